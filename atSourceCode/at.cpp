@@ -13,17 +13,67 @@ typedef __int8 int8_t;
 typedef __int16 int16_t;
 typedef __int32 int32_t;
 typedef __int64 int64_t;
+typedef unsigned __int8 uint8_t;
+typedef unsigned __int16 uint16_t;
+typedef unsigned __int32 uint32_t;
+typedef unsigned __int64 uint64_t;
 #  endif
 #endif
 
+#if defined( __x86_64__ ) && defined( __linux__ ) && !defined( AT_NO_JIT )
+#  define AT_JIT
+#  include <sys/mman.h>
+#endif
+
+#if ( defined( __unix__ ) || defined( __APPLE__ ) ) && !defined( AT_NO_AOT )
+#  define AT_AOT
+#  include <dlfcn.h>
+#  include <errno.h>
+#  include <unistd.h>
+#  include <sys/stat.h>
+#  include <sys/wait.h>
+#endif
+
+#if ( defined( __unix__ ) || defined( __APPLE__ ) ) && !defined( AT_NO_THREADS )
+#  define AT_THREADS
+#  include <unistd.h>
+#  include <pthread.h>
+#  include <sys/time.h>
+#endif
+
+#if ( defined( __unix__ ) || defined( __APPLE__ ) ) && !defined( AT_NO_STORE )
+#  define AT_STORE
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
+
+#ifndef AT_NO_TRACE
+#  define AT_TRACE
+#  ifdef _MSC_VER
+#     define AT_THREAD_LOCAL __declspec( thread )
+#  else
+#     define AT_THREAD_LOCAL __thread
+#  endif
+#endif
+
+#ifdef _MSC_VER
+#  include <intrin.h>
+#endif
+
 #include <map>
 #include <set>
 #include <deque>
+#include <ctime>
 #include <memory>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <limits>
 #include <fstream>
 #include <iomanip>
+#include <iterator>
 #include <sstream>
 #include <iostream>
 #include <stdexcept>
@@ -54,6 +104,16 @@ typedef __int64 int64_t;
 2
 1
 0
+
+(sleep address outside of data)
+> code 254000000028
+> run
+error: overflow
+
+(modulo by zero)
+> code 0100000000050000000000000016000000000300000028
+> run
+error: invalid code
 */
 
 using namespace std;
@@ -64,25 +124,10 @@ const int32_t c_data_page_bytes = 512;
 const int32_t c_call_stack_page_bytes = 256;
 const int32_t c_user_stack_page_bytes = 256;
 
-int32_t g_code_pages = 1;
-int32_t g_data_pages = 1;
-
-int32_t g_call_stack_pages = 1;
-int32_t g_user_stack_pages = 1;
-
 const int64_t c_default_balance = 100;
 
 const int32_t c_max_to_multiply = 0x1fffffff;
 
-int64_t g_val = 0;
-int64_t g_val1 = 0;
-
-int64_t g_balance = c_default_balance;
-
-bool g_first_call = true;
-
-int32_t g_increment_func = 0;
-
 enum op_code
 {
    e_op_code_NOP = 0x7f,
@@ -135,11 +180,186 @@ enum op_code
    e_op_code_EXT_FUN_RET_DAT_2 = 0x37,
 };
 
+// NOTE: A minimal SHA-256 (used for content hashes of code and data).
+struct sha256
+{
+   sha256( )
+   {
+      static const uint32_t c_init[ 8 ] =
+      {
+         0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+      };
+
+      memcpy( h, c_init, sizeof( h ) );
+
+      length = 0;
+      buffered = 0;
+   }
+
+   void update( const void* p_data, size_t size )
+   {
+      const uint8_t* p_bytes = ( const uint8_t* )p_data;
+
+      length += size;
+
+      while( size )
+      {
+         size_t num = 64 - buffered;
+         if( num > size )
+            num = size;
+
+         memcpy( buffer + buffered, p_bytes, num );
+
+         buffered += num;
+         p_bytes += num;
+         size -= num;
+
+         if( buffered == 64 )
+         {
+            process( buffer );
+            buffered = 0;
+         }
+      }
+   }
+
+   void finish( uint8_t digest[ 32 ] )
+   {
+      uint64_t bits = length * 8;
+
+      uint8_t pad = 0x80;
+      update( &pad, 1 );
+
+      pad = 0;
+      while( buffered != 56 )
+         update( &pad, 1 );
+
+      uint8_t len[ 8 ];
+      for( int i = 0; i < 8; i++ )
+         len[ i ] = ( uint8_t )( bits >> ( 56 - i * 8 ) );
+
+      update( len, 8 );
+
+      for( int i = 0; i < 32; i++ )
+         digest[ i ] = ( uint8_t )( h[ i / 4 ] >> ( 24 - ( i % 4 ) * 8 ) );
+   }
+
+   string hex_digest( )
+   {
+      uint8_t digest[ 32 ];
+      finish( digest );
+
+      ostringstream osstr;
+      for( int i = 0; i < 32; i++ )
+         osstr << hex << setw( 2 ) << setfill( '0' ) << ( int )digest[ i ];
+
+      return osstr.str( );
+   }
+
+   private:
+   void process( const uint8_t* p_block )
+   {
+      static const uint32_t c_k[ 64 ] =
+      {
+         0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+         0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+         0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+         0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+         0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+         0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+         0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+         0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+      };
+
+      uint32_t w[ 64 ];
+
+      for( int i = 0; i < 16; i++ )
+         w[ i ] = ( ( uint32_t )p_block[ i * 4 ] << 24 ) | ( ( uint32_t )p_block[ i * 4 + 1 ] << 16 )
+          | ( ( uint32_t )p_block[ i * 4 + 2 ] << 8 ) | ( uint32_t )p_block[ i * 4 + 3 ];
+
+      for( int i = 16; i < 64; i++ )
+      {
+         uint32_t s0 = rotr( w[ i - 15 ], 7 ) ^ rotr( w[ i - 15 ], 18 ) ^ ( w[ i - 15 ] >> 3 );
+         uint32_t s1 = rotr( w[ i - 2 ], 17 ) ^ rotr( w[ i - 2 ], 19 ) ^ ( w[ i - 2 ] >> 10 );
+
+         w[ i ] = w[ i - 16 ] + s0 + w[ i - 7 ] + s1;
+      }
+
+      uint32_t a = h[ 0 ], b = h[ 1 ], c = h[ 2 ], d = h[ 3 ];
+      uint32_t e = h[ 4 ], f = h[ 5 ], g = h[ 6 ], hh = h[ 7 ];
+
+      for( int i = 0; i < 64; i++ )
+      {
+         uint32_t t1 = hh + ( rotr( e, 6 ) ^ rotr( e, 11 ) ^ rotr( e, 25 ) ) + ( ( e & f ) ^ ( ~e & g ) ) + c_k[ i ] + w[ i ];
+         uint32_t t2 = ( rotr( a, 2 ) ^ rotr( a, 13 ) ^ rotr( a, 22 ) ) + ( ( a & b ) ^ ( a & c ) ^ ( b & c ) );
+
+         hh = g;
+         g = f;
+         f = e;
+         e = d + t1;
+         d = c;
+         c = b;
+         b = a;
+         a = t1 + t2;
+      }
+
+      h[ 0 ] += a;
+      h[ 1 ] += b;
+      h[ 2 ] += c;
+      h[ 3 ] += d;
+      h[ 4 ] += e;
+      h[ 5 ] += f;
+      h[ 6 ] += g;
+      h[ 7 ] += hh;
+   }
+
+   static uint32_t rotr( uint32_t x, int n )
+   {
+      return ( x >> n ) | ( x << ( 32 - n ) );
+   }
+
+   uint32_t h[ 8 ];
+
+   uint64_t length;
+
+   uint8_t buffer[ 64 ];
+   size_t buffered;
+};
+
+// NOTE: One bit for each code byte that is a valid jump destination (i.e. the start of an op).
+struct jump_map
+{
+   jump_map( )
+   {
+      size = 0;
+   }
+
+   void reset( int32_t csize )
+   {
+      size = csize > 0 ? csize : 0;
+      bits.assign( ( size + 63 ) / 64, 0 );
+   }
+
+   void set( int32_t pc )
+   {
+      bits[ pc >> 6 ] |= ( uint64_t )1 << ( pc & 63 );
+   }
+
+   bool test( int32_t pc ) const
+   {
+      return ( uint32_t )pc < ( uint32_t )size && ( ( bits[ pc >> 6 ] >> ( pc & 63 ) ) & 1 );
+   }
+
+   int32_t size;
+   vector< uint64_t > bits;
+};
+
 struct machine_state
 {
    machine_state( )
    {
       pce = pcs = 0;
+      p_jumps = 0;
+
       reset( );
    }
 
@@ -163,10 +383,10 @@ struct machine_state
       b3 = 0;
       b4 = 0;
 
-      jumps.clear( );
-
       stopped = false;
       finished = false;
+
+      sleep_until = 0;
    }
 
    bool stopped; // transient
@@ -193,9 +413,104 @@ struct machine_state
 
    int32_t steps;
 
-   int32_t sleep_until;
+   int32_t sleep_until; // block height from which execution can continue
+
+   const jump_map* p_jumps; // transient (shared by all states for the same code)
+};
+
+struct decoded_op
+{
+   decoded_op( )
+   {
+      op = 0;
+      rc = 0;
+      kind = 0;
+      flags = 0;
+      dispatch = 0;
+
+      fun = 0;
+
+      pc = 0;
+      size = 0;
+
+      block_left = 1;
+
+      fused = 0;
+
+      next = -1;
+      dest = -1;
+      target = -1;
+
+      addr1 = 0;
+      addr2 = 0;
+      addr3 = 0;
+
+      val = 0;
+   }
+
+   int8_t op;
+   int8_t rc; // result of operand validation (0 if the operands are valid)
+   int8_t kind;
+   int8_t flags; // verify flags (see "verify_code")
+   int8_t dispatch; // kind that is dispatched (which is either the kind or a fused kind)
+
+   int16_t fun;
+
+   int32_t pc;
+   int32_t size;
+
+   int32_t block_left; // number of ops from this one to the end of its basic block
+
+   int32_t fused; // number of ops executed by a fused op (or zero if not fused)
+
+   int32_t next; // index of the op at pc + size (or -1)
+   int32_t dest; // code address for jumps and branches (or -1)
+   int32_t target; // index of the op at dest (or -1)
+
+   int32_t addr1;
+   int32_t addr2;
+   int32_t addr3;
+
+   int64_t val;
+};
+
+struct decoded_code
+{
+   decoded_code( )
+   {
+      csize = 0;
+      dsize = 0;
+
+      cssize = 0;
+      ussize = 0;
+
+      version = 0;
+   }
+
+   // NOTE: Returns true if this was decoded from the same code (and for the same memory geometry)
+   // so doesn't need to be decoded again.
+   bool is_decoded_from( const int8_t* p_code, int32_t code_size,
+    int32_t data_size, int32_t call_stack_size, int32_t user_stack_size ) const
+   {
+      return version && csize == code_size && dsize == data_size
+       && cssize == call_stack_size && ussize == user_stack_size
+       && ( !csize || memcmp( &bytes[ 0 ], p_code, csize ) == 0 );
+   }
+
+   int32_t csize;
+   int32_t dsize;
 
-   set< int32_t > jumps; // transient
+   int32_t cssize;
+   int32_t ussize;
+
+   int64_t version; // changes whenever the code is decoded
+
+   vector< int8_t > bytes; // the code that was decoded
+
+   vector< decoded_op > ops;
+   vector< int32_t > index; // op index for each code byte (-1 if not the start of an op)
+
+   jump_map jumps;
 };
 
 struct function_data
@@ -212,1867 +527,8368 @@ struct function_data
    vector< int64_t > data;
 };
 
-string decode_function_name( int16_t fun, int8_t op )
+// NOTE: Flags kept for each data page of an AT.
+enum page_flag
 {
-   ostringstream osstr;
+   e_page_flag_unhashed = 1, // changed since the state hash was last updated
+   e_page_flag_written = 2, // written since the AT was last reset (otherwise it is all zeroes)
+   e_page_flag_all = 3
+};
 
-   int8_t op_expected = 0;
-
-   switch( fun )
-   {
-      case 0x0100:
-      osstr << "Get_A1";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0101:
-      osstr << "Get_A2";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0102:
-      osstr << "Get_A3";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0103:
-      osstr << "Get_A4";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0104:
-      osstr << "Get_B1";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0105:
-      osstr << "Get_B2";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0106:
-      osstr << "Get_B3";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0107:
-      osstr << "Get_B4";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0110:
-      osstr << "Set_A1";
-      op_expected = e_op_code_EXT_FUN_DAT;
-      break;
-
-      case 0x0111:
-      osstr << "Set_A2";
-      op_expected = e_op_code_EXT_FUN_DAT;
-      break;
-
-      case 0x0112:
-      osstr << "Set_A3";
-      op_expected = e_op_code_EXT_FUN_DAT;
-      break;
-
-      case 0x0113:
-      osstr << "Set_A4";
-      op_expected = e_op_code_EXT_FUN_DAT;
-      break;
-
-      case 0x0114:
-      osstr << "Set_A1_A2";
-      op_expected = e_op_code_EXT_FUN_DAT_2;
-      break;
-
-      case 0x0115:
-      osstr << "Set_A3_A4";
-      op_expected = e_op_code_EXT_FUN_DAT_2;
-      break;
-
-      case 0x0116:
-      osstr << "Set_B1";
-      op_expected = e_op_code_EXT_FUN_DAT;
-      break;
-
-      case 0x0117:
-      osstr << "Set_B2";
-      op_expected = e_op_code_EXT_FUN_DAT;
-      break;
-
-      case 0x0118:
-      osstr << "Set_B3";
-      op_expected = e_op_code_EXT_FUN_DAT;
-      break;
-
-      case 0x0119:
-      osstr << "Set_B4";
-      op_expected = e_op_code_EXT_FUN_DAT;
-      break;
-
-      case 0x011a:
-      osstr << "Set_B1_B2";
-      op_expected = e_op_code_EXT_FUN_DAT_2;
-      break;
-
-      case 0x011b:
-      osstr << "Set_B3_B4";
-      op_expected = e_op_code_EXT_FUN_DAT_2;
-      break;
-
-      case 0x0120:
-      osstr << "Clear_A";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x0121:
-      osstr << "Clear_B";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x0122:
-      osstr << "Clear_A_And_B";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x0123:
-      osstr << "Copy_A_From_B";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x0124:
-      osstr << "Copy_B_From_A";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x0125:
-      osstr << "Check_A_Is_Zero";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0126:
-      osstr << "Check_B_Is_Zero";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0127:
-      osstr << "Check_A_Equals_B";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0128:
-      osstr << "Swap_A_and_B";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x0129:
-      osstr << "OR_A_with_B";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x012a:
-      osstr << "OR_B_with_A";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x012b:
-      osstr << "AND_A_with_B";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x012c:
-      osstr << "AND_B_with_A";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x012d:
-      osstr << "XOR_A_with_B";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x012e:
-      osstr << "XOR_B_with_A";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x0200:
-      osstr << "MD5_A_To_B";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x0201:
-      osstr << "Check_MD5_A_With_B";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0202:
-      osstr << "HASH160_A_To_B";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x0203:
-      osstr << "Check_HASH160_A_With_B";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0204:
-      osstr << "SHA256_A_To_B";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x0205:
-      osstr << "Check_SHA256_A_With_B";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0300:
-      osstr << "Get_Block_Timestamp";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0301:
-      osstr << "Get_Creation_Timestamp";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0302:
-      osstr << "Get_Last_Block_Timestamp";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0303:
-      osstr << "Put_Last_Block_Hash_In_A";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x0304:
-      osstr << "A_To_Tx_After_Timestamp";
-      op_expected = e_op_code_EXT_FUN_DAT;
-      break;
-
-      case 0x0305:
-      osstr << "Get_Type_For_Tx_In_A";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0306:
-      osstr << "Get_Amount_For_Tx_In_A";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0307:
-      osstr << "Get_Timestamp_For_Tx_In_A";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0308:
-      osstr << "Get_Random_Id_For_Tx_In_A";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0309:
-      osstr << "Message_From_Tx_In_A_To_B";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x030a:
-      osstr << "B_To_Address_Of_Tx_In_A";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x030b:
-      osstr << "B_To_Address_Of_Creator";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x0400:
-      osstr << "Get_Current_Balance";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0401:
-      osstr << "Get_Previous_Balance";
-      op_expected = e_op_code_EXT_FUN_RET;
-      break;
-
-      case 0x0402:
-      osstr << "Send_To_Address_In_B";
-      op_expected = e_op_code_EXT_FUN_DAT;
-      break;
-
-      case 0x0403:
-      osstr << "Send_All_To_Address_In_B";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x0404:
-      osstr << "Send_Old_To_Address_In_B";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x0405:
-      osstr << "Send_A_To_Address_In_B";
-      op_expected = e_op_code_EXT_FUN;
-      break;
-
-      case 0x0406:
-      osstr << "Add_Minutes_To_Timestamp";
-      op_expected = e_op_code_EXT_FUN_RET_DAT_2;
-      break;
+// NOTE: A Merkle tree for the state hash of an AT. The leaves are the hashes of each data page (of
+// "c_data_page_bytes" with the stacks included) followed by the hash of the serialized machine state
+// (pc, cs, us, pce, pcs, sleep_until, A and B all as little-endian values). Each parent is the hash
+// of its two children (or just its only child where there is no right sibling). Only the leaves for
+// the pages that are marked as dirty (and the machine state leaf) are rehashed when updated along
+// with their ancestors so an update costs O(dirty pages * log pages).
+struct state_hash_tree
+{
+   struct digest
+   {
+      uint8_t bytes[ 32 ];
+   };
 
-      default:
-      osstr << "0x" << hex << setw( 4 ) << setfill( '0' ) << fun;
+   state_hash_tree( )
+   {
+      num_hashed = 0;
    }
 
-   if( op && op_expected && op != op_expected )
-      osstr << " *** invalid op ***";
+   void update( const int8_t* p_data, size_t size,
+    uint8_t* p_dirty_pages, size_t num_pages, const machine_state& state );
 
-   return osstr.str( );
-}
+   string hex_root( ) const;
+
+   vector< vector< digest > > levels; // the leaves first and the root last
 
-map< int32_t, function_data > g_function_data;
+   size_t num_hashed; // the number of nodes hashed by the last update
+};
+
+void put_le( uint8_t*& p_bytes, uint64_t value, size_t size )
+{
+   for( size_t i = 0; i < size; i++ )
+      *p_bytes++ = ( uint8_t )( value >> ( i * 8 ) );
+}
 
-int64_t get_function_data( int32_t func_num )
+void state_hash_tree::update( const int8_t* p_data, size_t size,
+ uint8_t* p_dirty_pages, size_t num_pages, const machine_state& state )
 {
-   if( func_num == g_increment_func )
+   if( levels.empty( ) || levels[ 0 ].size( ) != num_pages + 1 )
    {
-      if( g_first_call )
-         g_first_call = false;
-      else
+      levels.clear( );
+
+      for( size_t num = num_pages + 1; ; num = ( num + 1 ) / 2 )
       {
-         for( map< int32_t, function_data >::iterator i = g_function_data.begin( ); i != g_function_data.end( ); ++i )
-         {
-            if( ++( i->second.offset ) >= i->second.data.size( ) )
-            {
-               if( i->second.loop )
-                  i->second.offset = 0;
-               else
-                  --( i->second.offset );
-            }
-         }
+         levels.push_back( vector< digest >( num ) );
+
+         if( num == 1 )
+            break;
       }
-   }
 
-   int64_t rc = g_function_data[ func_num ].data[ g_function_data[ func_num ].offset ];
+      for( size_t i = 0; i < num_pages; i++ )
+         p_dirty_pages[ i ] |= e_page_flag_unhashed;
+   }
 
-   return rc;
-}
+   num_hashed = 0;
 
-int64_t func( int32_t func_num, machine_state& state )
-{
-   int64_t rc = 0;
+   vector< size_t > changed;
 
-   if( func_num == 1 )
-      rc = g_val;
-   else if( func_num == 2 ) // get a value
+   for( size_t i = 0; i < num_pages; i++ )
    {
-      if( g_val == 9 )
-         rc = g_val = 0;
-      else
-         rc = ++g_val;
+      if( !( p_dirty_pages[ i ] & e_page_flag_unhashed ) )
+         continue;
+
+      size_t offset = i * c_data_page_bytes;
+
+      sha256 hash;
+      hash.update( p_data + offset, min( size - offset, ( size_t )c_data_page_bytes ) );
+      hash.finish( levels[ 0 ][ i ].bytes );
+
+      p_dirty_pages[ i ] &= ~e_page_flag_unhashed;
+      changed.push_back( i );
    }
-   else if( func_num == 3 ) // get size
-      rc = 10;
-   else if( func_num == 4 ) // get func num
-      rc = func_num;
-   else if( func_num == 25 || func_num == 32 ) // get balance (prior)
+
+   uint8_t buffer[ 6 * sizeof( int32_t ) + 8 * sizeof( int64_t ) ];
+   uint8_t* p_bytes = buffer;
+
+   put_le( p_bytes, ( uint32_t )state.pc, sizeof( int32_t ) );
+   put_le( p_bytes, ( uint32_t )state.cs, sizeof( int32_t ) );
+   put_le( p_bytes, ( uint32_t )state.us, sizeof( int32_t ) );
+   put_le( p_bytes, ( uint32_t )state.pce, sizeof( int32_t ) );
+   put_le( p_bytes, ( uint32_t )state.pcs, sizeof( int32_t ) );
+   put_le( p_bytes, ( uint32_t )state.sleep_until, sizeof( int32_t ) );
+
+   put_le( p_bytes, state.a1, sizeof( int64_t ) );
+   put_le( p_bytes, state.a2, sizeof( int64_t ) );
+   put_le( p_bytes, state.a3, sizeof( int64_t ) );
+   put_le( p_bytes, state.a4, sizeof( int64_t ) );
+
+   put_le( p_bytes, state.b1, sizeof( int64_t ) );
+   put_le( p_bytes, state.b2, sizeof( int64_t ) );
+   put_le( p_bytes, state.b3, sizeof( int64_t ) );
+   put_le( p_bytes, state.b4, sizeof( int64_t ) );
+
+   sha256 hash;
+   hash.update( buffer, sizeof( buffer ) );
+   hash.finish( levels[ 0 ][ num_pages ].bytes );
+
+   changed.push_back( num_pages );
+
+   num_hashed += changed.size( );
+
+   for( size_t level = 1; level < levels.size( ); level++ )
    {
-      rc = g_balance;
-      if( g_function_data.count( func_num ) )
+      const vector< digest >& children( levels[ level - 1 ] );
+
+      size_t num_parents = 0;
+
+      for( size_t i = 0; i < changed.size( ); i++ )
       {
-         cout << "(resetting function data)\n";
-         g_first_call = true;
-         for( map< int32_t, function_data >::iterator i = g_function_data.begin( ); i != g_function_data.end( ); ++i )
-            i->second.offset = 0;
+         size_t parent = changed[ i ] / 2;
+
+         if( num_parents && changed[ num_parents - 1 ] == parent )
+            continue;
+
+         changed[ num_parents++ ] = parent;
+
+         if( parent * 2 + 1 < children.size( ) )
+         {
+            sha256 hash;
+            hash.update( children[ parent * 2 ].bytes, sizeof( digest ) );
+            hash.update( children[ parent * 2 + 1 ].bytes, sizeof( digest ) );
+            hash.finish( levels[ level ][ parent ].bytes );
+
+            ++num_hashed;
+         }
+         else
+            levels[ level ][ parent ] = children[ parent * 2 ];
       }
+
+      changed.resize( num_parents );
    }
-   else if( func_num == 0x0100 ) // Get_A1
-      rc = state.a1;
-   else if( func_num == 0x0101 ) // Get_A2
-      rc = state.a2;
-   else if( func_num == 0x0102 ) // Get_A3
-      rc = state.a3;
-   else if( func_num == 0x0103 ) // Get_A4
-      rc = state.a4;
-   else if( func_num == 0x0104 ) // Get_B1
-      rc = state.b1;
-   else if( func_num == 0x0105 ) // Get_B2
-      rc = state.b2;
-   else if( func_num == 0x0106 ) // Get_B3
-      rc = state.b3;
-   else if( func_num == 0x0107 ) // Get_B4
-      rc = state.b4;
-   else if( func_num == 0x0120 ) // Clear_A
-   {
-      state.a1 = 0;
-      state.a2 = 0;
-      state.a3 = 0;
-      state.a4 = 0;
-   }
-   else if( func_num == 0x0121 ) // Clear_B
-   {
-      state.b1 = 0;
-      state.b2 = 0;
-      state.b3 = 0;
-      state.b4 = 0;
-   }
-   else if( func_num == 0x0122 ) // Clear_A_And_B
-   {
-      state.a1 = state.b1 = 0;
-      state.a2 = state.b2 = 0;
-      state.a3 = state.b3 = 0;
-      state.a4 = state.b4 = 0;
-   }
-   else if( func_num == 0x0123 ) // Copy_A_From_B
-   {
-      state.a1 = state.b1;
-      state.a2 = state.b2;
-      state.a3 = state.b3;
-      state.a4 = state.b4;
-   }
-   else if( func_num == 0x0124 ) // Copy_B_From_A
-   {
-      state.b1 = state.a1;
-      state.b2 = state.a2;
-      state.b3 = state.a3;
-      state.b4 = state.a4;
-   }
-   else if( func_num == 0x0125 ) // Check_A_Is_Zero
-   {
-      if( state.a1 == 0 && state.a2 == 0 && state.a3 == 0 && state.a4 == 0 )
-         rc = true;
-   }
-   else if( func_num == 0x0126 ) // Check_B_Is_Zero
-   {
-      if( state.b1 == 0 && state.b2 == 0 && state.b3 == 0 && state.b4 == 0 )
-         rc = true;
-   }
-   else if( func_num == 0x0127 ) // Check_A_Equals_B
-   {
-      if( state.a1 == state.b1 && state.a2 == state.b2 && state.a3 == state.b3 && state.a4 == state.b4 )
-         rc = true;
-   }
-   else if( func_num == 0x0128 ) // Swap_A_and_B
-   {
-      int64_t tmp_a1 = state.a1;
-      int64_t tmp_a2 = state.a2;
-      int64_t tmp_a3 = state.a3;
-      int64_t tmp_a4 = state.a4;
+}
 
-      state.a1 = state.b1;
-      state.a2 = state.b2;
-      state.a3 = state.b3;
-      state.a4 = state.b4;
+string state_hash_tree::hex_root( ) const
+{
+   ostringstream osstr;
 
-      state.b1 = tmp_a1;
-      state.b2 = tmp_a2;
-      state.b3 = tmp_a3;
-      state.b4 = tmp_a4;
-   }
-   else if( func_num == 0x0129 ) // OR_A_with_B
-   {
-      state.a1 = state.a1 | state.b1;
-      state.a2 = state.a2 | state.b2;
-      state.a3 = state.a3 | state.b3;
-      state.a4 = state.a4 | state.b4;
-   }
-   else if( func_num == 0x012a ) // OR_B_with_A
-   {
-      state.b1 = state.a1 | state.b1;
-      state.b2 = state.a2 | state.b2;
-      state.b3 = state.a3 | state.b3;
-      state.b4 = state.a4 | state.b4;
-   }
-   else if( func_num == 0x012b ) // AND_A_with_B
-   {
-      state.a1 = state.a1 & state.b1;
-      state.a2 = state.a2 & state.b2;
-      state.a3 = state.a3 & state.b3;
-      state.a4 = state.a4 & state.b4;
-   }
-   else if( func_num == 0x012c ) // AND_B_with_A
+   if( !levels.empty( ) )
    {
-      state.b1 = state.a1 & state.b1;
-      state.b2 = state.a2 & state.b2;
-      state.b3 = state.a3 & state.b3;
-      state.b4 = state.a4 & state.b4;
+      for( size_t i = 0; i < sizeof( digest ); i++ )
+         osstr << hex << setw( 2 ) << setfill( '0' ) << ( int )levels.back( )[ 0 ].bytes[ i ];
    }
-   else if( func_num == 0x012d ) // XOR_A_with_B
-   {
-      state.a1 = state.a1 ^ state.b1;
-      state.a2 = state.a2 ^ state.b2;
-      state.a3 = state.a3 ^ state.b3;
-      state.a4 = state.a4 ^ state.b4;
-   }
-   else if( func_num == 0x012e ) // XOR_B_with_A
-   {
-      state.b1 = state.a1 ^ state.b1;
-      state.b2 = state.a2 ^ state.b2;
-      state.b3 = state.a3 ^ state.b3;
-      state.b4 = state.a4 ^ state.b4;
-   }
-   else if( g_function_data.count( func_num ) )
-      rc = get_function_data( func_num );
 
-   if( func_num != 2 )
-   {
-      if( func_num < 0x100 )
-         cout << "func: " << dec << func_num << " rc: " << hex << setw( 16 ) << setfill( '0' ) << rc << '\n';
-      else
-         cout << "func: " << decode_function_name( func_num, 0 )
-          << " rc: 0x" << hex << setw( 16 ) << setfill( '0' ) << rc << '\n';
-   }
+   return osstr.str( );
+}
 
-   return rc;
+template< typename T > inline bool atomic_compare_and_swap( T* volatile* pp, T* p_old, T* p_new )
+{
+#ifdef _MSC_VER
+   return _InterlockedCompareExchangePointer( ( void* volatile* )pp, p_new, p_old ) == p_old;
+#else
+   return __sync_bool_compare_and_swap( pp, p_old, p_new );
+#endif
 }
 
-int64_t func1( int32_t func_num, machine_state& state, int64_t value, int8_t* p_data = 0, int32_t dsize = 0 )
-{
-   int64_t rc = 0;
-
-   if( func_num == 1 ) // echo
-      cout << dec << value << '\n';
-   else if( func_num == 2 )
-      rc = value * 2; // double it
-   else if( func_num == 3 )
-      rc = value / 2; // halve it
-   else if( func_num == 26 || func_num == 33 ) // pay balance (prior)
-   {
-      cout << "payout " << dec << g_balance << " to account: " << value << '\n';
-      g_balance = 0;
-   }
-   else if( func_num == 0x0110 ) // Set_A1
-      state.a1 = value;
-   else if( func_num == 0x0111 ) // Set_A2
-      state.a2 = value;
-   else if( func_num == 0x0112 ) // Set_A3
-      state.a3 = value;
-   else if( func_num == 0x0113 ) // Set_A4
-      state.a4 = value;
-   else if( func_num == 0x0116 ) // Set_B1
-      state.b1 = value;
-   else if( func_num == 0x0117 ) // Set_B2
-      state.b2 = value;
-   else if( func_num == 0x0118 ) // Set_B3
-      state.b3 = value;
-   else if( func_num == 0x0119 ) // Set_B4
-      state.b4 = value;
-   else if( g_function_data.count( func_num ) )
-      rc = get_function_data( func_num );
-
-   if( func_num != 1 && func_num != 26 )
-   {
-      if( func_num < 0x100 )
-         cout << "func1: " << dec << func_num << " with " << value
-          << " rc: " << hex << setw( 16 ) << setfill( '0' ) << rc << '\n';
-      else
-         cout << "func1: " << decode_function_name( func_num, 0 )
-          << " with " << value << " rc: 0x" << hex << setw( 16 ) << setfill( '0' ) << rc << '\n';
-   }
+template< typename T > inline T* atomic_exchange( T* volatile* pp, T* p_new )
+{
+#ifdef _MSC_VER
+   return ( T* )_InterlockedExchangePointer( ( void* volatile* )pp, p_new );
+#else
+   T* p_old;
 
-   return rc;
+   do
+      p_old = *pp;
+   while( !__sync_bool_compare_and_swap( pp, p_old, p_new ) );
+
+   return p_old;
+#endif
 }
 
-int64_t func2( int32_t func_num, machine_state& state, int64_t value1, int64_t value2, int8_t* p_data = 0, int32_t dsize = 0 )
+inline int32_t atomic_increment( int32_t volatile* p_value )
 {
-   int64_t rc = 0;
+#ifdef _MSC_VER
+   return _InterlockedIncrement( ( long volatile* )p_value );
+#else
+   return __sync_add_and_fetch( p_value, 1 );
+#endif
+}
 
-   if( func_num == 2 )
-      rc = value1 * value2; // multiply values
-   else if( func_num == 3 )
-      rc = value1 / value2; // divide values
-   else if( func_num == 4 )
-      rc = value1 + value2; // sum values
-   else if( func_num == 31 ) // send amount to address
-   {
-      if( value1 > g_balance )
-         value1 = g_balance;
+inline int64_t atomic_increment( int64_t volatile* p_value )
+{
+#ifdef _MSC_VER
+   return _InterlockedIncrement64( ( __int64 volatile* )p_value );
+#else
+   return __sync_add_and_fetch( p_value, 1 );
+#endif
+}
 
-      cout << "payout " << dec << value1 << " to account: " << hex << setw( 8 ) << setfill( '0' ) << value2 << '\n';
-      g_balance -= value1;
-   }
-   else if( func_num == 0x0114 ) // Set_A1_A2
+inline int32_t atomic_decrement( int32_t volatile* p_value )
+{
+#ifdef _MSC_VER
+   return _InterlockedDecrement( ( long volatile* )p_value );
+#else
+   return __sync_sub_and_fetch( p_value, 1 );
+#endif
+}
+
+const size_t c_cache_line_bytes = 64;
+const size_t c_pool_slab_bytes = 65536;
+
+// NOTE: A pool of fixed size (cache line aligned) blocks that are carved out of larger slabs. All
+// blocks can be released at once (such as at the end of a block) with the slabs then being reused
+// rather than freed. Any blocks that are deallocated after such a release are simply ignored. The
+// slabs are calloc'ed so a block that has never been handed out before is known to be all zeroes
+// (and its pages are not materialised by the OS until they are first touched).
+struct block_pool
+{
+   block_pool( size_t bytes )
+    :
+    p_free( 0 ),
+    slab( 0 ),
+    used( 0 ),
+    carved( 0 ),
+    generation( 0 )
    {
-      state.a1 = value1;
-      state.a2 = value2;
+      block_bytes = ( max( bytes, sizeof( int8_t* ) ) + c_cache_line_bytes - 1 ) & ~( c_cache_line_bytes - 1 );
+      blocks_per_slab = max( c_pool_slab_bytes / block_bytes, ( size_t )1 );
    }
-   else if( func_num == 0x0115 ) // Set_A3_A4
+
+   ~block_pool( )
    {
-      state.a3 = value1;
-      state.a4 = value2;
+      for( size_t i = 0; i < slabs.size( ); i++ )
+         free( slabs[ i ] );
    }
-   else if( func_num == 0x011a ) // Set_B1_B2
+
+   size_t get_block_bytes( ) const { return block_bytes; }
+   size_t get_generation( ) const { return generation; }
+
+   size_t num_slabs( ) const { return slabs.size( ); }
+
+   // NOTE: If "p_is_zeroed" is provided then it is set to whether the block is known to be all
+   // zeroes (i.e. it has never been handed out before).
+   int8_t* allocate( bool* p_is_zeroed = 0 )
    {
-      state.b1 = value1;
-      state.b2 = value2;
+      if( p_is_zeroed )
+         *p_is_zeroed = false;
+
+      if( p_free )
+      {
+         int8_t* p_block = p_free;
+         p_free = *( int8_t** )p_block;
+
+         return p_block;
+      }
+
+      if( used == blocks_per_slab )
+      {
+         ++slab;
+         used = 0;
+      }
+
+      if( slab == slabs.size( ) )
+      {
+         int8_t* p_slab = ( int8_t* )calloc( blocks_per_slab * block_bytes + c_cache_line_bytes - 1, 1 );
+
+         if( !p_slab )
+            throw bad_alloc( );
+
+         slabs.push_back( p_slab );
+      }
+
+      size_t start = ( size_t )slabs[ slab ];
+      start = ( start + c_cache_line_bytes - 1 ) & ~( c_cache_line_bytes - 1 );
+
+      if( slab * blocks_per_slab + used == carved )
+      {
+         ++carved;
+
+         if( p_is_zeroed )
+            *p_is_zeroed = true;
+      }
+
+      return ( int8_t* )start + block_bytes * used++;
    }
-   else if( func_num == 0x011b ) // Set_B3_B4
+
+   void deallocate( int8_t* p_block, size_t block_generation )
    {
-      state.b3 = value1;
-      state.b4 = value2;
+      if( block_generation == generation )
+      {
+         *( int8_t** )p_block = p_free;
+         p_free = p_block;
+      }
    }
-   else if( g_function_data.count( func_num ) )
-      rc = get_function_data( func_num );
 
-   if( func_num != 31 )
+   void release_all( )
    {
-      if( func_num < 0x100 )
-         cout << "func2: " << dec << func_num << " with " << value1
-          << " and " << value2 << " rc: " << hex << setw( 16 ) << setfill( '0' ) << rc << '\n';
-      else
-         cout << "func2: " << decode_function_name( func_num, 0 ) << " with " << value1
-          << " and " << value2 << " rc: 0x" << hex << setw( 16 ) << setfill( '0' ) << rc << '\n';
+      p_free = 0;
+
+      slab = 0;
+      used = 0;
+
+      ++generation;
    }
 
-   return rc;
-}
+   private:
+   block_pool( const block_pool& );
+   block_pool& operator =( const block_pool& );
 
-int get_fun( int8_t* p_code, int32_t csize, const machine_state& state, int16_t& fun )
+   size_t block_bytes;
+   size_t blocks_per_slab;
+
+   vector< int8_t* > slabs;
+
+   int8_t* p_free;
+
+   size_t slab;
+   size_t used;
+
+   size_t carved; // number of blocks that have ever been handed out from the slabs
+
+   size_t generation;
+};
+
+// NOTE: Block pools for each size of AT code, data and page flags (i.e. each memory geometry) used so
+// that creating (and destroying) ATs doesn't need to use the heap (these are not thread safe so ATs
+// need to be created on a single thread).
+struct at_memory_pools
 {
-   if( state.pc + ( int32_t )sizeof( int16_t ) >= csize )
-      return -1;
-   else
+   at_memory_pools( )
    {
-      fun = *( int16_t* )( p_code + state.pc + 1 );
+   }
 
-      return 0;
+   ~at_memory_pools( )
+   {
+      for( map< size_t, block_pool* >::iterator i = pools.begin( ); i != pools.end( ); ++i )
+         delete i->second;
    }
-}
 
-int get_addr( int8_t* p_code,
- int32_t csize, int32_t dsize, const machine_state& state, int32_t& addr, bool is_code = false )
-{
-   if( state.pc + ( int32_t )sizeof( int32_t ) >= csize )
-      return -1;
-   else
+   block_pool& get( size_t bytes )
    {
-      addr = *( int32_t* )( p_code + state.pc + 1 );
+      bytes = ( bytes + c_cache_line_bytes - 1 ) & ~( c_cache_line_bytes - 1 );
 
-      if( addr < 0 || addr > c_max_to_multiply || ( is_code && addr >= csize ) )
-         return -1;
-      else if( !is_code && ( ( addr * 8 ) < 0 || ( addr * 8 ) + ( int32_t )sizeof( int64_t ) > dsize ) )
-         return -1;
-      else
-         return 0;
+      map< size_t, block_pool* >::iterator i = pools.find( bytes );
+
+      if( i == pools.end( ) )
+         i = pools.insert( make_pair( bytes, new block_pool( bytes ) ) ).first;
+
+      return *i->second;
    }
-}
 
-int get_addrs( int8_t* p_code,
- int32_t csize, int32_t dsize, const machine_state& state, int32_t& addr1, int32_t& addr2 )
-{
-   if( state.pc + ( int32_t )sizeof( int32_t ) + ( int32_t )sizeof( int32_t ) >= csize )
-      return -1;
-   else
+   // NOTE: Releases the blocks of all the pools (so any ATs that were using them must no longer be
+   // used, although they can still be safely destroyed).
+   void release_all( )
    {
-      addr1 = *( int32_t* )( p_code + state.pc + 1 );
-      addr2 = *( int32_t* )( p_code + state.pc + 1 + sizeof( int32_t ) );
-
-      if( addr1 < 0 || addr1 > c_max_to_multiply
-       || addr2 < 0 || addr2 > c_max_to_multiply
-       || ( addr1 * 8 ) < 0 || ( addr2 * 8 ) < 0
-       || ( addr1 * 8 ) + ( int32_t )sizeof( int64_t ) > dsize
-       || ( addr2 * 8 ) + ( int32_t )sizeof( int64_t ) > dsize )
-         return -1;
-      else
-         return 0;
+      for( map< size_t, block_pool* >::iterator i = pools.begin( ); i != pools.end( ); ++i )
+         i->second->release_all( );
    }
-}
 
-int get_addr_off( int8_t* p_code,
- int32_t csize, int32_t dsize, const machine_state& state, int32_t& addr, int8_t& off )
-{
-   if( state.pc + ( int32_t )sizeof( int32_t ) + ( int32_t )sizeof( int8_t ) >= csize )
-      return -1;
-   else
+   size_t num_slabs( ) const
    {
-      addr = *( int32_t* )( p_code + state.pc + 1 );
-      off = *( int8_t* )( p_code + state.pc + 1 + sizeof( int32_t ) );
+      size_t total = 0;
 
-      if( addr < 0 || addr > c_max_to_multiply || ( addr * 8 ) < 0
-       || ( addr * 8 ) + ( int32_t )sizeof( int64_t ) > dsize || state.pc + off >= csize )
-         return -1;
-      else
-         return 0;
+      for( map< size_t, block_pool* >::const_iterator i = pools.begin( ); i != pools.end( ); ++i )
+         total += i->second->num_slabs( );
+
+      return total;
    }
-}
 
-int get_addrs_off( int8_t* p_code,
- int32_t csize, int32_t dsize, const machine_state& state, int32_t& addr1, int32_t& addr2, int8_t& off )
+   private:
+   at_memory_pools( const at_memory_pools& );
+   at_memory_pools& operator =( const at_memory_pools& );
+
+   map< size_t, block_pool* > pools;
+};
+
+// NOTE: The code or data buffer of an AT which is either owned (having been allocated with calloc
+// or from a block pool) or borrowed (such as when the AT is attached to a record in an
+// "at_image_store").
+struct at_buffer
 {
-   if( state.pc + ( int32_t )sizeof( int32_t ) + ( int32_t )sizeof( int32_t ) + ( int32_t )sizeof( int8_t ) >= csize )
-      return -1;
-   else
+   at_buffer( )
+    :
+    p_bytes( 0 ),
+    owned( false ),
+    p_pool( 0 ),
+    generation( 0 )
    {
-      addr1 = *( int32_t* )( p_code + state.pc + 1 );
-      addr2 = *( int32_t* )( p_code + state.pc + 1 + sizeof( int32_t ) );
-      off = *( int8_t* )( p_code + state.pc + 1 + sizeof( int32_t ) + sizeof( int32_t ) );
+   }
 
-      if( addr1 < 0 || addr1 < c_max_to_multiply
-       || addr2 < 0 || addr2 < c_max_to_multiply
-       || ( addr1 * 8 ) < 0 || ( addr2 * 8 ) < 0
-       || ( addr1 * 8 ) + ( int32_t )sizeof( int64_t ) > dsize
-       || ( addr2 * 8 ) + ( int32_t )sizeof( int64_t ) > dsize || state.pc + off >= csize )
-         return -1;
-      else
-         return 0;
+   ~at_buffer( )
+   {
+      reset( );
    }
-}
 
-int get_fun_addr( int8_t* p_code,
- int32_t csize, int32_t dsize, const machine_state& state, int16_t& fun, int32_t& addr )
-{
-   if( state.pc + ( int32_t )sizeof( int16_t ) + ( int32_t )sizeof( int32_t ) >= csize )
-      return -1;
-   else
+   int8_t* get( ) const { return p_bytes; }
+
+   bool is_owned( ) const { return owned; }
+
+   void reset( int8_t* p_new_bytes = 0, bool owns = true )
    {
-      fun = *( int16_t* )( p_code + state.pc + 1 );
-      addr = *( int32_t* )( p_code + state.pc + 1 + sizeof( int16_t ) );
+      if( owned )
+      {
+         if( p_pool )
+            p_pool->deallocate( p_bytes, generation );
+         else
+            free( p_bytes );
+      }
 
-      if( addr < 0 || addr > c_max_to_multiply
-       || ( addr * 8 ) < 0 || ( addr * 8 ) + ( int32_t )sizeof( int64_t ) > dsize )
-         return -1;
-      else
-         return 0;
+      p_bytes = p_new_bytes;
+      owned = p_new_bytes && owns;
+
+      p_pool = 0;
    }
-}
 
-int get_fun_addrs( int8_t* p_code,
- int32_t csize, int32_t dsize, const machine_state& state, int16_t& fun, int32_t& addr1, int32_t& addr2 )
-{
-   if( state.pc + ( int32_t )sizeof( int16_t )
-    + ( int32_t )sizeof( int32_t ) + ( int32_t )sizeof( int32_t ) >= csize )
-      return -1;
-   else
+   // NOTE: Allocates an owned buffer (zeroed) which will be from a block pool if "p_pools" is set.
+   // If not then calloc is used so that large buffers get fresh pages from the OS which are only
+   // actually materialised when first written to (a pool block only needs to be cleared if it has
+   // been handed out before).
+   void allocate( size_t size, at_memory_pools* p_pools = 0 )
    {
-      fun = *( int16_t* )( p_code + state.pc + 1 );
-      addr1 = *( int32_t* )( p_code + state.pc + 1 + sizeof( int16_t ) );
-      addr2 = *( int32_t* )( p_code + state.pc + 1 + sizeof( int16_t ) + sizeof( int32_t ) );
+      if( !p_pools )
+      {
+         int8_t* p_new_bytes = ( int8_t* )calloc( max( size, ( size_t )1 ), 1 );
 
-      if( addr1 < 0 || addr1 > c_max_to_multiply
-       || addr2 < 0 || addr2 > c_max_to_multiply
-       || ( addr1 * 8 ) < 0 || ( addr2 * 8 ) < 0
-       || ( addr1 * 8 ) + ( int32_t )sizeof( int64_t ) > dsize
-       || ( addr2 * 8 ) + ( int32_t )sizeof( int64_t ) > dsize )
-         return -1;
+         if( !p_new_bytes )
+            throw bad_alloc( );
+
+         reset( p_new_bytes );
+      }
       else
-         return 0;
+      {
+         block_pool& pool( p_pools->get( size ) );
+
+         bool is_zeroed;
+         reset( pool.allocate( &is_zeroed ) );
+
+         p_pool = &pool;
+         generation = pool.get_generation( );
+
+         if( !is_zeroed )
+            memset( p_bytes, 0, size );
+      }
    }
-}
 
-int get_addr_val( int8_t* p_code,
- int32_t csize, int32_t dsize, const machine_state& state, int32_t& addr, int64_t& val )
+   private:
+   at_buffer( const at_buffer& );
+   at_buffer& operator =( const at_buffer& );
+
+   int8_t* p_bytes;
+
+   bool owned;
+
+   block_pool* p_pool;
+   size_t generation;
+};
+
+// NOTE: The flags (see "page_flag") for each data page of an AT which (like its code and data) are
+// allocated from a block pool if one is being used.
+struct page_flags
 {
-   if( state.pc + ( int32_t )sizeof( int32_t ) + ( int32_t )sizeof( int64_t ) >= csize )
-      return -1;
-   else
+   page_flags( )
+    :
+    num_pages( 0 )
    {
-      addr = *( int32_t* )( p_code + state.pc + 1 );
-      val = *( int64_t* )( p_code + state.pc + 1 + ( int32_t )sizeof( int32_t ) );
+   }
 
-      if( addr < 0 || addr > c_max_to_multiply
-       || ( addr * 8 ) < 0 || ( addr * 8 ) + ( int32_t )sizeof( int64_t ) > dsize )
-         return -1;
-      else
-         return 0;
+   size_t size( ) const { return num_pages; }
+
+   uint8_t& operator [ ]( size_t page ) { return ( ( uint8_t* )flags.get( ) )[ page ]; }
+   const uint8_t& operator [ ]( size_t page ) const { return ( ( const uint8_t* )flags.get( ) )[ page ]; }
+
+   void assign( size_t num, uint8_t flag, at_memory_pools* p_pools = 0 )
+   {
+      flags.allocate( num, p_pools );
+      num_pages = num;
+
+      fill( flag );
    }
-}
 
-int process_op( int8_t* p_code, int32_t csize, int8_t* p_data, int32_t dsize,
- int32_t cssize, int32_t ussize, bool disassemble, bool determine_jumps, machine_state& state )
-{
-   int rc = 0;
+   void fill( uint8_t flag )
+   {
+      memset( flags.get( ), flag, num_pages );
+   }
 
-   bool invalid = false;
-   bool had_overflow = false;
+   private:
+   page_flags( const page_flags& );
+   page_flags& operator =( const page_flags& );
 
-   if( csize < 1 || state.pc >= csize )
-      return 0;
+   at_buffer flags;
+
+   size_t num_pages;
+};
 
-   if( determine_jumps )
-      state.jumps.insert( state.pc );
+struct at_context;
 
-   int8_t op = p_code[ state.pc ];
+struct shared_code;
 
-   if( op && disassemble && !determine_jumps )
+void release_shared_code( shared_code* p_shared );
+
+struct at_tx
+{
+   at_tx( int64_t id, int64_t timestamp, int64_t amount )
+    :
+    id( id ),
+    timestamp( timestamp ),
+    amount( amount )
    {
-      cout << hex << setw( 8 ) << setfill( '0' ) << state.pc;
-      if( state.pc == state.opc )
-         cout << "* ";
-      else
-         cout << "  ";
    }
 
-   if( op == e_op_code_NOP )
+   int64_t id;
+   int64_t timestamp; // block height (high 32 bits) and tx number within the block
+   int64_t amount;
+};
+
+struct at_payment
+{
+   at_payment( int64_t at_id, int64_t account, int64_t amount )
+    :
+    at_id( at_id ),
+    account( account ),
+    amount( amount )
    {
-      if( disassemble )
-      {
-         if( !determine_jumps )
-            cout << "NOP\n";
-         while( true )
-         {
-            ++rc;
-            if( state.pc + rc >= csize || p_code[ state.pc + rc ] != e_op_code_NOP )
-               break;
-         }
-      }
-      else while( true )
-      {
-         ++rc;
-         ++state.pc;
-         if( state.pc >= csize || p_code[ state.pc ] != e_op_code_NOP )
-            break;
-      }
    }
-   else if( op == e_op_code_SET_VAL )
+
+   int64_t at_id;
+   int64_t account;
+   int64_t amount;
+};
+
+// NOTE: Function numbers are grouped into the following ranges (see AT_API_SPEC) and
+// the function table covers all of them (anything outside is treated as unknown).
+enum function_range
+{
+   e_function_range_testing = 0x0000,
+   e_function_range_experimental = 0x0010,
+   e_function_range_registers = 0x0100,
+   e_function_range_hashes = 0x0200,
+   e_function_range_chain_info = 0x0300,
+   e_function_range_balance_ops = 0x0400,
+   e_function_range_platform_chain_info = 0x0500,
+   e_function_range_platform_balance_ops = 0x0600,
+   e_function_range_end = 0x0700
+};
+
+typedef int64_t ( *function_handler )( at_context& context, int32_t func_num, int64_t value1, int64_t value2 );
+
+struct function_entry
+{
+   function_entry( )
    {
-      int32_t addr;
-      int64_t val;
-      rc = get_addr_val( p_code, csize, dsize, state, addr, val );
+      p_name = 0;
+      op = 0;
 
-      if( rc == 0 || disassemble )
-      {
-         rc = 1 + sizeof( int32_t ) + sizeof( int64_t );
+      keeps_balance = false;
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-               cout << "SET @" << hex << setw( 8 ) << setfill( '0' )
-                << addr << " #" << setw( 16 ) << setfill( '0' ) << val << '\n';
-         }
-         else
-         {
-            state.pc += rc;
-            *( int64_t* )( p_data + ( addr * 8 ) ) = val;
-         }
-      }
+      for( size_t i = 0; i < 3; i++ )
+         p_handlers[ i ] = 0;
    }
-   else if( op == e_op_code_SET_DAT )
-   {
-      int32_t addr1, addr2;
-      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
 
-      if( rc == 0 || disassemble )
-      {
-         rc = 1 + sizeof( int32_t ) + sizeof( int32_t );
+   const char* p_name;
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-               cout << "SET @" << hex << setw( 8 ) << setfill( '0' )
-                << addr1 << " $" << setw( 8 ) << setfill( '0' ) << addr2 << '\n';
-         }
-         else
+   int8_t op; // the op code that the function has been declared for (if any)
+
+   bool keeps_balance; // set if the function can't change the balance (see "set_keeps_balance")
+
+   function_handler p_handlers[ 3 ]; // indexed by the number of argument values
+};
+
+function_entry g_functions[ e_function_range_end ];
+
+inline const function_entry* get_function_entry( int32_t func_num )
+{
+   if( func_num < 0 || func_num >= e_function_range_end )
+      return 0;
+
+   return &g_functions[ func_num ];
+}
+
+inline bool keeps_balance( int32_t func_num )
+{
+   const function_entry* p_entry = get_function_entry( func_num );
+
+   return p_entry && p_entry->keeps_balance;
+}
+
+void register_function( int32_t func_num, const char* p_name, int8_t op,
+ function_handler p_handler0, function_handler p_handler1 = 0, function_handler p_handler2 = 0 )
+{
+   if( func_num < 0 || func_num >= e_function_range_end )
+      throw runtime_error( "function number is outside of all function ranges" );
+
+   function_entry& entry( g_functions[ func_num ] );
+
+   entry.p_name = p_name;
+   entry.op = op;
+
+   entry.keeps_balance = false;
+
+   entry.p_handlers[ 0 ] = p_handler0;
+   entry.p_handlers[ 1 ] = p_handler1;
+   entry.p_handlers[ 2 ] = p_handler2;
+}
+
+// NOTE: Declares that the (already registered) functions from "first_func_num" to "last_func_num"
+// can't change the balance so that a call to one of them can be fused with the op that follows it
+// (registering a function again clears this).
+void set_keeps_balance( int32_t first_func_num, int32_t last_func_num )
+{
+   if( first_func_num < 0 || last_func_num >= e_function_range_end || first_func_num > last_func_num )
+      throw runtime_error( "function numbers are outside of all function ranges" );
+
+   for( int32_t func_num = first_func_num; func_num <= last_func_num; func_num++ )
+      g_functions[ func_num ].keeps_balance = true;
+}
+
+// NOTE: An AT context owns everything that is needed to run an AT (its code, data and stacks along
+// with its machine state, balance and the host functions that it is bound to). As there is no AT
+// state kept in globals any number of contexts can be run in the one process (although any given
+// context must only be used by one thread at a time).
+struct at_context
+{
+   // NOTE: If "p_pools" is provided then the AT's code and data are allocated from it (and so it
+   // must outlive the AT).
+   explicit at_context( at_memory_pools* p_pools = 0 )
+    :
+    p_pools( p_pools )
+   {
+      id = 0;
+      height = 0;
+
+      code_pages = 1;
+      data_pages = 1;
+
+      call_stack_pages = 1;
+      user_stack_pages = 1;
+
+      val = 0;
+      val1 = 0;
+
+      balance = c_default_balance;
+
+      first_call = true;
+
+      increment_func = 0;
+
+      p_functions = g_functions;
+
+      p_output = 0;
+
+      balance_read = false;
+
+      waiting_for_tx = false;
+
+      func_failed = false;
+
+      p_shared_code = 0;
+
+      state.p_jumps = &code.jumps;
+
+      allocate_code( );
+      allocate_data( );
+   }
+
+   ~at_context( )
+   {
+      release_shared_code( p_shared_code );
+   }
+
+   int32_t csize( ) const { return code_pages * c_code_page_bytes; }
+   int32_t dsize( ) const { return data_pages * c_data_page_bytes; }
+
+   int32_t cssize( ) const { return call_stack_pages * c_call_stack_page_bytes; }
+   int32_t ussize( ) const { return user_stack_pages * c_user_stack_page_bytes; }
+
+   void allocate_code( )
+   {
+      set_shared_code( 0 );
+
+      ap_code.allocate( csize( ), p_pools );
+   }
+
+   void allocate_data( )
+   {
+      // NOTE: As shared code is only shared for the same memory geometry.
+      set_shared_code( 0 );
+
+      ap_data.allocate( dsize( ) + cssize( ) + ussize( ), p_pools );
+
+      allocate_dirty_pages( e_page_flag_unhashed );
+   }
+
+   void allocate_dirty_pages( uint8_t flags )
+   {
+      dirty_pages.assign( ( dsize( ) + cssize( ) + ussize( ) + c_data_page_bytes - 1 ) / c_data_page_bytes, flags, p_pools );
+   }
+
+   const decoded_code& get_code( ) const;
+
+   // NOTE: Changes the AT to use shared code (or to stop using it if "p_new_shared" is null).
+   void set_shared_code( shared_code* p_new_shared );
+
+   void mark_all_dirty( )
+   {
+      dirty_pages.fill( e_page_flag_all );
+   }
+
+   // NOTE: Returns the Merkle root of the AT's state (only rehashing the pages changed since the
+   // last call).
+   string get_state_hash( )
+   {
+      state_hash.update( ap_data.get( ), dsize( ) + cssize( ) + ussize( ), &dirty_pages[ 0 ], dirty_pages.size( ), state );
+
+      return state_hash.hex_root( );
+   }
+
+   int64_t id;
+   int32_t height; // current block height
+
+   int32_t code_pages;
+   int32_t data_pages;
+
+   int32_t call_stack_pages;
+   int32_t user_stack_pages;
+
+   at_buffer ap_code;
+   at_buffer ap_data;
+
+   machine_state state;
+   decoded_code code; // unused if the code is shared
+
+   shared_code* p_shared_code;
+
+   int64_t balance;
+
+   int64_t val;
+   int64_t val1;
+
+   bool first_call;
+
+   int32_t increment_func;
+
+   map< int32_t, function_data > func_data;
+
+   const function_entry* p_functions; // host functions (indexed by function number)
+
+   ostream* p_output; // if set then test function output (such as payouts) is written to it
+
+   vector< at_payment > payments; // outgoing payments (in the order that they were made)
+
+   bool balance_read; // set if the balance was read (or limited execution) since last cleared
+
+   vector< at_tx > txs; // txs sent to the AT (in timestamp order)
+
+   bool waiting_for_tx; // set if A_To_Tx_After_Timestamp found no tx and was followed by SLP_IMD
+
+   bool func_failed; // set by a function handler to make the op that called it fail
+
+   page_flags dirty_pages; // flags for each data page
+
+   state_hash_tree state_hash;
+
+   private:
+   at_memory_pools* p_pools;
+
+   at_context( const at_context& );
+   at_context& operator =( const at_context& );
+};
+
+inline bool is_sleeping( const at_context& context )
+{
+   return context.state.sleep_until > context.height;
+}
+
+int64_t get_function_data( at_context& context, int32_t func_num )
+{
+   if( func_num == context.increment_func )
+   {
+      if( context.first_call )
+         context.first_call = false;
+      else
+      {
+         for( map< int32_t, function_data >::iterator i = context.func_data.begin( ); i != context.func_data.end( ); ++i )
          {
-            state.pc += rc;
-            *( int64_t* )( p_data + ( addr1 * 8 ) ) = *( int64_t* )( p_data + ( addr2 * 8 ) );
+            if( ++( i->second.offset ) >= i->second.data.size( ) )
+            {
+               if( i->second.loop )
+                  i->second.offset = 0;
+               else
+                  --( i->second.offset );
+            }
          }
       }
    }
-   else if( op == e_op_code_CLR_DAT )
+
+   int64_t rc = context.func_data[ func_num ].data[ context.func_data[ func_num ].offset ];
+
+   return rc;
+}
+
+int64_t test_get_val( at_context& context, int32_t, int64_t, int64_t )
+{
+   return context.val;
+}
+
+int64_t test_echo( at_context& context, int32_t, int64_t value, int64_t )
+{
+   if( context.p_output )
+      *context.p_output << dec << value << '\n';
+
+   return 0;
+}
+
+int64_t test_get_value( at_context& context, int32_t, int64_t, int64_t )
+{
+   if( context.val == 9 )
+      return context.val = 0;
+   else
+      return ++context.val;
+}
+
+int64_t test_double( at_context&, int32_t, int64_t value, int64_t )
+{
+   return value * 2;
+}
+
+int64_t test_multiply( at_context&, int32_t, int64_t value1, int64_t value2 )
+{
+   return value1 * value2;
+}
+
+int64_t test_get_size( at_context&, int32_t, int64_t, int64_t )
+{
+   return 10;
+}
+
+int64_t test_halve( at_context&, int32_t, int64_t value, int64_t )
+{
+   return value / 2;
+}
+
+int64_t test_divide( at_context&, int32_t, int64_t value1, int64_t value2 )
+{
+   return value1 / value2;
+}
+
+int64_t test_get_func_num( at_context&, int32_t func_num, int64_t, int64_t )
+{
+   return func_num;
+}
+
+int64_t test_sum( at_context&, int32_t, int64_t value1, int64_t value2 )
+{
+   return value1 + value2;
+}
+
+int64_t test_get_balance( at_context& context, int32_t func_num, int64_t, int64_t )
+{
+   if( context.func_data.count( func_num ) )
+   {
+      if( context.p_output )
+         *context.p_output << "(resetting function data)\n";
+
+      context.first_call = true;
+      for( map< int32_t, function_data >::iterator i = context.func_data.begin( ); i != context.func_data.end( ); ++i )
+         i->second.offset = 0;
+   }
+
+   context.balance_read = true;
+
+   return context.balance;
+}
+
+int64_t test_pay_balance( at_context& context, int32_t, int64_t value, int64_t )
+{
+   context.balance_read = true;
+   context.payments.push_back( at_payment( context.id, value, context.balance ) );
+
+   if( context.p_output )
+      *context.p_output << "payout " << dec << context.balance << " to account: " << value << '\n';
+
+   context.balance = 0;
+
+   return 0;
+}
+
+int64_t test_send_amount( at_context& context, int32_t, int64_t value1, int64_t value2 )
+{
+   context.balance_read = true;
+
+   if( value1 > context.balance )
+      value1 = context.balance;
+
+   context.payments.push_back( at_payment( context.id, value2, value1 ) );
+
+   if( context.p_output )
+      *context.p_output << "payout " << dec << value1
+       << " to account: " << hex << setw( 8 ) << setfill( '0' ) << value2 << '\n';
+
+   context.balance -= value1;
+
+   return 0;
+}
+
+int64_t get_a1( at_context& context, int32_t, int64_t, int64_t )
+{
+   return context.state.a1;
+}
+
+int64_t get_a2( at_context& context, int32_t, int64_t, int64_t )
+{
+   return context.state.a2;
+}
+
+int64_t get_a3( at_context& context, int32_t, int64_t, int64_t )
+{
+   return context.state.a3;
+}
+
+int64_t get_a4( at_context& context, int32_t, int64_t, int64_t )
+{
+   return context.state.a4;
+}
+
+int64_t get_b1( at_context& context, int32_t, int64_t, int64_t )
+{
+   return context.state.b1;
+}
+
+int64_t get_b2( at_context& context, int32_t, int64_t, int64_t )
+{
+   return context.state.b2;
+}
+
+int64_t get_b3( at_context& context, int32_t, int64_t, int64_t )
+{
+   return context.state.b3;
+}
+
+int64_t get_b4( at_context& context, int32_t, int64_t, int64_t )
+{
+   return context.state.b4;
+}
+
+int64_t set_a1( at_context& context, int32_t, int64_t value, int64_t )
+{
+   context.state.a1 = value;
+
+   return 0;
+}
+
+int64_t set_a2( at_context& context, int32_t, int64_t value, int64_t )
+{
+   context.state.a2 = value;
+
+   return 0;
+}
+
+int64_t set_a3( at_context& context, int32_t, int64_t value, int64_t )
+{
+   context.state.a3 = value;
+
+   return 0;
+}
+
+int64_t set_a4( at_context& context, int32_t, int64_t value, int64_t )
+{
+   context.state.a4 = value;
+
+   return 0;
+}
+
+int64_t set_b1( at_context& context, int32_t, int64_t value, int64_t )
+{
+   context.state.b1 = value;
+
+   return 0;
+}
+
+int64_t set_b2( at_context& context, int32_t, int64_t value, int64_t )
+{
+   context.state.b2 = value;
+
+   return 0;
+}
+
+int64_t set_b3( at_context& context, int32_t, int64_t value, int64_t )
+{
+   context.state.b3 = value;
+
+   return 0;
+}
+
+int64_t set_b4( at_context& context, int32_t, int64_t value, int64_t )
+{
+   context.state.b4 = value;
+
+   return 0;
+}
+
+int64_t set_a1_a2( at_context& context, int32_t, int64_t value1, int64_t value2 )
+{
+   context.state.a1 = value1;
+   context.state.a2 = value2;
+
+   return 0;
+}
+
+int64_t set_a3_a4( at_context& context, int32_t, int64_t value1, int64_t value2 )
+{
+   context.state.a3 = value1;
+   context.state.a4 = value2;
+
+   return 0;
+}
+
+int64_t set_b1_b2( at_context& context, int32_t, int64_t value1, int64_t value2 )
+{
+   context.state.b1 = value1;
+   context.state.b2 = value2;
+
+   return 0;
+}
+
+int64_t set_b3_b4( at_context& context, int32_t, int64_t value1, int64_t value2 )
+{
+   context.state.b3 = value1;
+   context.state.b4 = value2;
+
+   return 0;
+}
+
+int64_t clear_a( at_context& context, int32_t, int64_t, int64_t )
+{
+   context.state.a1 = 0;
+   context.state.a2 = 0;
+   context.state.a3 = 0;
+   context.state.a4 = 0;
+
+   return 0;
+}
+
+int64_t clear_b( at_context& context, int32_t, int64_t, int64_t )
+{
+   context.state.b1 = 0;
+   context.state.b2 = 0;
+   context.state.b3 = 0;
+   context.state.b4 = 0;
+
+   return 0;
+}
+
+int64_t clear_a_and_b( at_context& context, int32_t, int64_t, int64_t )
+{
+   context.state.a1 = context.state.b1 = 0;
+   context.state.a2 = context.state.b2 = 0;
+   context.state.a3 = context.state.b3 = 0;
+   context.state.a4 = context.state.b4 = 0;
+
+   return 0;
+}
+
+int64_t copy_a_from_b( at_context& context, int32_t, int64_t, int64_t )
+{
+   context.state.a1 = context.state.b1;
+   context.state.a2 = context.state.b2;
+   context.state.a3 = context.state.b3;
+   context.state.a4 = context.state.b4;
+
+   return 0;
+}
+
+int64_t copy_b_from_a( at_context& context, int32_t, int64_t, int64_t )
+{
+   context.state.b1 = context.state.a1;
+   context.state.b2 = context.state.a2;
+   context.state.b3 = context.state.a3;
+   context.state.b4 = context.state.a4;
+
+   return 0;
+}
+
+int64_t check_a_is_zero( at_context& context, int32_t, int64_t, int64_t )
+{
+   return context.state.a1 == 0 && context.state.a2 == 0 && context.state.a3 == 0 && context.state.a4 == 0;
+}
+
+int64_t check_b_is_zero( at_context& context, int32_t, int64_t, int64_t )
+{
+   return context.state.b1 == 0 && context.state.b2 == 0 && context.state.b3 == 0 && context.state.b4 == 0;
+}
+
+int64_t check_a_equals_b( at_context& context, int32_t, int64_t, int64_t )
+{
+   return context.state.a1 == context.state.b1 && context.state.a2 == context.state.b2 && context.state.a3 == context.state.b3 && context.state.a4 == context.state.b4;
+}
+
+int64_t swap_a_and_b( at_context& context, int32_t, int64_t, int64_t )
+{
+   int64_t tmp_a1 = context.state.a1;
+   int64_t tmp_a2 = context.state.a2;
+   int64_t tmp_a3 = context.state.a3;
+   int64_t tmp_a4 = context.state.a4;
+
+   context.state.a1 = context.state.b1;
+   context.state.a2 = context.state.b2;
+   context.state.a3 = context.state.b3;
+   context.state.a4 = context.state.b4;
+
+   context.state.b1 = tmp_a1;
+   context.state.b2 = tmp_a2;
+   context.state.b3 = tmp_a3;
+   context.state.b4 = tmp_a4;
+
+   return 0;
+}
+
+int64_t or_a_with_b( at_context& context, int32_t, int64_t, int64_t )
+{
+   context.state.a1 = context.state.a1 | context.state.b1;
+   context.state.a2 = context.state.a2 | context.state.b2;
+   context.state.a3 = context.state.a3 | context.state.b3;
+   context.state.a4 = context.state.a4 | context.state.b4;
+
+   return 0;
+}
+
+int64_t or_b_with_a( at_context& context, int32_t, int64_t, int64_t )
+{
+   context.state.b1 = context.state.a1 | context.state.b1;
+   context.state.b2 = context.state.a2 | context.state.b2;
+   context.state.b3 = context.state.a3 | context.state.b3;
+   context.state.b4 = context.state.a4 | context.state.b4;
+
+   return 0;
+}
+
+int64_t and_a_with_b( at_context& context, int32_t, int64_t, int64_t )
+{
+   context.state.a1 = context.state.a1 & context.state.b1;
+   context.state.a2 = context.state.a2 & context.state.b2;
+   context.state.a3 = context.state.a3 & context.state.b3;
+   context.state.a4 = context.state.a4 & context.state.b4;
+
+   return 0;
+}
+
+int64_t and_b_with_a( at_context& context, int32_t, int64_t, int64_t )
+{
+   context.state.b1 = context.state.a1 & context.state.b1;
+   context.state.b2 = context.state.a2 & context.state.b2;
+   context.state.b3 = context.state.a3 & context.state.b3;
+   context.state.b4 = context.state.a4 & context.state.b4;
+
+   return 0;
+}
+
+int64_t xor_a_with_b( at_context& context, int32_t, int64_t, int64_t )
+{
+   context.state.a1 = context.state.a1 ^ context.state.b1;
+   context.state.a2 = context.state.a2 ^ context.state.b2;
+   context.state.a3 = context.state.a3 ^ context.state.b3;
+   context.state.a4 = context.state.a4 ^ context.state.b4;
+
+   return 0;
+}
+
+int64_t xor_b_with_a( at_context& context, int32_t, int64_t, int64_t )
+{
+   context.state.b1 = context.state.a1 ^ context.state.b1;
+   context.state.b2 = context.state.a2 ^ context.state.b2;
+   context.state.b3 = context.state.a3 ^ context.state.b3;
+   context.state.b4 = context.state.a4 ^ context.state.b4;
+
+   return 0;
+}
+
+// NOTE: The A and B pseudo registers are treated as unsigned 256 bit values (with A1 and B1 being
+// their least significant 64 bits) by the math functions (with results being truncated to 256 bits).
+struct uint256
+{
+   uint64_t words[ 4 ];
+};
+
+inline uint256 get_a( const machine_state& state )
+{
+   uint256 value = { { ( uint64_t )state.a1, ( uint64_t )state.a2, ( uint64_t )state.a3, ( uint64_t )state.a4 } };
+
+   return value;
+}
+
+inline uint256 get_b( const machine_state& state )
+{
+   uint256 value = { { ( uint64_t )state.b1, ( uint64_t )state.b2, ( uint64_t )state.b3, ( uint64_t )state.b4 } };
+
+   return value;
+}
+
+inline void set_a( machine_state& state, const uint256& value )
+{
+   state.a1 = ( int64_t )value.words[ 0 ];
+   state.a2 = ( int64_t )value.words[ 1 ];
+   state.a3 = ( int64_t )value.words[ 2 ];
+   state.a4 = ( int64_t )value.words[ 3 ];
+}
+
+inline void set_b( machine_state& state, const uint256& value )
+{
+   state.b1 = ( int64_t )value.words[ 0 ];
+   state.b2 = ( int64_t )value.words[ 1 ];
+   state.b3 = ( int64_t )value.words[ 2 ];
+   state.b4 = ( int64_t )value.words[ 3 ];
+}
+
+inline void mul_64( uint64_t x, uint64_t y, uint64_t& lo, uint64_t& hi )
+{
+#if defined( __SIZEOF_INT128__ )
+   unsigned __int128 product = ( unsigned __int128 )x * y;
+
+   lo = ( uint64_t )product;
+   hi = ( uint64_t )( product >> 64 );
+#elif defined( _MSC_VER ) && defined( _M_X64 )
+   lo = _umul128( x, y, &hi );
+#else
+   uint64_t x_lo = x & 0xffffffff, x_hi = x >> 32;
+   uint64_t y_lo = y & 0xffffffff, y_hi = y >> 32;
+
+   uint64_t p0 = x_lo * y_lo;
+   uint64_t p1 = x_lo * y_hi;
+   uint64_t p2 = x_hi * y_lo;
+   uint64_t p3 = x_hi * y_hi;
+
+   uint64_t middle = ( p0 >> 32 ) + ( p1 & 0xffffffff ) + ( p2 & 0xffffffff );
+
+   lo = ( middle << 32 ) | ( p0 & 0xffffffff );
+   hi = p3 + ( p1 >> 32 ) + ( p2 >> 32 ) + ( middle >> 32 );
+#endif
+}
+
+uint256 add_256( const uint256& x, const uint256& y )
+{
+   uint256 result;
+   uint64_t carry = 0;
+
+   for( size_t i = 0; i < 4; i++ )
+   {
+      uint64_t sum = x.words[ i ] + carry;
+      carry = sum < carry;
+
+      result.words[ i ] = sum + y.words[ i ];
+      carry += result.words[ i ] < sum;
+   }
+
+   return result;
+}
+
+uint256 sub_256( const uint256& x, const uint256& y )
+{
+   uint256 result;
+   uint64_t borrow = 0;
+
+   for( size_t i = 0; i < 4; i++ )
+   {
+      uint64_t diff = x.words[ i ] - y.words[ i ];
+      uint64_t next_borrow = x.words[ i ] < y.words[ i ];
+
+      result.words[ i ] = diff - borrow;
+      borrow = next_borrow | ( diff < borrow );
+   }
+
+   return result;
+}
+
+// NOTE: A schoolbook multiply that only calculates the 10 (of 16) partial products that affect the
+// lower 256 bits (at this size Karatsuba would need more work rather than less).
+uint256 mul_256( const uint256& x, const uint256& y )
+{
+   uint256 result = { { 0, 0, 0, 0 } };
+
+   for( size_t i = 0; i < 4; i++ )
+   {
+      uint64_t carry = 0;
+
+      for( size_t j = 0; i + j < 4; j++ )
+      {
+         uint64_t lo, hi;
+         mul_64( x.words[ i ], y.words[ j ], lo, hi );
+
+         lo += carry;
+         hi += lo < carry;
+
+         result.words[ i + j ] += lo;
+         hi += result.words[ i + j ] < lo;
+
+         carry = hi;
+      }
+   }
+
+   return result;
+}
+
+// NOTE: Long division (Knuth's algorithm D using 32 bit digits so that only 64 bit arithmetic is
+// needed) which returns false if the divisor is zero.
+bool div_256( const uint256& x, const uint256& y, uint256& quotient )
+{
+   uint32_t u[ 8 ], v[ 8 ], q[ 8 ];
+
+   for( size_t i = 0; i < 8; i++ )
+   {
+      u[ i ] = ( uint32_t )( x.words[ i / 2 ] >> ( ( i % 2 ) * 32 ) );
+      v[ i ] = ( uint32_t )( y.words[ i / 2 ] >> ( ( i % 2 ) * 32 ) );
+      q[ i ] = 0;
+   }
+
+   int n = 8;
+   while( n > 0 && !v[ n - 1 ] )
+      --n;
+
+   if( !n )
+      return false;
+
+   int m = 8;
+   while( m > 0 && !u[ m - 1 ] )
+      --m;
+
+   if( n == 1 )
+   {
+      uint64_t remainder = 0;
+
+      for( int j = m - 1; j >= 0; j-- )
+      {
+         uint64_t next = ( remainder << 32 ) | u[ j ];
+
+         q[ j ] = ( uint32_t )( next / v[ 0 ] );
+         remainder = next % v[ 0 ];
+      }
+   }
+   else if( m >= n )
+   {
+      // NOTE: Normalise so that the top digit of the divisor has its high bit set.
+      int s = 0;
+      while( !( ( v[ n - 1 ] << s ) & 0x80000000 ) )
+         ++s;
+
+      uint32_t vn[ 8 ], un[ 9 ];
+
+      for( int i = n - 1; i > 0; i-- )
+         vn[ i ] = ( v[ i ] << s ) | ( s ? v[ i - 1 ] >> ( 32 - s ) : 0 );
+      vn[ 0 ] = v[ 0 ] << s;
+
+      un[ m ] = s ? u[ m - 1 ] >> ( 32 - s ) : 0;
+      for( int i = m - 1; i > 0; i-- )
+         un[ i ] = ( u[ i ] << s ) | ( s ? u[ i - 1 ] >> ( 32 - s ) : 0 );
+      un[ 0 ] = u[ 0 ] << s;
+
+      for( int j = m - n; j >= 0; j-- )
+      {
+         uint64_t next = ( ( uint64_t )un[ j + n ] << 32 ) | un[ j + n - 1 ];
+
+         uint64_t qhat = next / vn[ n - 1 ];
+         uint64_t rhat = next % vn[ n - 1 ];
+
+         while( ( qhat >> 32 ) || qhat * vn[ n - 2 ] > ( ( rhat << 32 ) | un[ j + n - 2 ] ) )
+         {
+            --qhat;
+            rhat += vn[ n - 1 ];
+
+            if( rhat >> 32 )
+               break;
+         }
+
+         // NOTE: Multiply and subtract (adding back if the estimate was one too large).
+         int64_t t, k = 0;
+
+         for( int i = 0; i < n; i++ )
+         {
+            uint64_t product = qhat * vn[ i ];
+
+            t = ( int64_t )un[ i + j ] - k - ( int64_t )( product & 0xffffffff );
+            un[ i + j ] = ( uint32_t )t;
+
+            k = ( int64_t )( product >> 32 ) - ( t >> 32 );
+         }
+
+         t = ( int64_t )un[ j + n ] - k;
+         un[ j + n ] = ( uint32_t )t;
+
+         if( t < 0 )
+         {
+            --qhat;
+            k = 0;
+
+            for( int i = 0; i < n; i++ )
+            {
+               t = ( int64_t )un[ i + j ] + vn[ i ] + k;
+               un[ i + j ] = ( uint32_t )t;
+
+               k = t >> 32;
+            }
+
+            un[ j + n ] = ( uint32_t )( un[ j + n ] + k );
+         }
+
+         q[ j ] = ( uint32_t )qhat;
+      }
+   }
+
+   for( size_t i = 0; i < 4; i++ )
+      quotient.words[ i ] = ( uint64_t )q[ i * 2 ] | ( ( uint64_t )q[ i * 2 + 1 ] << 32 );
+
+   return true;
+}
+
+int64_t add_a_to_b( at_context& context, int32_t, int64_t, int64_t )
+{
+   set_b( context.state, add_256( get_a( context.state ), get_b( context.state ) ) );
+
+   return 0;
+}
+
+int64_t add_b_to_a( at_context& context, int32_t, int64_t, int64_t )
+{
+   set_a( context.state, add_256( get_a( context.state ), get_b( context.state ) ) );
+
+   return 0;
+}
+
+int64_t sub_a_from_b( at_context& context, int32_t, int64_t, int64_t )
+{
+   set_b( context.state, sub_256( get_b( context.state ), get_a( context.state ) ) );
+
+   return 0;
+}
+
+int64_t sub_b_from_a( at_context& context, int32_t, int64_t, int64_t )
+{
+   set_a( context.state, sub_256( get_a( context.state ), get_b( context.state ) ) );
+
+   return 0;
+}
+
+int64_t mul_a_by_b( at_context& context, int32_t, int64_t, int64_t )
+{
+   set_b( context.state, mul_256( get_a( context.state ), get_b( context.state ) ) );
+
+   return 0;
+}
+
+int64_t mul_b_by_a( at_context& context, int32_t, int64_t, int64_t )
+{
+   set_a( context.state, mul_256( get_b( context.state ), get_a( context.state ) ) );
+
+   return 0;
+}
+
+int64_t div_a_by_b( at_context& context, int32_t, int64_t, int64_t )
+{
+   uint256 quotient;
+
+   if( !div_256( get_a( context.state ), get_b( context.state ), quotient ) )
+      context.func_failed = true;
+   else
+      set_b( context.state, quotient );
+
+   return 0;
+}
+
+int64_t div_b_by_a( at_context& context, int32_t, int64_t, int64_t )
+{
+   uint256 quotient;
+
+   if( !div_256( get_b( context.state ), get_a( context.state ), quotient ) )
+      context.func_failed = true;
+   else
+      set_a( context.state, quotient );
+
+   return 0;
+}
+
+// NOTE: Functions that are declared (and so can be decoded) but which have no handlers
+// for the simulator are registered with null handlers (calling these will fall back to
+// any custom function data or otherwise just return zero).
+void register_functions( )
+{
+   // NOTE: Internal testing functions (0x0000..0x000f).
+   register_function( 1, 0, 0, test_get_val, test_echo );
+   register_function( 2, 0, 0, test_get_value, test_double, test_multiply );
+   register_function( 3, 0, 0, test_get_size, test_halve, test_divide );
+   register_function( 4, 0, 0, test_get_func_num, 0, test_sum );
+
+   // NOTE: Experimental functions (0x0010..0x00ff).
+   register_function( 25, 0, 0, test_get_balance );
+   register_function( 26, 0, 0, 0, test_pay_balance );
+   register_function( 31, 0, 0, 0, 0, test_send_amount );
+   register_function( 32, 0, 0, test_get_balance );
+   register_function( 33, 0, 0, 0, test_pay_balance );
+
+   // NOTE: Get/Set functions for "pseudo registers" (0x0100..0x01ff).
+   register_function( 0x0100, "Get_A1", e_op_code_EXT_FUN_RET, get_a1 );
+   register_function( 0x0101, "Get_A2", e_op_code_EXT_FUN_RET, get_a2 );
+   register_function( 0x0102, "Get_A3", e_op_code_EXT_FUN_RET, get_a3 );
+   register_function( 0x0103, "Get_A4", e_op_code_EXT_FUN_RET, get_a4 );
+   register_function( 0x0104, "Get_B1", e_op_code_EXT_FUN_RET, get_b1 );
+   register_function( 0x0105, "Get_B2", e_op_code_EXT_FUN_RET, get_b2 );
+   register_function( 0x0106, "Get_B3", e_op_code_EXT_FUN_RET, get_b3 );
+   register_function( 0x0107, "Get_B4", e_op_code_EXT_FUN_RET, get_b4 );
+
+   set_keeps_balance( 0x0100, 0x0107 );
+
+   register_function( 0x0110, "Set_A1", e_op_code_EXT_FUN_DAT, 0, set_a1 );
+   register_function( 0x0111, "Set_A2", e_op_code_EXT_FUN_DAT, 0, set_a2 );
+   register_function( 0x0112, "Set_A3", e_op_code_EXT_FUN_DAT, 0, set_a3 );
+   register_function( 0x0113, "Set_A4", e_op_code_EXT_FUN_DAT, 0, set_a4 );
+   register_function( 0x0114, "Set_A1_A2", e_op_code_EXT_FUN_DAT_2, 0, 0, set_a1_a2 );
+   register_function( 0x0115, "Set_A3_A4", e_op_code_EXT_FUN_DAT_2, 0, 0, set_a3_a4 );
+   register_function( 0x0116, "Set_B1", e_op_code_EXT_FUN_DAT, 0, set_b1 );
+   register_function( 0x0117, "Set_B2", e_op_code_EXT_FUN_DAT, 0, set_b2 );
+   register_function( 0x0118, "Set_B3", e_op_code_EXT_FUN_DAT, 0, set_b3 );
+   register_function( 0x0119, "Set_B4", e_op_code_EXT_FUN_DAT, 0, set_b4 );
+   register_function( 0x011a, "Set_B1_B2", e_op_code_EXT_FUN_DAT_2, 0, 0, set_b1_b2 );
+   register_function( 0x011b, "Set_B3_B4", e_op_code_EXT_FUN_DAT_2, 0, 0, set_b3_b4 );
+
+   set_keeps_balance( 0x0110, 0x011b );
+
+   register_function( 0x0120, "Clear_A", e_op_code_EXT_FUN, clear_a );
+   register_function( 0x0121, "Clear_B", e_op_code_EXT_FUN, clear_b );
+   register_function( 0x0122, "Clear_A_And_B", e_op_code_EXT_FUN, clear_a_and_b );
+   register_function( 0x0123, "Copy_A_From_B", e_op_code_EXT_FUN, copy_a_from_b );
+   register_function( 0x0124, "Copy_B_From_A", e_op_code_EXT_FUN, copy_b_from_a );
+   register_function( 0x0125, "Check_A_Is_Zero", e_op_code_EXT_FUN_RET, check_a_is_zero );
+   register_function( 0x0126, "Check_B_Is_Zero", e_op_code_EXT_FUN_RET, check_b_is_zero );
+   register_function( 0x0127, "Check_A_Equals_B", e_op_code_EXT_FUN_RET, check_a_equals_b );
+   register_function( 0x0128, "Swap_A_and_B", e_op_code_EXT_FUN, swap_a_and_b );
+   register_function( 0x0129, "OR_A_with_B", e_op_code_EXT_FUN, or_a_with_b );
+   register_function( 0x012a, "OR_B_with_A", e_op_code_EXT_FUN, or_b_with_a );
+   register_function( 0x012b, "AND_A_with_B", e_op_code_EXT_FUN, and_a_with_b );
+   register_function( 0x012c, "AND_B_with_A", e_op_code_EXT_FUN, and_b_with_a );
+   register_function( 0x012d, "XOR_A_with_B", e_op_code_EXT_FUN, xor_a_with_b );
+   register_function( 0x012e, "XOR_B_with_A", e_op_code_EXT_FUN, xor_b_with_a );
+
+   set_keeps_balance( 0x0120, 0x012e );
+
+   register_function( 0x0140, "Add_A_To_B", e_op_code_EXT_FUN, add_a_to_b );
+   register_function( 0x0141, "Add_B_To_A", e_op_code_EXT_FUN, add_b_to_a );
+   register_function( 0x0142, "Sub_A_From_B", e_op_code_EXT_FUN, sub_a_from_b );
+   register_function( 0x0143, "Sub_B_From_A", e_op_code_EXT_FUN, sub_b_from_a );
+   register_function( 0x0144, "Mul_A_By_B", e_op_code_EXT_FUN, mul_a_by_b );
+   register_function( 0x0145, "Mul_B_By_A", e_op_code_EXT_FUN, mul_b_by_a );
+   register_function( 0x0146, "Div_A_By_B", e_op_code_EXT_FUN, div_a_by_b );
+   register_function( 0x0147, "Div_B_By_A", e_op_code_EXT_FUN, div_b_by_a );
+
+   set_keeps_balance( 0x0140, 0x0147 );
+
+   // NOTE: Functions that perform hash operations (0x0200..0x02ff).
+   register_function( 0x0200, "MD5_A_To_B", e_op_code_EXT_FUN, 0 );
+   register_function( 0x0201, "Check_MD5_A_With_B", e_op_code_EXT_FUN_RET, 0 );
+   register_function( 0x0202, "HASH160_A_To_B", e_op_code_EXT_FUN, 0 );
+   register_function( 0x0203, "Check_HASH160_A_With_B", e_op_code_EXT_FUN_RET, 0 );
+   register_function( 0x0204, "SHA256_A_To_B", e_op_code_EXT_FUN, 0 );
+   register_function( 0x0205, "Check_SHA256_A_With_B", e_op_code_EXT_FUN_RET, 0 );
+
+   set_keeps_balance( 0x0200, 0x0205 );
+
+   // NOTE: Generic functions that get block and tx info (0x0300..0x03ff).
+   register_function( 0x0300, "Get_Block_Timestamp", e_op_code_EXT_FUN_RET, 0 );
+   register_function( 0x0301, "Get_Creation_Timestamp", e_op_code_EXT_FUN_RET, 0 );
+   register_function( 0x0302, "Get_Last_Block_Timestamp", e_op_code_EXT_FUN_RET, 0 );
+   register_function( 0x0303, "Put_Last_Block_Hash_In_A", e_op_code_EXT_FUN, 0 );
+   register_function( 0x0304, "A_To_Tx_After_Timestamp", e_op_code_EXT_FUN_DAT, 0 );
+   register_function( 0x0305, "Get_Type_For_Tx_In_A", e_op_code_EXT_FUN_RET, 0 );
+   register_function( 0x0306, "Get_Amount_For_Tx_In_A", e_op_code_EXT_FUN_RET, 0 );
+   register_function( 0x0307, "Get_Timestamp_For_Tx_In_A", e_op_code_EXT_FUN_RET, 0 );
+   register_function( 0x0308, "Get_Random_Id_For_Tx_In_A", e_op_code_EXT_FUN_RET, 0 );
+   register_function( 0x0309, "Message_From_Tx_In_A_To_B", e_op_code_EXT_FUN, 0 );
+   register_function( 0x030a, "B_To_Address_Of_Tx_In_A", e_op_code_EXT_FUN, 0 );
+   register_function( 0x030b, "B_To_Address_Of_Creator", e_op_code_EXT_FUN, 0 );
+
+   set_keeps_balance( 0x0300, 0x030b );
+
+   // NOTE: Generic functions that check balances and perform ops (0x0400..0x04ff).
+   register_function( 0x0400, "Get_Current_Balance", e_op_code_EXT_FUN_RET, 0 );
+   register_function( 0x0401, "Get_Previous_Balance", e_op_code_EXT_FUN_RET, 0 );
+
+   set_keeps_balance( 0x0400, 0x0401 );
+
+   register_function( 0x0402, "Send_To_Address_In_B", e_op_code_EXT_FUN_DAT, 0 );
+   register_function( 0x0403, "Send_All_To_Address_In_B", e_op_code_EXT_FUN, 0 );
+   register_function( 0x0404, "Send_Old_To_Address_In_B", e_op_code_EXT_FUN, 0 );
+   register_function( 0x0405, "Send_A_To_Address_In_B", e_op_code_EXT_FUN, 0 );
+   register_function( 0x0406, "Add_Minutes_To_Timestamp", e_op_code_EXT_FUN_RET_DAT_2, 0 );
+
+   // NOTE: The platform specific ranges (0x0500..0x06ff) have no functions that are
+   // known to the simulator although a platform can register its own in these ranges.
+}
+
+struct function_registrar
+{
+   function_registrar( ) { register_functions( ); }
+} g_function_registrar;
+
+string decode_function_name( int16_t fun, int8_t op )
+{
+   ostringstream osstr;
+
+   const function_entry* p_entry = get_function_entry( fun );
+
+   if( p_entry && p_entry->p_name )
+      osstr << p_entry->p_name;
+   else
+      osstr << "0x" << hex << setw( 4 ) << setfill( '0' ) << fun;
+
+   if( op && p_entry && p_entry->op && op != p_entry->op )
+      osstr << " *** invalid op ***";
+
+   return osstr.str( );
+}
+
+// NOTE: Tracing records events as fixed size binary records into a ring buffer (one per thread)
+// that are only formatted when dumped (or if a sink has been set for immediate output). Whether
+// an event is traced is determined by a single mask test (one bit per level and category) so a
+// disabled trace costs one predictable branch (and if compiled with AT_NO_TRACE then nothing).
+enum trace_level
+{
+   e_trace_level_none,
+   e_trace_level_error,
+   e_trace_level_info,
+   e_trace_level_debug
+};
+
+enum trace_category
+{
+   e_trace_category_func = 0x01,
+   e_trace_category_machine = 0x02,
+   e_trace_category_all = 0xff
+};
+
+enum trace_event
+{
+   e_trace_event_call,
+   e_trace_event_error,
+   e_trace_event_finish,
+   e_trace_event_stop
+};
+
+struct trace_record
+{
+   uint8_t event;
+   int8_t op;
+   uint8_t num_values;
+
+   int32_t pc;
+   int32_t func_num;
+
+   int64_t value1;
+   int64_t value2;
+
+   int64_t rc;
+};
+
+typedef void ( *trace_sink )( const trace_record& record );
+
+const size_t c_trace_buffer_size = 4096; // must be a power of two
+
+struct trace_buffer
+{
+   trace_buffer( ) : next( 0 ) { }
+
+   uint64_t next;
+
+   trace_record records[ c_trace_buffer_size ];
+};
+
+uint32_t g_trace_mask = 0;
+
+int g_trace_level = e_trace_level_none;
+int g_trace_categories = 0;
+
+trace_sink g_trace_sink = 0;
+
+#ifdef AT_TRACE
+AT_THREAD_LOCAL trace_buffer* gp_trace_buffer = 0;
+#endif
+
+void set_trace( int level, int categories )
+{
+   g_trace_level = level;
+   g_trace_categories = categories;
+
+   g_trace_mask = 0;
+   for( int i = e_trace_level_error; i <= level; i++ )
+      g_trace_mask |= ( uint32_t )( categories & 0xff ) << ( ( i - 1 ) * 8 );
+}
+
+inline bool is_tracing( trace_category category, trace_level level )
+{
+#ifdef AT_TRACE
+   return g_trace_mask & ( ( uint32_t )category << ( ( level - 1 ) * 8 ) );
+#else
+   return false;
+#endif
+}
+
+void trace( trace_event event, int8_t op, int32_t pc,
+ int32_t func_num, uint8_t num_values, int64_t value1, int64_t value2, int64_t rc )
+{
+#ifdef AT_TRACE
+   if( !gp_trace_buffer )
+      gp_trace_buffer = new trace_buffer;
+
+   trace_record& record( gp_trace_buffer->records[ gp_trace_buffer->next++ & ( c_trace_buffer_size - 1 ) ] );
+
+   record.event = event;
+   record.op = op;
+   record.num_values = num_values;
+   record.pc = pc;
+   record.func_num = func_num;
+   record.value1 = value1;
+   record.value2 = value2;
+   record.rc = rc;
+
+   if( g_trace_sink )
+      ( *g_trace_sink )( record );
+#endif
+}
+
+void release_trace_buffer( )
+{
+#ifdef AT_TRACE
+   delete gp_trace_buffer;
+   gp_trace_buffer = 0;
+#endif
+}
+
+void output_trace_record( ostream& os, const trace_record& record )
+{
+   if( record.event == e_trace_event_call )
+   {
+      if( record.num_values == 0 )
+      {
+         if( record.func_num < 0x100 )
+            os << "func: " << dec << record.func_num << " rc: " << hex << setw( 16 ) << setfill( '0' ) << record.rc << '\n';
+         else
+            os << "func: " << decode_function_name( record.func_num, 0 )
+             << " rc: 0x" << hex << setw( 16 ) << setfill( '0' ) << record.rc << '\n';
+      }
+      else if( record.num_values == 1 )
+      {
+         if( record.func_num < 0x100 )
+            os << "func1: " << dec << record.func_num << " with " << record.value1
+             << " rc: " << hex << setw( 16 ) << setfill( '0' ) << record.rc << '\n';
+         else
+            os << "func1: " << decode_function_name( record.func_num, 0 )
+             << " with " << record.value1 << " rc: 0x" << hex << setw( 16 ) << setfill( '0' ) << record.rc << '\n';
+      }
+      else
+      {
+         if( record.func_num < 0x100 )
+            os << "func2: " << dec << record.func_num << " with " << record.value1
+             << " and " << record.value2 << " rc: " << hex << setw( 16 ) << setfill( '0' ) << record.rc << '\n';
+         else
+            os << "func2: " << decode_function_name( record.func_num, 0 ) << " with " << record.value1
+             << " and " << record.value2 << " rc: 0x" << hex << setw( 16 ) << setfill( '0' ) << record.rc << '\n';
+      }
+   }
+   else
+   {
+      if( record.event == e_trace_event_error )
+         os << "error";
+      else if( record.event == e_trace_event_finish )
+         os << "finish";
+      else
+         os << "stop";
+
+      os << " at pc: " << hex << setw( 8 ) << setfill( '0' ) << record.pc
+       << " op: " << setw( 2 ) << ( int )( uint8_t )record.op << " rc: " << dec << record.rc << '\n';
+   }
+}
+
+// NOTE: The test functions that output their own details (or are called to get values for
+// loops) are not output to the console.
+void trace_to_console( const trace_record& record )
+{
+   if( record.event == e_trace_event_call )
+   {
+      if( ( record.num_values == 0 && record.func_num == 2 )
+       || ( record.num_values == 1 && ( record.func_num == 1 || record.func_num == 26 ) )
+       || ( record.num_values == 2 && record.func_num == 31 ) )
+         return;
+   }
+
+   output_trace_record( cout, record );
+}
+
+void dump_trace( ostream& os, size_t max_records = c_trace_buffer_size )
+{
+#ifdef AT_TRACE
+   if( !gp_trace_buffer )
+      return;
+
+   uint64_t end = gp_trace_buffer->next;
+   uint64_t start = end > max_records ? end - max_records : 0;
+
+   if( end - start > c_trace_buffer_size )
+      start = end - c_trace_buffer_size;
+
+   for( uint64_t i = start; i < end; i++ )
+   {
+      os << dec << i << ": ";
+      output_trace_record( os, gp_trace_buffer->records[ i & ( c_trace_buffer_size - 1 ) ] );
+   }
+#endif
+}
+
+inline int64_t call_function( at_context& context, int32_t func_num, size_t num_values, int64_t value1, int64_t value2 )
+{
+   function_handler p_handler = 0;
+
+   if( func_num >= 0 && func_num < e_function_range_end )
+      p_handler = context.p_functions[ func_num ].p_handlers[ num_values ];
+
+   if( p_handler )
+      return ( *p_handler )( context, func_num, value1, value2 );
+   else if( context.func_data.count( func_num ) )
+      return get_function_data( context, func_num );
+
+   return 0;
+}
+
+int64_t func( at_context& context, int8_t op, int32_t func_num )
+{
+   int64_t rc = call_function( context, func_num, 0, 0, 0 );
+
+   if( is_tracing( e_trace_category_func, e_trace_level_info ) )
+      trace( e_trace_event_call, op, context.state.pc, func_num, 0, 0, 0, rc );
+
+   return rc;
+}
+
+int64_t func1( at_context& context, int8_t op, int32_t func_num, int64_t value )
+{
+   int64_t rc = call_function( context, func_num, 1, value, 0 );
+
+   if( is_tracing( e_trace_category_func, e_trace_level_info ) )
+      trace( e_trace_event_call, op, context.state.pc, func_num, 1, value, 0, rc );
+
+   return rc;
+}
+
+int64_t func2( at_context& context, int8_t op, int32_t func_num, int64_t value1, int64_t value2 )
+{
+   int64_t rc = call_function( context, func_num, 2, value1, value2 );
+
+   if( is_tracing( e_trace_category_func, e_trace_level_info ) )
+      trace( e_trace_event_call, op, context.state.pc, func_num, 2, value1, value2, rc );
+
+   return rc;
+}
+
+int get_fun( int8_t* p_code, int32_t csize, const machine_state& state, int16_t& fun )
+{
+   if( state.pc + ( int32_t )sizeof( int16_t ) >= csize )
+      return -1;
+   else
+   {
+      fun = *( int16_t* )( p_code + state.pc + 1 );
+
+      return 0;
+   }
+}
+
+// NOTE: Divides (or gets the remainder of) a non-zero divisor with the one quotient that can't be
+// represented (the most negative value divided by -1) wrapping (rather than trapping) as overflows
+// do for the other arithmetic ops.
+inline int64_t divide( int64_t value, int64_t divisor )
+{
+   return divisor == -1 ? ( int64_t )( 0 - ( uint64_t )value ) : value / divisor;
+}
+
+inline int64_t modulo( int64_t value, int64_t divisor )
+{
+   return divisor == -1 ? 0 : value % divisor;
+}
+
+int get_addr( int8_t* p_code,
+ int32_t csize, int32_t dsize, const machine_state& state, int32_t& addr, bool is_code = false )
+{
+   if( state.pc + ( int32_t )sizeof( int32_t ) >= csize )
+      return -1;
+   else
+   {
+      addr = *( int32_t* )( p_code + state.pc + 1 );
+
+      if( addr < 0 || addr > c_max_to_multiply || ( is_code && addr >= csize ) )
+         return -1;
+      else if( !is_code && ( ( addr * 8 ) < 0 || ( addr * 8 ) + ( int32_t )sizeof( int64_t ) > dsize ) )
+         return -1;
+      else
+         return 0;
+   }
+}
+
+int get_addrs( int8_t* p_code,
+ int32_t csize, int32_t dsize, const machine_state& state, int32_t& addr1, int32_t& addr2 )
+{
+   if( state.pc + ( int32_t )sizeof( int32_t ) + ( int32_t )sizeof( int32_t ) >= csize )
+      return -1;
+   else
+   {
+      addr1 = *( int32_t* )( p_code + state.pc + 1 );
+      addr2 = *( int32_t* )( p_code + state.pc + 1 + sizeof( int32_t ) );
+
+      if( addr1 < 0 || addr1 > c_max_to_multiply
+       || addr2 < 0 || addr2 > c_max_to_multiply
+       || ( addr1 * 8 ) < 0 || ( addr2 * 8 ) < 0
+       || ( addr1 * 8 ) + ( int32_t )sizeof( int64_t ) > dsize
+       || ( addr2 * 8 ) + ( int32_t )sizeof( int64_t ) > dsize )
+         return -1;
+      else
+         return 0;
+   }
+}
+
+int get_addr_off( int8_t* p_code,
+ int32_t csize, int32_t dsize, const machine_state& state, int32_t& addr, int8_t& off )
+{
+   if( state.pc + ( int32_t )sizeof( int32_t ) + ( int32_t )sizeof( int8_t ) >= csize )
+      return -1;
+   else
+   {
+      addr = *( int32_t* )( p_code + state.pc + 1 );
+      off = *( int8_t* )( p_code + state.pc + 1 + sizeof( int32_t ) );
+
+      if( addr < 0 || addr > c_max_to_multiply || ( addr * 8 ) < 0
+       || ( addr * 8 ) + ( int32_t )sizeof( int64_t ) > dsize || state.pc + off >= csize )
+         return -1;
+      else
+         return 0;
+   }
+}
+
+int get_addrs_off( int8_t* p_code,
+ int32_t csize, int32_t dsize, const machine_state& state, int32_t& addr1, int32_t& addr2, int8_t& off )
+{
+   if( state.pc + ( int32_t )sizeof( int32_t ) + ( int32_t )sizeof( int32_t ) + ( int32_t )sizeof( int8_t ) >= csize )
+      return -1;
+   else
+   {
+      addr1 = *( int32_t* )( p_code + state.pc + 1 );
+      addr2 = *( int32_t* )( p_code + state.pc + 1 + sizeof( int32_t ) );
+      off = *( int8_t* )( p_code + state.pc + 1 + sizeof( int32_t ) + sizeof( int32_t ) );
+
+      if( addr1 < 0 || addr1 > c_max_to_multiply
+       || addr2 < 0 || addr2 > c_max_to_multiply
+       || ( addr1 * 8 ) < 0 || ( addr2 * 8 ) < 0
+       || ( addr1 * 8 ) + ( int32_t )sizeof( int64_t ) > dsize
+       || ( addr2 * 8 ) + ( int32_t )sizeof( int64_t ) > dsize || state.pc + off >= csize )
+         return -1;
+      else
+         return 0;
+   }
+}
+
+int get_fun_addr( int8_t* p_code,
+ int32_t csize, int32_t dsize, const machine_state& state, int16_t& fun, int32_t& addr )
+{
+   if( state.pc + ( int32_t )sizeof( int16_t ) + ( int32_t )sizeof( int32_t ) >= csize )
+      return -1;
+   else
+   {
+      fun = *( int16_t* )( p_code + state.pc + 1 );
+      addr = *( int32_t* )( p_code + state.pc + 1 + sizeof( int16_t ) );
+
+      if( addr < 0 || addr > c_max_to_multiply
+       || ( addr * 8 ) < 0 || ( addr * 8 ) + ( int32_t )sizeof( int64_t ) > dsize )
+         return -1;
+      else
+         return 0;
+   }
+}
+
+int get_fun_addrs( int8_t* p_code,
+ int32_t csize, int32_t dsize, const machine_state& state, int16_t& fun, int32_t& addr1, int32_t& addr2 )
+{
+   if( state.pc + ( int32_t )sizeof( int16_t )
+    + ( int32_t )sizeof( int32_t ) + ( int32_t )sizeof( int32_t ) >= csize )
+      return -1;
+   else
+   {
+      fun = *( int16_t* )( p_code + state.pc + 1 );
+      addr1 = *( int32_t* )( p_code + state.pc + 1 + sizeof( int16_t ) );
+      addr2 = *( int32_t* )( p_code + state.pc + 1 + sizeof( int16_t ) + sizeof( int32_t ) );
+
+      if( addr1 < 0 || addr1 > c_max_to_multiply
+       || addr2 < 0 || addr2 > c_max_to_multiply
+       || ( addr1 * 8 ) < 0 || ( addr2 * 8 ) < 0
+       || ( addr1 * 8 ) + ( int32_t )sizeof( int64_t ) > dsize
+       || ( addr2 * 8 ) + ( int32_t )sizeof( int64_t ) > dsize )
+         return -1;
+      else
+         return 0;
+   }
+}
+
+int get_addr_val( int8_t* p_code,
+ int32_t csize, int32_t dsize, const machine_state& state, int32_t& addr, int64_t& val )
+{
+   if( state.pc + ( int32_t )sizeof( int32_t ) + ( int32_t )sizeof( int64_t ) >= csize )
+      return -1;
+   else
+   {
+      addr = *( int32_t* )( p_code + state.pc + 1 );
+      val = *( int64_t* )( p_code + state.pc + 1 + ( int32_t )sizeof( int32_t ) );
+
+      if( addr < 0 || addr > c_max_to_multiply
+       || ( addr * 8 ) < 0 || ( addr * 8 ) + ( int32_t )sizeof( int64_t ) > dsize )
+         return -1;
+      else
+         return 0;
+   }
+}
+
+int process_op( at_context& context, bool disassemble )
+{
+   int8_t* p_code = context.ap_code.get( );
+   int8_t* p_data = context.ap_data.get( );
+
+   int32_t csize = context.csize( );
+   int32_t dsize = context.dsize( );
+   int32_t cssize = context.cssize( );
+   int32_t ussize = context.ussize( );
+
+   machine_state& state( context.state );
+
+   int rc = 0;
+
+   bool invalid = false;
+   bool had_overflow = false;
+
+   if( csize < 1 || state.pc >= csize )
+      return 0;
+
+   int8_t op = p_code[ state.pc ];
+
+   if( op && disassemble )
+   {
+      cout << hex << setw( 8 ) << setfill( '0' ) << state.pc;
+      if( state.pc == state.opc )
+         cout << "* ";
+      else
+         cout << "  ";
+   }
+
+   if( op == e_op_code_NOP )
+   {
+      if( disassemble )
+      {
+         cout << "NOP\n";
+         while( true )
+         {
+            ++rc;
+            if( state.pc + rc >= csize || p_code[ state.pc + rc ] != e_op_code_NOP )
+               break;
+         }
+      }
+      else while( true )
+      {
+         ++rc;
+         ++state.pc;
+         if( state.pc >= csize || p_code[ state.pc ] != e_op_code_NOP )
+            break;
+      }
+   }
+   else if( op == e_op_code_SET_VAL )
+   {
+      int32_t addr;
+      int64_t val;
+      rc = get_addr_val( p_code, csize, dsize, state, addr, val );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int32_t ) + sizeof( int64_t );
+
+         if( disassemble )
+         {
+            cout << "SET @" << hex << setw( 8 ) << setfill( '0' )
+             << addr << " #" << setw( 16 ) << setfill( '0' ) << val << '\n';
+         }
+         else
+         {
+            state.pc += rc;
+            *( int64_t* )( p_data + ( addr * 8 ) ) = val;
+         }
+      }
+   }
+   else if( op == e_op_code_SET_DAT )
+   {
+      int32_t addr1, addr2;
+      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int32_t ) + sizeof( int32_t );
+
+         if( disassemble )
+         {
+            cout << "SET @" << hex << setw( 8 ) << setfill( '0' )
+             << addr1 << " $" << setw( 8 ) << setfill( '0' ) << addr2 << '\n';
+         }
+         else
+         {
+            state.pc += rc;
+            *( int64_t* )( p_data + ( addr1 * 8 ) ) = *( int64_t* )( p_data + ( addr2 * 8 ) );
+         }
+      }
+   }
+   else if( op == e_op_code_CLR_DAT )
+   {
+      int32_t addr;
+      rc = get_addr( p_code, csize, dsize, state, addr );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int32_t );
+
+         if( disassemble )
+         {
+            cout << "CLR @" << hex << setw( 8 ) << setfill( '0' ) << addr << '\n';
+         }
+         else
+         {
+            state.pc += rc;
+            *( int64_t* )( p_data + ( addr * 8 ) ) = 0;
+         }
+      }
+   }
+   else if( op == e_op_code_INC_DAT || op == e_op_code_DEC_DAT || op == e_op_code_NOT_DAT )
+   {
+      int32_t addr;
+      rc = get_addr( p_code, csize, dsize, state, addr );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int32_t );
+
+         if( disassemble )
+         {
+            if( op == e_op_code_INC_DAT )
+               cout << "INC @";
+            else if( op == e_op_code_DEC_DAT )
+               cout << "DEC @";
+            else
+               cout << "NOT @";
+
+            cout << hex << setw( 8 ) << setfill( '0' ) << addr << '\n';
+         }
+         else
+         {
+            state.pc += rc;
+
+            if( op == e_op_code_INC_DAT )
+               ++*( int64_t* )( p_data + ( addr * 8 ) );
+            else if( op == e_op_code_DEC_DAT )
+               --*( int64_t* )( p_data + ( addr * 8 ) );
+            else
+               *( int64_t* )( p_data + ( addr * 8 ) ) = ~*( int64_t* )( p_data + ( addr * 8 ) );
+         }
+      }
+   }
+   else if( op == e_op_code_ADD_DAT || op == e_op_code_SUB_DAT
+    || op == e_op_code_MUL_DAT || op == e_op_code_DIV_DAT )
+   {
+      int32_t addr1, addr2;
+      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int32_t ) + sizeof( int32_t );
+
+         if( disassemble )
+         {
+            if( op == e_op_code_ADD_DAT )
+               cout << "ADD @";
+            else if( op == e_op_code_SUB_DAT )
+               cout << "SUB @";
+            else if( op == e_op_code_MUL_DAT )
+               cout << "MUL @";
+            else
+               cout << "DIV @";
+
+            cout << hex << setw( 8 ) << setfill( '0' )
+             << addr1 << " $" << setw( 8 ) << setfill( '0' ) << addr2 << '\n';
+         }
+         else
+         {
+            int64_t val = *( int64_t* )( p_data + ( addr2 * 8 ) );
+
+            if( op == e_op_code_DIV_DAT && val == 0 )
+               rc = -2;
+            else
+            {
+               state.pc += rc;
+
+               if( op == e_op_code_ADD_DAT )
+                  *( int64_t* )( p_data + ( addr1 * 8 ) ) += *( int64_t* )( p_data + ( addr2 * 8 ) );
+               else if( op == e_op_code_SUB_DAT )
+                  *( int64_t* )( p_data + ( addr1 * 8 ) ) -= *( int64_t* )( p_data + ( addr2 * 8 ) );
+               else if( op == e_op_code_MUL_DAT )
+                  *( int64_t* )( p_data + ( addr1 * 8 ) ) *= *( int64_t* )( p_data + ( addr2 * 8 ) );
+               else
+                  *( int64_t* )( p_data + ( addr1 * 8 ) ) = divide( *( int64_t* )( p_data + ( addr1 * 8 ) ), val );
+            }
+         }
+      }
+   }
+   else if( op == e_op_code_BOR_DAT
+    || op == e_op_code_AND_DAT || op == e_op_code_XOR_DAT )
+   {
+      int32_t addr1, addr2;
+      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int32_t ) + sizeof( int32_t );
+
+         if( disassemble )
+         {
+            if( op == e_op_code_BOR_DAT )
+               cout << "BOR @";
+            else if( op == e_op_code_AND_DAT )
+               cout << "AND @";
+            else
+               cout << "XOR @";
+
+            cout << hex << setw( 8 ) << setfill( '0' )
+             << addr1 << " $" << setw( 8 ) << setfill( '0' ) << addr2 << '\n';
+         }
+         else
+         {
+            state.pc += rc;
+            int64_t val = *( int64_t* )( p_data + ( addr2 * 8 ) );
+
+            if( op == e_op_code_BOR_DAT )
+               *( int64_t* )( p_data + ( addr1 * 8 ) ) |= val;
+            else if( op == e_op_code_AND_DAT )
+               *( int64_t* )( p_data + ( addr1 * 8 ) ) &= val;
+            else
+               *( int64_t* )( p_data + ( addr1 * 8 ) ) ^= val;
+         }
+      }
+   }
+   else if( op == e_op_code_SET_IND )
+   {
+      int32_t addr1, addr2;
+      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int32_t ) + sizeof( int32_t );
+
+         if( disassemble )
+         {
+            cout << "SET @" << hex << setw( 8 ) << setfill( '0' )
+             << addr1 << " $($" << setw( 8 ) << setfill( '0' ) << addr2 << ")\n";
+         }
+         else
+         {
+            int64_t addr = *( int64_t* )( p_data + ( addr2 * 8 ) );
+
+            if( addr < 0 || addr > c_max_to_multiply
+             || ( addr * 8 ) < 0 || ( addr * 8 ) + ( int32_t )sizeof( int64_t ) > dsize )
+               rc = -1;
+            else
+            {
+               state.pc += rc;
+              *( int64_t* )( p_data + ( addr1 * 8 ) ) = *( int64_t* )( p_data + ( addr * 8 ) );
+            }
+         }
+      }
+   }
+   else if( op == e_op_code_SET_IDX )
+   {
+      int32_t addr1, addr2;
+      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
+
+      int32_t size = sizeof( int32_t ) + sizeof( int32_t );
+
+      if( rc == 0 || disassemble )
+      {
+         int32_t addr3;
+         rc = get_addr( p_code + size, csize, dsize, state, addr3 );
+
+         if( rc == 0 || disassemble )
+         {
+            rc = 1 + size + sizeof( int32_t );
+
+            if( disassemble )
+            {
+               cout << "SET @" << hex << setw( 8 ) << setfill( '0' )
+                << addr1 << " $($" << setw( 8 ) << setfill( '0' ) << addr2
+                << "+$" << setw( 8 ) << setfill( '0' ) << addr3 << ")\n";
+            }
+            else
+            {
+               int64_t base = *( int64_t* )( p_data + ( addr2 * 8 ) );
+               int64_t offs = *( int64_t* )( p_data + ( addr3 * 8 ) );
+
+               int64_t addr = base + offs;
+
+               if( addr < 0 || addr > c_max_to_multiply
+                || ( addr * 8 ) < 0 || ( addr * 8 ) + ( int32_t )sizeof( int64_t ) > dsize )
+                  rc = -1;
+               else
+               {
+                  state.pc += rc;
+                 *( int64_t* )( p_data + ( addr1 * 8 ) ) = *( int64_t* )( p_data + ( addr * 8 ) );
+               }
+            }
+         }
+      }
+   }
+   else if( op == e_op_code_PSH_DAT || op == e_op_code_POP_DAT )
+   {
+      int32_t addr;
+      rc = get_addr( p_code, csize, dsize, state, addr );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int32_t );
+
+         if( disassemble )
+         {
+            if( op == e_op_code_PSH_DAT )
+               cout << "PSH $";
+            else
+               cout << "POP @";
+
+            cout << hex << setw( 8 ) << setfill( '0' ) << addr << '\n';
+         }
+         else if( ( op == e_op_code_PSH_DAT && state.us == ( ussize / 8 ) )
+          || ( op == e_op_code_POP_DAT && state.us == 0 ) )
+            rc = -1;
+         else
+         {
+            state.pc += rc;
+            if( op == e_op_code_PSH_DAT )
+               *( int64_t* )( p_data + dsize + cssize + ussize
+                - ( ++state.us * 8 ) ) = *( int64_t* )( p_data + ( addr * 8 ) );
+            else
+               *( int64_t* )( p_data + ( addr * 8 ) )
+                = *( int64_t* )( p_data + dsize + cssize + ussize - ( state.us-- * 8 ) );
+         }
+      }
+   }
+   else if( op == e_op_code_JMP_SUB )
+   {
+      int32_t addr;
+      rc = get_addr( p_code, csize, dsize, state, addr, true );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int32_t );
+
+         if( disassemble )
+         {
+            cout << "JSR :" << hex << setw( 8 ) << setfill( '0' ) << addr << '\n';
+         }
+         else
+         {
+            if( state.cs == ( cssize / 8 ) )
+               rc = -1;
+            else if( state.p_jumps->test( addr ) )
+            {
+               *( int64_t* )( p_data + dsize + cssize - ( ++state.cs * 8 ) ) = state.pc + rc;
+               state.pc = addr;
+            }
+            else
+               rc = -2;
+         }
+      }
+   }
+   else if( op == e_op_code_RET_SUB )
+   {
+      rc = 1;
+
+      if( disassemble )
+      {
+         cout << "RET\n";
+      }
+      else
+      {
+         if( state.cs == 0 )
+            rc = -1;
+         else
+         {
+            int64_t val = *( int64_t* )( p_data + dsize + cssize - ( state.cs-- * 8 ) );
+            int32_t addr = ( int32_t )val;
+            if( state.p_jumps->test( addr ) )
+               state.pc = addr;
+            else
+               rc = -2;
+         }
+      }
+   }
+   else if( op == e_op_code_IND_DAT )
+   {
+      int32_t addr1, addr2;
+      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int32_t ) + sizeof( int32_t );
+
+         if( disassemble )
+         {
+            cout << "SET @($" << hex << setw( 8 ) << setfill( '0' )
+             << addr1 << ") $" << setw( 8 ) << setfill( '0' ) << addr2 << "\n";
+         }
+         else
+         {
+            int64_t addr = *( int64_t* )( p_data + ( addr1 * 8 ) );
+
+            if( addr < 0 || addr > c_max_to_multiply
+             || ( addr * 8 ) < 0 || ( addr * 8 ) + ( int32_t )sizeof( int64_t ) > dsize )
+               rc = -1;
+            else
+            {
+               state.pc += rc;
+              *( int64_t* )( p_data + ( addr * 8 ) ) = *( int64_t* )( p_data + ( addr2 * 8 ) );
+            }
+         }
+      }
+   }
+   else if( op == e_op_code_IDX_DAT )
+   {
+      int32_t addr1, addr2;
+      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
+
+      int32_t size = sizeof( int32_t ) + sizeof( int32_t );
+
+      if( rc == 0 || disassemble )
+      {
+         int32_t addr3;
+         rc = get_addr( p_code + size, csize, dsize, state, addr3 );
+
+         if( rc == 0 || disassemble )
+         {
+            rc = 1 + size + sizeof( int32_t );
+
+            if( disassemble )
+            {
+               cout << "SET @($" << hex << setw( 8 ) << setfill( '0' )
+                << addr1 << "+$" << setw( 8 ) << setfill( '0' ) << addr2
+                << ") $" << setw( 8 ) << setfill( '0' ) << addr3 << "\n";
+            }
+            else
+            {
+               int64_t base = *( int64_t* )( p_data + ( addr1 * 8 ) );
+               int64_t offs = *( int64_t* )( p_data + ( addr2 * 8 ) );
+
+               int64_t addr = base + offs;
+
+               if( addr < 0 || addr > c_max_to_multiply
+                || ( addr * 8 ) < 0 || ( addr * 8 ) + ( int32_t )sizeof( int64_t ) > dsize )
+                  rc = -1;
+               else
+               {
+                  state.pc += rc;
+                 *( int64_t* )( p_data + ( addr * 8 ) ) = *( int64_t* )( p_data + ( addr3 * 8 ) );
+               }
+            }
+         }
+      }
+   }
+   else if( op == e_op_code_MOD_DAT )
+   {
+      int32_t addr1, addr2;
+      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int32_t ) + sizeof( int32_t );
+
+         if( disassemble )
+         {
+            cout << "MOD @" << hex << setw( 8 ) << setfill( '0' )
+             << addr1 << " $" << setw( 16 ) << setfill( '0' ) << addr2 << '\n';
+         }
+         else
+         {
+            int64_t val = *( int64_t* )( p_data + ( addr2 * 8 ) );
+
+            if( val == 0 )
+               rc = -2;
+            else
+            {
+               state.pc += rc;
+               *( int64_t* )( p_data + ( addr1 * 8 ) ) = modulo( *( int64_t* )( p_data + ( addr1 * 8 ) ), val );
+            }
+         }
+      }
+   }
+   else if( op == e_op_code_SHL_DAT )
+   {
+      int32_t addr1, addr2;
+      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int32_t ) + sizeof( int32_t );
+
+         if( disassemble )
+         {
+            cout << "SHL @" << hex << setw( 8 ) << setfill( '0' )
+             << addr1 << " $" << setw( 16 ) << setfill( '0' ) << addr2 << '\n';
+         }
+         else
+         {
+            state.pc += rc;
+            int64_t val = *( int64_t* )( p_data + ( addr2 * 8 ) );
+
+            *( int64_t* )( p_data + ( addr1 * 8 ) ) <<= val;
+         }
+      }
+   }
+   else if( op == e_op_code_SHR_DAT )
+   {
+      int32_t addr1, addr2;
+      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int32_t ) + sizeof( int32_t );
+
+         if( disassemble )
+         {
+            cout << "SHR @" << hex << setw( 8 ) << setfill( '0' )
+             << addr1 << " $" << setw( 16 ) << setfill( '0' ) << addr2 << '\n';
+         }
+         else
+         {
+            state.pc += rc;
+            int64_t val = *( int64_t* )( p_data + ( addr2 * 8 ) );
+
+            *( int64_t* )( p_data + ( addr1 * 8 ) ) >>= val;
+         }
+      }
+   }
+   else if( op == e_op_code_JMP_ADR )
+   {
+      int32_t addr;
+      rc = get_addr( p_code, csize, dsize, state, addr, true );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int32_t );
+
+         if( disassemble )
+         {
+            cout << "JMP :" << hex << setw( 8 ) << setfill( '0' ) << addr << '\n';
+         }
+         else if( state.p_jumps->test( addr ) )
+            state.pc = addr;
+         else
+            rc = -2;
+      }
+   }
+   else if( op == e_op_code_BZR_DAT || op == e_op_code_BNZ_DAT )
+   {
+      int8_t off;
+      int32_t addr;
+      rc = get_addr_off( p_code, csize, dsize, state, addr, off );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int32_t ) + sizeof( int8_t );
+
+         if( disassemble )
+         {
+            if( op == e_op_code_BZR_DAT )
+               cout << "BZR $";
+            else
+               cout << "BNZ $";
+
+            cout << hex << setw( 8 ) << setfill( '0' )
+             << addr << " :" << setw( 8 ) << setfill( '0' ) << ( state.pc + off ) << '\n';
+         }
+         else
+         {
+            int64_t val = *( int64_t* )( p_data + ( addr * 8 ) );
+
+            if( ( op == e_op_code_BZR_DAT && val == 0 )
+             || ( op == e_op_code_BNZ_DAT && val != 0 ) )
+            {
+               if( state.p_jumps->test( state.pc + off ) )
+                  state.pc += off;
+               else
+                  rc = -2;
+            }
+            else
+               state.pc += rc;
+         }
+      }
+   }
+   else if( op == e_op_code_BGT_DAT || op == e_op_code_BLT_DAT
+    || op == e_op_code_BGE_DAT || op == e_op_code_BLE_DAT
+    || op == e_op_code_BEQ_DAT || op == e_op_code_BNE_DAT )
+   {
+      int8_t off;
+      int32_t addr1, addr2;
+      rc = get_addrs_off( p_code, csize, dsize, state, addr1, addr2, off );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int32_t ) + sizeof( int32_t ) + sizeof( int8_t );
+
+         if( disassemble )
+         {
+            if( op == e_op_code_BGT_DAT )
+               cout << "BGT $";
+            else if( op == e_op_code_BLT_DAT )
+               cout << "BLT $";
+            else if( op == e_op_code_BGE_DAT )
+               cout << "BGE $";
+            else if( op == e_op_code_BLE_DAT )
+               cout << "BLE $";
+            else if( op == e_op_code_BEQ_DAT )
+               cout << "BEQ $";
+            else
+               cout << "BNE $";
+
+            cout << hex << setw( 8 ) << setfill( '0' )
+             << addr1 << " $" << setw( 8 ) << setfill( '0' )
+             << addr2 << " :" << setw( 8 ) << setfill( '0' ) << ( state.pc + off ) << '\n';
+         }
+         else
+         {
+            int64_t val1 = *( int64_t* )( p_data + ( addr1 * 8 ) );
+            int64_t val2 = *( int64_t* )( p_data + ( addr2 * 8 ) );
+
+            if( ( op == e_op_code_BGT_DAT && val1 > val2 )
+             || ( op == e_op_code_BLT_DAT && val1 < val2 )
+             || ( op == e_op_code_BGE_DAT && val1 >= val2 )
+             || ( op == e_op_code_BLE_DAT && val1 <= val2 )
+             || ( op == e_op_code_BEQ_DAT && val1 == val2 )
+             || ( op == e_op_code_BNE_DAT && val1 != val2 ) )
+            {
+               if( state.p_jumps->test( state.pc + off ) )
+                  state.pc += off;
+               else
+                  rc = -2;
+            }
+            else
+               state.pc += rc;
+         }
+      }
+   }
+   else if( op == e_op_code_SLP_DAT )
+   {
+      int32_t addr;
+      rc = get_addr( p_code, csize, dsize, state, addr );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int32_t );
+
+         if( disassemble )
+         {
+            cout << "SLP @" << hex << setw( 8 ) << setfill( '0' ) << addr << '\n';
+         }
+         else
+         {
+            // NOTE: The block height is the high order 32 bits of $addr (if this is not after the
+            // current block height then it will sleep until the next block).
+            int32_t height = ( int32_t )( *( int64_t* )( p_data + ( addr * 8 ) ) >> 32 );
+
+            state.sleep_until = height > context.height ? height : context.height + 1;
+
+            state.pc += rc;
+         }
+      }
+   }
+   else if( op == e_op_code_FIZ_DAT || op == e_op_code_STZ_DAT )
+   {
+      int32_t addr;
+      rc = get_addr( p_code, csize, dsize, state, addr );
+
+      if( rc == 0 || disassemble )
+      {
+         if( disassemble )
+         {
+            rc = 1 + sizeof( int32_t );
+
+            if( op == e_op_code_FIZ_DAT )
+               cout << "FIZ $";
+            else
+               cout << "STZ $";
+
+            cout << hex << setw( 8 ) << setfill( '0' ) << addr << '\n';
+         }
+         else
+         {
+            if( *( int64_t* )( p_data + ( addr * 8 ) ) == 0 )
+            {
+               if( op == e_op_code_STZ_DAT )
+               {
+                  state.pc += rc;
+                  state.stopped = true;
+               }   
+               else
+               {
+                  state.pc = state.pcs;
+                  state.finished = true;
+               }
+            }
+            else
+            {
+               rc = 1 + sizeof( int32_t );
+               state.pc += rc;
+            }
+         }
+      }
+   }
+   else if( op == e_op_code_FIN_IMD || op == e_op_code_STP_IMD )
+   {
+      if( disassemble )
+      {
+         rc = 1;
+
+         if( op == e_op_code_FIN_IMD )
+            cout << "FIN\n";
+         else
+            cout << "STP\n";
+      }
+      else if( op == e_op_code_STP_IMD )
+      {
+         state.pc += rc;
+         state.stopped = true;
+      }
+      else
+      {
+         state.pc = state.pcs;
+         state.finished = true;
+      }
+   }
+   else if( op == e_op_code_SLP_IMD )
+   {
+      if( rc == 0 || disassemble )
+      {
+         rc = 1;
+
+         if( disassemble )
+         {
+            cout << "SLP\n";
+         }
+         else
+         {
+            state.sleep_until = context.height + 1;
+
+            state.pc += rc;
+         }
+      }
+   }
+   else if( op == e_op_code_ERR_ADR )
+   {
+      int32_t addr;
+      rc = get_addr( p_code, csize, dsize, state, addr, true );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int32_t );
+
+         if( disassemble )
+         {
+            cout << "ERR :" << hex << setw( 8 ) << setfill( '0' ) << addr << '\n';
+         }
+         else if( state.p_jumps->test( addr ) )
+            state.pce = addr;
+         else
+            rc = -3;
+      }
+   }
+   else if( op == e_op_code_SET_PCS )
+   {
+      rc = 1;
+
+      if( disassemble )
+      {
+         cout << "PCS\n";
+      }
+      else
+      {
+         state.pc += rc;
+         state.pcs = state.pc;
+      }
+   }
+   else if( op == e_op_code_EXT_FUN )
+   {
+      int16_t fun;
+      rc = get_fun( p_code, csize, state, fun );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int16_t );
+
+         if( disassemble )
+         {
+            if( fun < 0x100 )
+               cout << "FUN " << dec << fun << "\n";
+            else
+               cout << "FUN " << decode_function_name( fun, op ) << "\n";
+         }
+         else
+         {
+            state.pc += rc;
+            func( context, op, fun );
+         }
+      }
+   }
+   else if( op == e_op_code_EXT_FUN_DAT )
+   {
+      int16_t fun;
+      int32_t addr;
+      rc = get_fun_addr( p_code, csize, dsize, state, fun, addr );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int16_t ) + sizeof( int32_t );
+
+         if( disassemble )
+         {
+            if( fun < 0x100 )
+               cout << "FUN " << dec << fun << " $" << hex << setw( 8 ) << setfill( '0' ) << addr << "\n";
+            else
+               cout << "FUN " << decode_function_name( fun, op )
+                << " $" << hex << setw( 8 ) << setfill( '0' ) << addr << "\n";
+         }
+         else
+         {
+            state.pc += rc;
+            int64_t val = *( int64_t* )( p_data + ( addr * 8 ) );
+
+            func1( context, op, fun, val );
+         }
+      }
+   }
+   else if( op == e_op_code_EXT_FUN_DAT_2 )
+   {
+      int16_t fun;
+      int32_t addr1, addr2;
+      rc = get_fun_addrs( p_code, csize, dsize, state, fun, addr1, addr2 );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int16_t ) + sizeof( int32_t ) + sizeof( int32_t );
+
+         if( disassemble )
+         {
+            if( fun < 0x100 )
+               cout << "FUN " << dec << fun << " $" << hex << setw( 8 )
+                << setfill( '0' ) << addr1 << " $" << setw( 8 ) << setfill( '0' ) << addr2 << "\n";
+            else
+               cout << "FUN " << decode_function_name( fun, op ) << " $" << hex << setw( 8 )
+                << setfill( '0' ) << addr1 << " $" << setw( 8 ) << setfill( '0' ) << addr2 << "\n";
+         }
+         else
+         {
+            state.pc += rc;
+            int64_t val1 = *( int64_t* )( p_data + ( addr1 * 8 ) );
+            int64_t val2 = *( int64_t* )( p_data + ( addr2 * 8 ) );
+
+            func2( context, op, fun, val1, val2 );
+         }
+      }
+   }
+   else if( op == e_op_code_EXT_FUN_RET )
+   {
+      int16_t fun;
+      int32_t addr;
+      rc = get_fun_addr( p_code, csize, dsize, state, fun, addr );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + sizeof( int16_t ) + sizeof( int32_t );
+
+         if( disassemble )
+         {
+            if( fun < 0x100 )
+               cout << "FUN @" << hex << setw( 8 ) << setfill( '0' ) << addr << ' ' << dec << fun << '\n';
+            else
+               cout << "FUN @" << hex << setw( 8 ) << setfill( '0' ) << addr
+                << " " << decode_function_name( fun, op ) << '\n';
+         }
+         else
+         {
+            state.pc += rc;
+            int64_t result = func( context, op, fun );
+
+            if( !context.func_failed )
+               *( int64_t* )( p_data + ( addr * 8 ) ) = result;
+         }
+      }
+   }
+   else if( op == e_op_code_EXT_FUN_RET_DAT || op == e_op_code_EXT_FUN_RET_DAT_2 )
+   {
+      int16_t fun;
+      int32_t addr1, addr2;
+      rc = get_fun_addrs( p_code, csize, dsize, state, fun, addr1, addr2 );
+
+      int32_t size = sizeof( int16_t ) + sizeof( int32_t ) + sizeof( int32_t );
+
+      int32_t addr3;
+      if( ( rc == 0 || disassemble ) && op == e_op_code_EXT_FUN_RET_DAT_2 )
+         rc = get_addr( p_code + size, csize, dsize, state, addr3 );
+
+      if( rc == 0 || disassemble )
+      {
+         rc = 1 + size + ( op == e_op_code_EXT_FUN_RET_DAT_2 ? sizeof( int32_t ) : 0 );
+
+         if( disassemble )
+         {
+            if( fun < 0x100 )
+               cout << "FUN @" << hex << setw( 8 ) << setfill( '0' ) << addr1
+                << ' ' << dec << fun << " $" << setw( 8 ) << setfill( '0' ) << addr2;
+            else
+               cout << "FUN @" << hex << setw( 8 ) << setfill( '0' ) << addr1 << " "
+                << decode_function_name( fun, op ) << " $" << setw( 8 ) << setfill( '0' ) << addr2;
+
+            if( op == e_op_code_EXT_FUN_RET_DAT_2 )
+               cout << " $" << setw( 8 ) << setfill( '0' ) << addr3;
+
+            cout << "\n";
+         }
+         else
+         {
+            state.pc += rc;
+            int64_t val = *( int64_t* )( p_data + ( addr2 * 8 ) );
+
+            int64_t result;
+
+            if( op != e_op_code_EXT_FUN_RET_DAT_2 )
+               result = func1( context, op, fun, val );
+            else
+            {
+               int64_t val2 = *( int64_t* )( p_data + ( addr3 * 8 ) );
+               result = func2( context, op, fun, val, val2 );
+            }
+
+            if( !context.func_failed )
+               *( int64_t* )( p_data + ( addr1 * 8 ) ) = result;
+         }
+      }
+   }
+   else
+   {
+      if( !disassemble )
+         rc = -2;
+   }
+
+   // NOTE: A function handler can fail the op that called it (such as for a divide by zero).
+   if( context.func_failed )
+   {
+      context.func_failed = false;
+
+      state.pc -= rc;
+      rc = -1;
+   }
+
+   if( rc == -1 && state.pce )
+   {
+      rc = 0;
+      state.pc = state.pce;
+   }
+
+   if( rc == -1 && disassemble )
+      cout << "\n(overflow)\n";
+
+   if( rc == -2 && disassemble )
+      cout << "\n(invalid op)\n";
+
+   if( rc >= 0 )
+      ++state.steps;
+
+   return rc;
+}
+
+// NOTE: The op kinds are a dense numbering of the op codes (used for dispatching decoded ops).
+enum op_kind
+{
+   e_op_kind_invalid,
+   e_op_kind_NOP,
+   e_op_kind_SET_VAL,
+   e_op_kind_SET_DAT,
+   e_op_kind_CLR_DAT,
+   e_op_kind_INC_DAT,
+   e_op_kind_DEC_DAT,
+   e_op_kind_ADD_DAT,
+   e_op_kind_SUB_DAT,
+   e_op_kind_MUL_DAT,
+   e_op_kind_DIV_DAT,
+   e_op_kind_BOR_DAT,
+   e_op_kind_AND_DAT,
+   e_op_kind_XOR_DAT,
+   e_op_kind_NOT_DAT,
+   e_op_kind_SET_IND,
+   e_op_kind_SET_IDX,
+   e_op_kind_PSH_DAT,
+   e_op_kind_POP_DAT,
+   e_op_kind_JMP_SUB,
+   e_op_kind_RET_SUB,
+   e_op_kind_IND_DAT,
+   e_op_kind_IDX_DAT,
+   e_op_kind_MOD_DAT,
+   e_op_kind_SHL_DAT,
+   e_op_kind_SHR_DAT,
+   e_op_kind_JMP_ADR,
+   e_op_kind_BZR_DAT,
+   e_op_kind_BNZ_DAT,
+   e_op_kind_BGT_DAT,
+   e_op_kind_BLT_DAT,
+   e_op_kind_BGE_DAT,
+   e_op_kind_BLE_DAT,
+   e_op_kind_BEQ_DAT,
+   e_op_kind_BNE_DAT,
+   e_op_kind_SLP_DAT,
+   e_op_kind_FIZ_DAT,
+   e_op_kind_STZ_DAT,
+   e_op_kind_FIN_IMD,
+   e_op_kind_STP_IMD,
+   e_op_kind_SLP_IMD,
+   e_op_kind_ERR_ADR,
+   e_op_kind_SET_PCS,
+   e_op_kind_EXT_FUN,
+   e_op_kind_EXT_FUN_DAT,
+   e_op_kind_EXT_FUN_DAT_2,
+   e_op_kind_EXT_FUN_RET,
+   e_op_kind_EXT_FUN_RET_DAT,
+   e_op_kind_EXT_FUN_RET_DAT_2,
+   e_op_kind_error, // an op that will always fail (with the return code of the decoded op)
+   e_op_kind_checked, // an op that is executed via "process_op" (as it could not be verified)
+   e_op_kind_INC_BNE, // fused ops (see "fuse_code")
+   e_op_kind_SET_VAL_RUN,
+   e_op_kind_EXT_FUN_RET_BZR,
+   e_op_kind_EXT_FUN_DAT_2_PAIR,
+};
+
+int8_t get_op_kind( int8_t op )
+{
+   switch( op )
+   {
+      case e_op_code_NOP:
+      return e_op_kind_NOP;
+
+      case e_op_code_SET_VAL:
+      return e_op_kind_SET_VAL;
+
+      case e_op_code_SET_DAT:
+      return e_op_kind_SET_DAT;
+
+      case e_op_code_CLR_DAT:
+      return e_op_kind_CLR_DAT;
+
+      case e_op_code_INC_DAT:
+      return e_op_kind_INC_DAT;
+
+      case e_op_code_DEC_DAT:
+      return e_op_kind_DEC_DAT;
+
+      case e_op_code_ADD_DAT:
+      return e_op_kind_ADD_DAT;
+
+      case e_op_code_SUB_DAT:
+      return e_op_kind_SUB_DAT;
+
+      case e_op_code_MUL_DAT:
+      return e_op_kind_MUL_DAT;
+
+      case e_op_code_DIV_DAT:
+      return e_op_kind_DIV_DAT;
+
+      case e_op_code_BOR_DAT:
+      return e_op_kind_BOR_DAT;
+
+      case e_op_code_AND_DAT:
+      return e_op_kind_AND_DAT;
+
+      case e_op_code_XOR_DAT:
+      return e_op_kind_XOR_DAT;
+
+      case e_op_code_NOT_DAT:
+      return e_op_kind_NOT_DAT;
+
+      case e_op_code_SET_IND:
+      return e_op_kind_SET_IND;
+
+      case e_op_code_SET_IDX:
+      return e_op_kind_SET_IDX;
+
+      case e_op_code_PSH_DAT:
+      return e_op_kind_PSH_DAT;
+
+      case e_op_code_POP_DAT:
+      return e_op_kind_POP_DAT;
+
+      case e_op_code_JMP_SUB:
+      return e_op_kind_JMP_SUB;
+
+      case e_op_code_RET_SUB:
+      return e_op_kind_RET_SUB;
+
+      case e_op_code_IND_DAT:
+      return e_op_kind_IND_DAT;
+
+      case e_op_code_IDX_DAT:
+      return e_op_kind_IDX_DAT;
+
+      case e_op_code_MOD_DAT:
+      return e_op_kind_MOD_DAT;
+
+      case e_op_code_SHL_DAT:
+      return e_op_kind_SHL_DAT;
+
+      case e_op_code_SHR_DAT:
+      return e_op_kind_SHR_DAT;
+
+      case e_op_code_JMP_ADR:
+      return e_op_kind_JMP_ADR;
+
+      case e_op_code_BZR_DAT:
+      return e_op_kind_BZR_DAT;
+
+      case e_op_code_BNZ_DAT:
+      return e_op_kind_BNZ_DAT;
+
+      case e_op_code_BGT_DAT:
+      return e_op_kind_BGT_DAT;
+
+      case e_op_code_BLT_DAT:
+      return e_op_kind_BLT_DAT;
+
+      case e_op_code_BGE_DAT:
+      return e_op_kind_BGE_DAT;
+
+      case e_op_code_BLE_DAT:
+      return e_op_kind_BLE_DAT;
+
+      case e_op_code_BEQ_DAT:
+      return e_op_kind_BEQ_DAT;
+
+      case e_op_code_BNE_DAT:
+      return e_op_kind_BNE_DAT;
+
+      case e_op_code_SLP_DAT:
+      return e_op_kind_SLP_DAT;
+
+      case e_op_code_FIZ_DAT:
+      return e_op_kind_FIZ_DAT;
+
+      case e_op_code_STZ_DAT:
+      return e_op_kind_STZ_DAT;
+
+      case e_op_code_FIN_IMD:
+      return e_op_kind_FIN_IMD;
+
+      case e_op_code_STP_IMD:
+      return e_op_kind_STP_IMD;
+
+      case e_op_code_SLP_IMD:
+      return e_op_kind_SLP_IMD;
+
+      case e_op_code_ERR_ADR:
+      return e_op_kind_ERR_ADR;
+
+      case e_op_code_SET_PCS:
+      return e_op_kind_SET_PCS;
+
+      case e_op_code_EXT_FUN:
+      return e_op_kind_EXT_FUN;
+
+      case e_op_code_EXT_FUN_DAT:
+      return e_op_kind_EXT_FUN_DAT;
+
+      case e_op_code_EXT_FUN_DAT_2:
+      return e_op_kind_EXT_FUN_DAT_2;
+
+      case e_op_code_EXT_FUN_RET:
+      return e_op_kind_EXT_FUN_RET;
+
+      case e_op_code_EXT_FUN_RET_DAT:
+      return e_op_kind_EXT_FUN_RET_DAT;
+
+      case e_op_code_EXT_FUN_RET_DAT_2:
+      return e_op_kind_EXT_FUN_RET_DAT_2;
+
+      default:
+      return e_op_kind_invalid;
+   }
+}
+
+enum verify_flag
+{
+   e_verify_flag_reachable = 0x01,
+   e_verify_flag_indirect = 0x02,
+   e_verify_flag_stack = 0x04,
+   e_verify_flag_invalid = 0x08
+};
+
+// NOTE: Verifies the decoded ops so that the fast engine only needs to check what can't be known
+// until the ops are executed (i.e. indirect addresses, stack usage and divisors). Ops whose static
+// operands are invalid become "error" ops (that fail exactly as "process_op" would) whilst jumps
+// and branches to addresses that are not valid jump destinations become "checked" ops. Reachable
+// ops (from the start of the code or via any "ERR" or "JSR" address) are also flagged along with
+// those that will need runtime checks.
+void verify_code( decoded_code& code, int32_t cssize, int32_t ussize )
+{
+   vector< int32_t > pending;
+
+   if( !code.ops.empty( ) && code.index[ 0 ] == 0 )
+      pending.push_back( 0 );
+
+   while( !pending.empty( ) )
+   {
+      int32_t i = pending.back( );
+      pending.pop_back( );
+
+      decoded_op& d( code.ops[ i ] );
+
+      if( d.flags & e_verify_flag_reachable )
+         continue;
+
+      d.flags |= e_verify_flag_reachable;
+
+      bool falls_through = true;
+
+      switch( d.op )
+      {
+         case e_op_code_SET_IND:
+         case e_op_code_SET_IDX:
+         case e_op_code_IND_DAT:
+         case e_op_code_IDX_DAT:
+         d.flags |= e_verify_flag_indirect;
+         break;
+
+         case e_op_code_PSH_DAT:
+         case e_op_code_POP_DAT:
+         d.flags |= e_verify_flag_stack;
+         if( ussize < 8 )
+            d.flags |= e_verify_flag_invalid;
+         break;
+
+         case e_op_code_JMP_SUB:
+         case e_op_code_RET_SUB:
+         d.flags |= e_verify_flag_stack;
+         if( cssize < 8 )
+            d.flags |= e_verify_flag_invalid;
+         if( d.op == e_op_code_RET_SUB )
+            falls_through = false;
+         break;
+
+         case e_op_code_JMP_ADR:
+         case e_op_code_FIN_IMD:
+         case e_op_code_STP_IMD:
+         falls_through = false;
+         break;
+      }
+
+      if( d.rc != 0 )
+      {
+         d.flags |= e_verify_flag_invalid;
+         falls_through = false;
+      }
+      else if( d.dest >= 0 && d.target < 0 )
+         d.flags |= e_verify_flag_invalid;
+
+      // NOTE: The op following a "JSR" is reachable via "RET" and an "ERR" address is reachable
+      // via any op that overflows.
+      if( falls_through && d.next >= 0 )
+         pending.push_back( d.next );
+
+      if( d.target >= 0 )
+         pending.push_back( d.target );
+   }
+
+   for( size_t i = 0; i < code.ops.size( ); i++ )
+   {
+      decoded_op& d( code.ops[ i ] );
+
+      if( d.rc != 0 )
+         d.kind = e_op_kind_error;
+      else if( d.dest >= 0 && d.target < 0 )
+      {
+         if( d.op == e_op_code_JMP_ADR )
+         {
+            d.rc = -2;
+            d.kind = e_op_kind_error;
+         }
+         else if( d.op == e_op_code_ERR_ADR )
+         {
+            d.rc = -3;
+            d.kind = e_op_kind_error;
+         }
+         else
+            d.kind = e_op_kind_checked;
+      }
+   }
+}
+
+bool is_block_end( const decoded_op& d )
+{
+   switch( d.kind )
+   {
+      case e_op_kind_NOP:
+      case e_op_kind_SET_VAL:
+      case e_op_kind_SET_DAT:
+      case e_op_kind_CLR_DAT:
+      case e_op_kind_INC_DAT:
+      case e_op_kind_DEC_DAT:
+      case e_op_kind_ADD_DAT:
+      case e_op_kind_SUB_DAT:
+      case e_op_kind_MUL_DAT:
+      case e_op_kind_DIV_DAT:
+      case e_op_kind_BOR_DAT:
+      case e_op_kind_AND_DAT:
+      case e_op_kind_XOR_DAT:
+      case e_op_kind_NOT_DAT:
+      case e_op_kind_SET_IND:
+      case e_op_kind_SET_IDX:
+      case e_op_kind_PSH_DAT:
+      case e_op_kind_POP_DAT:
+      case e_op_kind_IND_DAT:
+      case e_op_kind_IDX_DAT:
+      case e_op_kind_MOD_DAT:
+      case e_op_kind_SHL_DAT:
+      case e_op_kind_SHR_DAT:
+      return false;
+
+      default:
+      return true;
+   }
+}
+
+bool is_ext_fun( const decoded_op& d )
+{
+   return d.kind >= e_op_kind_EXT_FUN && d.kind <= e_op_kind_EXT_FUN_RET_DAT_2;
+}
+
+// NOTE: A basic block ends with any op that doesn't simply continue with the next one (or an op
+// that is followed by a jump destination or an external function call so that any external call
+// will always be a block by itself).
+void find_basic_blocks( decoded_code& code )
+{
+   vector< bool > leaders( code.ops.size( ) );
+
+   for( size_t i = 0; i < code.ops.size( ); i++ )
+   {
+      const decoded_op& d( code.ops[ i ] );
+
+      if( d.target >= 0 )
+         leaders[ d.target ] = true;
+
+      if( is_ext_fun( d ) )
+         leaders[ i ] = true;
+   }
+
+   for( size_t i = code.ops.size( ); i > 0; i-- )
+   {
+      decoded_op& d( code.ops[ i - 1 ] );
+
+      d.block_left = 1;
+
+      if( !is_block_end( d ) && d.next >= 0 && !leaders[ d.next ] )
+         d.block_left += code.ops[ d.next ].block_left;
+   }
+}
+
+// NOTE: Common sequences of ops are fused so that they are executed by a single handler (which
+// still counts each of the original ops as a step). Fusing within a basic block requires that all
+// of the fused ops have already been charged for (otherwise only the first op is executed) whereas
+// an external function call can only be fused with the op that follows it if the function can't
+// change the balance (i.e. it has been declared with "set_keeps_balance"). As decoded code can be
+// shared by ATs this is checked against the registered functions (so a function table that is not
+// a copy of them must not replace a function that keeps the balance with one that doesn't).
+void fuse_code( decoded_code& code )
+{
+   for( size_t i = code.ops.size( ); i > 0; i-- )
+   {
+      decoded_op& d( code.ops[ i - 1 ] );
+
+      d.fused = 0;
+      d.dispatch = d.kind;
+
+      if( d.next < 0 )
+         continue;
+
+      const decoded_op& n( code.ops[ d.next ] );
+
+      if( d.kind == e_op_kind_INC_DAT && n.kind == e_op_kind_BNE_DAT && d.block_left > 1 )
+      {
+         d.fused = 2;
+         d.dispatch = e_op_kind_INC_BNE;
+      }
+      else if( d.kind == e_op_kind_SET_VAL && n.kind == e_op_kind_SET_VAL && d.block_left > 1 )
+      {
+         d.fused = n.fused ? n.fused + 1 : 2;
+         d.dispatch = e_op_kind_SET_VAL_RUN;
+      }
+      else if( d.kind == e_op_kind_EXT_FUN_RET && n.kind == e_op_kind_BZR_DAT && keeps_balance( d.fun ) )
+      {
+         d.fused = 2;
+         d.dispatch = e_op_kind_EXT_FUN_RET_BZR;
+      }
+      else if( d.kind == e_op_kind_EXT_FUN_DAT_2 && n.kind == e_op_kind_EXT_FUN_DAT_2
+       && ( ( d.fun == 0x0114 && n.fun == 0x0115 ) || ( d.fun == 0x011a && n.fun == 0x011b ) )
+       && keeps_balance( d.fun ) && keeps_balance( n.fun ) )
+      {
+         d.fused = 2;
+         d.dispatch = e_op_kind_EXT_FUN_DAT_2_PAIR;
+      }
+   }
+}
+
+void decode_code( decoded_code& code, int8_t* p_code,
+ int32_t csize, int32_t dsize, int32_t cssize, int32_t ussize )
+{
+   // NOTE: As code can be decoded on any thread the version is incremented atomically (so that no
+   // two decodings can ever have the same version).
+   static int64_t volatile s_version = 0;
+
+   code.csize = csize;
+   code.dsize = dsize;
+
+   code.cssize = cssize;
+   code.ussize = ussize;
+
+   code.version = atomic_increment( &s_version );
+
+   code.bytes.assign( p_code, p_code + ( csize > 0 ? csize : 0 ) );
+
+   code.ops.clear( );
+   code.index.assign( csize > 0 ? csize : 0, -1 );
+
+   code.jumps.reset( csize );
+
+   machine_state state;
+
+   // NOTE: The ops are decoded using the same linear sweep (and the same operand validation) that
+   // "list_code" uses with the start of each decoded op being a valid jump destination.
+   while( state.pc < csize )
+   {
+      decoded_op d;
+
+      d.op = p_code[ state.pc ];
+      d.pc = state.pc;
+      d.kind = get_op_kind( d.op );
+
+      int rc = 0;
+      int8_t off = 0;
+
+      switch( d.op )
+      {
+         case e_op_code_NOP:
+         d.size = 1;
+         while( state.pc + d.size < csize && p_code[ state.pc + d.size ] == e_op_code_NOP )
+            ++d.size;
+         break;
+
+         case e_op_code_SET_VAL:
+         rc = get_addr_val( p_code, csize, dsize, state, d.addr1, d.val );
+         d.size = 1 + sizeof( int32_t ) + sizeof( int64_t );
+         break;
+
+         case e_op_code_SET_DAT:
+         case e_op_code_ADD_DAT:
+         case e_op_code_SUB_DAT:
+         case e_op_code_MUL_DAT:
+         case e_op_code_DIV_DAT:
+         case e_op_code_BOR_DAT:
+         case e_op_code_AND_DAT:
+         case e_op_code_XOR_DAT:
+         case e_op_code_SET_IND:
+         case e_op_code_IND_DAT:
+         case e_op_code_MOD_DAT:
+         case e_op_code_SHL_DAT:
+         case e_op_code_SHR_DAT:
+         rc = get_addrs( p_code, csize, dsize, state, d.addr1, d.addr2 );
+         d.size = 1 + sizeof( int32_t ) + sizeof( int32_t );
+         break;
+
+         case e_op_code_SET_IDX:
+         case e_op_code_IDX_DAT:
+         rc = get_addrs( p_code, csize, dsize, state, d.addr1, d.addr2 );
+         if( rc == 0 )
+            rc = get_addr( p_code + sizeof( int32_t ) + sizeof( int32_t ), csize, dsize, state, d.addr3 );
+         d.size = 1 + sizeof( int32_t ) + sizeof( int32_t ) + sizeof( int32_t );
+         break;
+
+         case e_op_code_CLR_DAT:
+         case e_op_code_INC_DAT:
+         case e_op_code_DEC_DAT:
+         case e_op_code_NOT_DAT:
+         case e_op_code_PSH_DAT:
+         case e_op_code_POP_DAT:
+         case e_op_code_FIZ_DAT:
+         case e_op_code_STZ_DAT:
+         rc = get_addr( p_code, csize, dsize, state, d.addr1 );
+         d.size = 1 + sizeof( int32_t );
+         break;
+
+         case e_op_code_JMP_SUB:
+         case e_op_code_JMP_ADR:
+         case e_op_code_ERR_ADR:
+         rc = get_addr( p_code, csize, dsize, state, d.addr1, true );
+         d.size = 1 + sizeof( int32_t );
+         if( rc == 0 )
+            d.dest = d.addr1;
+         break;
+
+         case e_op_code_SLP_DAT:
+         rc = get_addr( p_code, csize, dsize, state, d.addr1 );
+         d.size = 1 + sizeof( int32_t );
+         break;
+
+         case e_op_code_BZR_DAT:
+         case e_op_code_BNZ_DAT:
+         rc = get_addr_off( p_code, csize, dsize, state, d.addr1, off );
+         d.size = 1 + sizeof( int32_t ) + sizeof( int8_t );
+         if( rc == 0 )
+            d.dest = state.pc + off;
+         break;
+
+         case e_op_code_BGT_DAT:
+         case e_op_code_BLT_DAT:
+         case e_op_code_BGE_DAT:
+         case e_op_code_BLE_DAT:
+         case e_op_code_BEQ_DAT:
+         case e_op_code_BNE_DAT:
+         rc = get_addrs_off( p_code, csize, dsize, state, d.addr1, d.addr2, off );
+         d.size = 1 + sizeof( int32_t ) + sizeof( int32_t ) + sizeof( int8_t );
+         if( rc == 0 )
+            d.dest = state.pc + off;
+         break;
+
+         case e_op_code_RET_SUB:
+         case e_op_code_FIN_IMD:
+         case e_op_code_STP_IMD:
+         case e_op_code_SLP_IMD:
+         case e_op_code_SET_PCS:
+         d.size = 1;
+         break;
+
+         case e_op_code_EXT_FUN:
+         rc = get_fun( p_code, csize, state, d.fun );
+         d.size = 1 + sizeof( int16_t );
+         break;
+
+         case e_op_code_EXT_FUN_DAT:
+         case e_op_code_EXT_FUN_RET:
+         rc = get_fun_addr( p_code, csize, dsize, state, d.fun, d.addr1 );
+         d.size = 1 + sizeof( int16_t ) + sizeof( int32_t );
+         break;
+
+         case e_op_code_EXT_FUN_DAT_2:
+         case e_op_code_EXT_FUN_RET_DAT:
+         rc = get_fun_addrs( p_code, csize, dsize, state, d.fun, d.addr1, d.addr2 );
+         d.size = 1 + sizeof( int16_t ) + sizeof( int32_t ) + sizeof( int32_t );
+         break;
+
+         case e_op_code_EXT_FUN_RET_DAT_2:
+         rc = get_fun_addrs( p_code, csize, dsize, state, d.fun, d.addr1, d.addr2 );
+         if( rc == 0 )
+            rc = get_addr( p_code + sizeof( int16_t ) + sizeof( int32_t ) + sizeof( int32_t ), csize, dsize, state, d.addr3 );
+         d.size = 1 + sizeof( int16_t ) + sizeof( int32_t ) + sizeof( int32_t ) + sizeof( int32_t );
+         break;
+
+         default:
+         rc = -2;
+      }
+
+      d.rc = rc;
+
+      code.index[ state.pc ] = code.ops.size( );
+      code.ops.push_back( d );
+
+      code.jumps.set( state.pc );
+
+      // NOTE: An unknown op (including a zero byte) ends the sweep.
+      if( rc == -2 )
+         break;
+
+      state.pc += d.size;
+   }
+
+   for( size_t i = 0; i < code.ops.size( ); i++ )
+   {
+      decoded_op& d( code.ops[ i ] );
+
+      if( d.pc + d.size < csize )
+         d.next = code.index[ d.pc + d.size ];
+
+      if( d.dest >= 0 && d.dest < csize )
+         d.target = code.index[ d.dest ];
+   }
+
+   verify_code( code, cssize, ussize );
+
+   find_basic_blocks( code );
+
+   fuse_code( code );
+}
+
+#if defined( __GNUC__ ) && !defined( AT_NO_THREADED_DISPATCH )
+#  define AT_THREADED_DISPATCH
+#endif
+
+#ifdef AT_THREADED_DISPATCH
+#  define AT_OP( name ) l_##name:
+#else
+#  define AT_OP( name ) case e_op_kind_##name: l_##name:
+#endif
+
+#define AT_DATA( addr ) ( *( int64_t* )( p_data + ( ( addr ) * 8 ) ) )
+
+// NOTE: Data is written via "AT_SET" so that the page being written is marked as dirty (with the
+// "process_op" fallback marking every page as it doesn't track which are written).
+#define AT_DIRTY( offset ) ( p_dirty[ ( offset ) / c_data_page_bytes ] = e_page_flag_all )
+#define AT_SET( addr ) ( AT_DIRTY( ( addr ) * 8 ), AT_DATA( addr ) )
+
+// NOTE: Executes decoded ops until one fails, stops, finishes or calls an external function or
+// until "max_steps" ops have been executed (with steps being charged per basic block). The number
+// of ops executed is returned in "steps" and the return value is that of the last op (with each op
+// producing the same result and return code that "process_op" would have). Static operands are not
+// checked here (as this has already been done by "verify_code") so only indirect addresses, stack
+// usage and divisors are checked. As an external function may use (or change) the balance an op
+// calling one is only ever executed as the first op (so the caller has charged all prior steps).
+int run_decoded( at_context& context, int32_t max_steps, int32_t& steps )
+{
+   const decoded_code& code( context.get_code( ) );
+
+   int8_t* p_code = context.ap_code.get( );
+   int8_t* p_data = context.ap_data.get( );
+   uint8_t* p_dirty = &context.dirty_pages[ 0 ];
+
+   int32_t csize = context.csize( );
+   int32_t dsize = context.dsize( );
+   int32_t cssize = context.cssize( );
+   int32_t ussize = context.ussize( );
+
+   machine_state& state( context.state );
+
+#ifdef AT_THREADED_DISPATCH
+   static void* const c_handlers[ ] =
+   {
+      &&l_invalid,
+      &&l_NOP,
+      &&l_SET_VAL,
+      &&l_SET_DAT,
+      &&l_CLR_DAT,
+      &&l_INC_DAT,
+      &&l_DEC_DAT,
+      &&l_ADD_DAT,
+      &&l_SUB_DAT,
+      &&l_MUL_DAT,
+      &&l_DIV_DAT,
+      &&l_BOR_DAT,
+      &&l_AND_DAT,
+      &&l_XOR_DAT,
+      &&l_NOT_DAT,
+      &&l_SET_IND,
+      &&l_SET_IDX,
+      &&l_PSH_DAT,
+      &&l_POP_DAT,
+      &&l_JMP_SUB,
+      &&l_RET_SUB,
+      &&l_IND_DAT,
+      &&l_IDX_DAT,
+      &&l_MOD_DAT,
+      &&l_SHL_DAT,
+      &&l_SHR_DAT,
+      &&l_JMP_ADR,
+      &&l_BZR_DAT,
+      &&l_BNZ_DAT,
+      &&l_BGT_DAT,
+      &&l_BLT_DAT,
+      &&l_BGE_DAT,
+      &&l_BLE_DAT,
+      &&l_BEQ_DAT,
+      &&l_BNE_DAT,
+      &&l_SLP_DAT,
+      &&l_FIZ_DAT,
+      &&l_STZ_DAT,
+      &&l_FIN_IMD,
+      &&l_STP_IMD,
+      &&l_SLP_IMD,
+      &&l_ERR_ADR,
+      &&l_SET_PCS,
+      &&l_EXT_FUN,
+      &&l_EXT_FUN_DAT,
+      &&l_EXT_FUN_DAT_2,
+      &&l_EXT_FUN_RET,
+      &&l_EXT_FUN_RET_DAT,
+      &&l_EXT_FUN_RET_DAT_2,
+      &&l_error,
+      &&l_checked,
+      &&l_INC_BNE,
+      &&l_SET_VAL_RUN,
+      &&l_EXT_FUN_RET_BZR,
+      &&l_EXT_FUN_DAT_2_PAIR
+   };
+#endif
+
+   int rc = 0;
+   int last_rc = 0;
+
+   int64_t result = 0;
+
+   bool failed = false;
+
+   // NOTE: Steps are charged for a whole basic block at once (if there are enough remaining) with
+   // any charged steps for ops not executed (due to leaving the block early) being given back.
+   int32_t remaining = max_steps;
+   int32_t prepaid = 0;
+
+   const decoded_op* p_ops = code.ops.empty( ) ? 0 : &code.ops[ 0 ];
+   const decoded_op* p_op = 0;
+
+   // NOTE: If already stopped or finished (which are only cleared by the caller) then only one
+   // op is executed (as the caller will check these flags after each op).
+   if( state.stopped || state.finished )
+      max_steps = remaining = 1;
+
+   int32_t i = 0;
+
+   while( true )
+   {
+      if( csize < 1 || state.pc >= csize )
+      {
+         // NOTE: Running past the end of the code does nothing (and doesn't count as a step)
+         // so all of the remaining steps can be consumed at once.
+         state.steps += max_steps - remaining;
+         steps = max_steps;
+         return 0;
+      }
+
+      i = code.index[ state.pc ];
+
+      if( i < 0 )
+      {
+         // NOTE: An op that isn't at a decoded address is executed by "process_op" (which counts
+         // its own steps) and is only executed as the first op (as it might call a function).
+         if( remaining != max_steps )
+         {
+            rc = last_rc;
+            goto leave;
+         }
+
+         steps = 1;
+         rc = process_op( context, false );
+
+         context.mark_all_dirty( );
+
+         if( rc < 0 && is_tracing( e_trace_category_machine, e_trace_level_error ) )
+            trace( e_trace_event_error, p_code[ state.pc ], state.pc, 0, 0, 0, 0, rc );
+
+         return rc;
+      }
+
+   dispatch:
+      p_op = p_ops + i;
+      rc = p_op->size;
+
+      if( !prepaid )
+      {
+         if( remaining >= p_op->block_left )
+            prepaid = p_op->block_left;
+         else if( remaining )
+            prepaid = 1;
+         else
+         {
+            rc = last_rc;
+            goto leave;
+         }
+
+         remaining -= prepaid;
+      }
+
+      --prepaid;
+
+#ifdef AT_THREADED_DISPATCH
+      goto *c_handlers[ p_op->dispatch ];
+      {
+#else
+      switch( p_op->dispatch )
+      {
+#endif
+         AT_OP( NOP )
+         state.pc += rc;
+         goto next;
+
+         AT_OP( SET_VAL )
+         state.pc += rc;
+         AT_SET( p_op->addr1 ) = p_op->val;
+         goto next;
+
+         AT_OP( SET_DAT )
+         state.pc += rc;
+         AT_SET( p_op->addr1 ) = AT_DATA( p_op->addr2 );
+         goto next;
+
+         AT_OP( CLR_DAT )
+         state.pc += rc;
+         AT_SET( p_op->addr1 ) = 0;
+         goto next;
+
+         AT_OP( INC_DAT )
+         state.pc += rc;
+         ++AT_SET( p_op->addr1 );
+         goto next;
+
+         AT_OP( DEC_DAT )
+         state.pc += rc;
+         --AT_SET( p_op->addr1 );
+         goto next;
+
+         AT_OP( NOT_DAT )
+         state.pc += rc;
+         AT_SET( p_op->addr1 ) = ~AT_DATA( p_op->addr1 );
+         goto next;
+
+         AT_OP( ADD_DAT )
+         state.pc += rc;
+         AT_SET( p_op->addr1 ) += AT_DATA( p_op->addr2 );
+         goto next;
+
+         AT_OP( SUB_DAT )
+         state.pc += rc;
+         AT_SET( p_op->addr1 ) -= AT_DATA( p_op->addr2 );
+         goto next;
+
+         AT_OP( MUL_DAT )
+         state.pc += rc;
+         AT_SET( p_op->addr1 ) *= AT_DATA( p_op->addr2 );
+         goto next;
+
+         AT_OP( DIV_DAT )
+         if( AT_DATA( p_op->addr2 ) == 0 )
+         {
+            rc = -2;
+            goto fail;
+         }
+         state.pc += rc;
+         AT_SET( p_op->addr1 ) = divide( AT_DATA( p_op->addr1 ), AT_DATA( p_op->addr2 ) );
+         goto next;
+
+         AT_OP( BOR_DAT )
+         state.pc += rc;
+         AT_SET( p_op->addr1 ) |= AT_DATA( p_op->addr2 );
+         goto next;
+
+         AT_OP( AND_DAT )
+         state.pc += rc;
+         AT_SET( p_op->addr1 ) &= AT_DATA( p_op->addr2 );
+         goto next;
+
+         AT_OP( XOR_DAT )
+         state.pc += rc;
+         AT_SET( p_op->addr1 ) ^= AT_DATA( p_op->addr2 );
+         goto next;
+
+         AT_OP( MOD_DAT )
+         if( AT_DATA( p_op->addr2 ) == 0 )
+         {
+            rc = -2;
+            goto fail;
+         }
+         state.pc += rc;
+         AT_SET( p_op->addr1 ) = modulo( AT_DATA( p_op->addr1 ), AT_DATA( p_op->addr2 ) );
+         goto next;
+
+         AT_OP( SHL_DAT )
+         state.pc += rc;
+         AT_SET( p_op->addr1 ) <<= AT_DATA( p_op->addr2 );
+         goto next;
+
+         AT_OP( SHR_DAT )
+         state.pc += rc;
+         AT_SET( p_op->addr1 ) >>= AT_DATA( p_op->addr2 );
+         goto next;
+
+         AT_OP( SET_IND )
+         AT_OP( SET_IDX )
+         {
+            int64_t addr = AT_DATA( p_op->addr2 );
+
+            if( p_op->op == e_op_code_SET_IDX )
+               addr += AT_DATA( p_op->addr3 );
+
+            if( addr < 0 || addr > c_max_to_multiply
+             || ( addr * 8 ) < 0 || ( addr * 8 ) + ( int32_t )sizeof( int64_t ) > dsize )
+            {
+               rc = -1;
+               goto fail;
+            }
+
+            state.pc += rc;
+            AT_SET( p_op->addr1 ) = AT_DATA( addr );
+         }
+         goto next;
+
+         AT_OP( IND_DAT )
+         AT_OP( IDX_DAT )
+         {
+            int64_t addr = AT_DATA( p_op->addr1 );
+
+            if( p_op->op == e_op_code_IDX_DAT )
+               addr += AT_DATA( p_op->addr2 );
+
+            if( addr < 0 || addr > c_max_to_multiply
+             || ( addr * 8 ) < 0 || ( addr * 8 ) + ( int32_t )sizeof( int64_t ) > dsize )
+            {
+               rc = -1;
+               goto fail;
+            }
+
+            state.pc += rc;
+            AT_SET( addr ) = AT_DATA( p_op->op == e_op_code_IDX_DAT ? p_op->addr3 : p_op->addr2 );
+         }
+         goto next;
+
+         AT_OP( PSH_DAT )
+         if( state.us == ( ussize / 8 ) )
+         {
+            rc = -1;
+            goto fail;
+         }
+         state.pc += rc;
+         AT_DIRTY( dsize + cssize + ussize - ( ( state.us + 1 ) * 8 ) );
+         *( int64_t* )( p_data + dsize + cssize + ussize - ( ++state.us * 8 ) ) = AT_DATA( p_op->addr1 );
+         goto next;
+
+         AT_OP( POP_DAT )
+         if( state.us == 0 )
+         {
+            rc = -1;
+            goto fail;
+         }
+         state.pc += rc;
+         AT_SET( p_op->addr1 ) = *( int64_t* )( p_data + dsize + cssize + ussize - ( state.us-- * 8 ) );
+         goto next;
+
+         AT_OP( JMP_SUB )
+         if( state.cs == ( cssize / 8 ) )
+         {
+            rc = -1;
+            goto fail;
+         }
+         AT_DIRTY( dsize + cssize - ( ( state.cs + 1 ) * 8 ) );
+         *( int64_t* )( p_data + dsize + cssize - ( ++state.cs * 8 ) ) = state.pc + rc;
+         goto branch;
+
+         AT_OP( RET_SUB )
+         if( state.cs == 0 )
+         {
+            rc = -1;
+            goto fail;
+         }
+         else
+         {
+            int32_t addr = ( int32_t )*( int64_t* )( p_data + dsize + cssize - ( state.cs-- * 8 ) );
+
+            if( !code.jumps.test( addr ) )
+            {
+               rc = -2;
+               goto fail;
+            }
+            state.pc = addr;
+         }
+         goto jumped;
+
+         AT_OP( JMP_ADR )
+         goto branch;
+
+         AT_OP( BZR_DAT )
+         if( AT_DATA( p_op->addr1 ) == 0 )
+            goto branch;
+         state.pc += rc;
+         goto next;
+
+         AT_OP( BNZ_DAT )
+         if( AT_DATA( p_op->addr1 ) != 0 )
+            goto branch;
+         state.pc += rc;
+         goto next;
+
+         AT_OP( BGT_DAT )
+         if( AT_DATA( p_op->addr1 ) > AT_DATA( p_op->addr2 ) )
+            goto branch;
+         state.pc += rc;
+         goto next;
+
+         AT_OP( BLT_DAT )
+         if( AT_DATA( p_op->addr1 ) < AT_DATA( p_op->addr2 ) )
+            goto branch;
+         state.pc += rc;
+         goto next;
+
+         AT_OP( BGE_DAT )
+         if( AT_DATA( p_op->addr1 ) >= AT_DATA( p_op->addr2 ) )
+            goto branch;
+         state.pc += rc;
+         goto next;
+
+         AT_OP( BLE_DAT )
+         if( AT_DATA( p_op->addr1 ) <= AT_DATA( p_op->addr2 ) )
+            goto branch;
+         state.pc += rc;
+         goto next;
+
+         AT_OP( BEQ_DAT )
+         if( AT_DATA( p_op->addr1 ) == AT_DATA( p_op->addr2 ) )
+            goto branch;
+         state.pc += rc;
+         goto next;
+
+         AT_OP( BNE_DAT )
+         if( AT_DATA( p_op->addr1 ) != AT_DATA( p_op->addr2 ) )
+            goto branch;
+         state.pc += rc;
+         goto next;
+
+         AT_OP( SLP_DAT )
+         {
+            int32_t height = ( int32_t )( AT_DATA( p_op->addr1 ) >> 32 );
+            state.sleep_until = height > context.height ? height : context.height + 1;
+         }
+         state.pc += rc;
+         goto yield;
+
+         AT_OP( SLP_IMD )
+         state.sleep_until = context.height + 1;
+         state.pc += rc;
+         goto yield;
+
+         AT_OP( FIZ_DAT )
+         if( AT_DATA( p_op->addr1 ) == 0 )
+            goto finish;
+         state.pc += rc;
+         goto next;
+
+         AT_OP( STZ_DAT )
+         if( AT_DATA( p_op->addr1 ) == 0 )
+            goto stop;
+         state.pc += rc;
+         goto next;
+
+         AT_OP( FIN_IMD )
+         goto finish;
+
+         AT_OP( STP_IMD )
+         goto stop;
+
+         AT_OP( ERR_ADR )
+         state.pce = p_op->dest;
+         goto jumped;
+
+         AT_OP( SET_PCS )
+         state.pc += rc;
+         state.pcs = state.pc;
+         goto next;
+
+         AT_OP( EXT_FUN )
+         if( max_steps - remaining > 1 )
+            goto undo;
+         state.pc += rc;
+         func( context, p_op->op, p_op->fun );
+         goto called;
+
+         AT_OP( EXT_FUN_DAT )
+         if( max_steps - remaining > 1 )
+            goto undo;
+         state.pc += rc;
+         func1( context, p_op->op, p_op->fun, AT_DATA( p_op->addr1 ) );
+         goto called;
+
+         AT_OP( EXT_FUN_DAT_2 )
+         if( max_steps - remaining > 1 )
+            goto undo;
+         state.pc += rc;
+         func2( context, p_op->op, p_op->fun, AT_DATA( p_op->addr1 ), AT_DATA( p_op->addr2 ) );
+         goto called;
+
+         AT_OP( EXT_FUN_RET )
+         if( max_steps - remaining > 1 )
+            goto undo;
+         state.pc += rc;
+         result = func( context, p_op->op, p_op->fun );
+         if( context.func_failed )
+            goto func_failed;
+         AT_SET( p_op->addr1 ) = result;
+         goto yield;
+
+         AT_OP( EXT_FUN_RET_DAT )
+         if( max_steps - remaining > 1 )
+            goto undo;
+         state.pc += rc;
+         result = func1( context, p_op->op, p_op->fun, AT_DATA( p_op->addr2 ) );
+         if( context.func_failed )
+            goto func_failed;
+         AT_SET( p_op->addr1 ) = result;
+         goto yield;
+
+         AT_OP( EXT_FUN_RET_DAT_2 )
+         if( max_steps - remaining > 1 )
+            goto undo;
+         state.pc += rc;
+         result = func2( context, p_op->op, p_op->fun, AT_DATA( p_op->addr2 ), AT_DATA( p_op->addr3 ) );
+         if( context.func_failed )
+            goto func_failed;
+         AT_SET( p_op->addr1 ) = result;
+         goto yield;
+
+         AT_OP( error )
+         rc = p_op->rc;
+         goto fail;
+
+         AT_OP( checked )
+         {
+            // NOTE: As "process_op" counts its own steps (which are counted here when leaving)
+            // the original step count is restored.
+            int32_t osteps = state.steps;
+
+            rc = process_op( context, false );
+
+            state.steps = osteps;
+
+            context.mark_all_dirty( );
+         }
+         if( rc < 0 )
+         {
+            failed = true;
+            goto yield;
+         }
+         goto jumped;
+
+         AT_OP( INC_BNE )
+         if( !prepaid )
+            goto l_INC_DAT;
+         --prepaid;
+         state.pc += rc;
+         ++AT_SET( p_op->addr1 );
+         p_op = p_ops + p_op->next;
+         rc = p_op->size;
+         goto l_BNE_DAT;
+
+         AT_OP( SET_VAL_RUN )
+         if( prepaid < p_op->fused - 1 )
+            goto l_SET_VAL;
+         prepaid -= p_op->fused - 1;
+         for( const decoded_op* p_end = p_op + p_op->fused; ; )
+         {
+            AT_SET( p_op->addr1 ) = p_op->val;
+            if( p_op + 1 == p_end )
+               break;
+            ++p_op;
+         }
+         rc = p_op->size;
+         state.pc = p_op->pc + rc;
+         goto next;
+
+         AT_OP( EXT_FUN_RET_BZR )
+         if( max_steps - remaining > 1 )
+            goto undo;
+         if( !remaining )
+            goto l_EXT_FUN_RET;
+         --remaining;
+         state.pc += rc;
+         result = func( context, p_op->op, p_op->fun );
+         if( context.func_failed )
+         {
+            ++remaining;
+            goto func_failed;
+         }
+         AT_SET( p_op->addr1 ) = result;
+         p_op = p_ops + p_op->next;
+         rc = p_op->size;
+         if( AT_DATA( p_op->addr1 ) == 0 )
+            state.pc = p_op->dest;
+         else
+            state.pc += rc;
+         goto yield;
+
+         AT_OP( EXT_FUN_DAT_2_PAIR )
+         if( max_steps - remaining > 1 )
+            goto undo;
+         if( !remaining )
+            goto l_EXT_FUN_DAT_2;
+         --remaining;
+         state.pc += rc;
+         func2( context, p_op->op, p_op->fun, AT_DATA( p_op->addr1 ), AT_DATA( p_op->addr2 ) );
+         if( context.func_failed )
+         {
+            ++remaining;
+            goto func_failed;
+         }
+         p_op = p_ops + p_op->next;
+         rc = p_op->size;
+         state.pc += rc;
+         func2( context, p_op->op, p_op->fun, AT_DATA( p_op->addr1 ), AT_DATA( p_op->addr2 ) );
+         goto called;
+
+#ifndef AT_THREADED_DISPATCH
+         default:
+#endif
+         AT_OP( invalid )
+         rc = -2;
+         goto fail;
+      }
+
+      // NOTE: Jumps and branches (which have verified destinations) and ops that continue with
+      // the next op are dispatched directly (whereas any other change to the pc is looked up).
+   branch:
+      state.pc = p_op->dest;
+      last_rc = rc;
+      i = p_op->target;
+      goto dispatch;
+
+   next:
+      last_rc = rc;
+      i = p_op->next;
+      if( i >= 0 )
+         goto dispatch;
+      continue;
+
+   jumped:
+      last_rc = rc;
+      continue;
+
+   called:
+      if( !context.func_failed )
+         goto yield;
+
+      // NOTE: A function handler has failed the op that called it (such as for a divide by zero)
+      // so the pc is restored to that op and it fails as an overflow would.
+   func_failed:
+      context.func_failed = false;
+      state.pc -= rc;
+      rc = -1;
+      goto fail;
+
+   undo:
+      remaining += prepaid + 1;
+      rc = last_rc;
+      goto leave;
+
+   fail:
+      if( is_tracing( e_trace_category_machine, e_trace_level_error ) )
+         trace( e_trace_event_error, p_op->op, state.pc, 0, 0, 0, 0, rc );
+
+      if( rc == -1 && state.pce )
+      {
+         rc = 0;
+         state.pc = state.pce;
+
+         remaining += prepaid;
+         prepaid = 0;
+
+         goto jumped;
+      }
+      failed = true;
+      goto yield;
+
+   finish:
+      if( is_tracing( e_trace_category_machine, e_trace_level_debug ) )
+         trace( e_trace_event_finish, p_op->op, state.pc, 0, 0, 0, 0, 0 );
+
+      rc = 0;
+      state.pc = state.pcs;
+      state.finished = true;
+      goto yield;
+
+   stop:
+      if( is_tracing( e_trace_category_machine, e_trace_level_debug ) )
+         trace( e_trace_event_stop, p_op->op, state.pc, 0, 0, 0, 0, 0 );
+
+      rc = 0;
+      state.stopped = true;
+
+   yield:
+      remaining += prepaid;
+
+   leave:
+      // NOTE: An op that failed is included in "steps" but not in the machine state steps.
+      steps = max_steps - remaining;
+      state.steps += failed ? steps - 1 : steps;
+
+      return rc;
+   }
+}
+
+#undef AT_SET
+#undef AT_DIRTY
+#undef AT_DATA
+#undef AT_OP
+
+// NOTE: Native code (from either the JIT or the AOT compiler) consists of basic blocks of ops that
+// start by checking (and then deducting) their step cost from the steps that are remaining so that
+// a block is either executed entirely or not at all (an op that then fails a runtime check gives
+// back the cost of itself and the ops following it before exiting). Execution of the native code
+// is started at a block and continues from block to block until it reaches an op that it doesn't
+// support or runs out of steps (in which case "run_native" will step the interpreter).
+struct native_frame
+{
+   int64_t remaining; // steps remaining (offset 0)
+   int32_t pc; // code address at which the native code exited (offset 8)
+   int32_t cs; // offset 12
+   int32_t us; // offset 16
+};
+
+typedef void ( *native_enter_func )( int8_t* p_data, native_frame* p_frame, const uint8_t* p_entry );
+
+struct native_code
+{
+   native_code( )
+   {
+      version = 0;
+
+      p_base = 0;
+      p_enter = 0;
+   }
+
+   void clear( )
+   {
+      version = 0;
+
+      p_base = 0;
+      p_enter = 0;
+
+      entries.clear( );
+   }
+
+   int64_t version; // version of the decoded code that was compiled
+
+   const uint8_t* p_base;
+   native_enter_func p_enter;
+
+   vector< int32_t > entries; // offset from "p_base" for each op (-1 if not the start of a block)
+};
+
+void find_block_leaders( const decoded_code& code, bool ( *p_supported )( const decoded_op& ), vector< bool >& leaders )
+{
+   size_t num_ops = code.ops.size( );
+
+   leaders.assign( num_ops, false );
+
+   if( num_ops )
+      leaders[ 0 ] = true;
+
+   for( size_t i = 0; i < num_ops; i++ )
+   {
+      const decoded_op& d( code.ops[ i ] );
+
+      if( d.target >= 0 )
+         leaders[ d.target ] = true;
+
+      if( d.next >= 0 && ( !( *p_supported )( d ) || d.dest >= 0 ) )
+         leaders[ d.next ] = true;
+   }
+}
+
+int32_t get_block_last( const decoded_code& code,
+ bool ( *p_supported )( const decoded_op& ), const vector< bool >& leaders, int32_t first )
+{
+   int32_t last = first;
+
+   for( int32_t i = first; i >= 0 && ( *p_supported )( code.ops[ i ] )
+    && ( i == first || !leaders[ i ] ); i = code.ops[ i ].next )
+   {
+      last = i;
+
+      if( code.ops[ i ].dest >= 0 )
+         break;
+   }
+
+   return last;
+}
+
+// NOTE: The JIT compiles blocks of simple ops (that can't fail once verified) into x86-64 code.
+struct jit_code
+{
+   jit_code( )
+   {
+      p_exec = 0;
+      exec_size = 0;
+   }
+
+   ~jit_code( )
+   {
+      release( );
+   }
+
+   void release( )
+   {
+#ifdef AT_JIT
+      if( p_exec )
+         munmap( p_exec, exec_size );
+#endif
+      p_exec = 0;
+      exec_size = 0;
+
+      native.clear( );
+   }
+
+   uint8_t* p_exec;
+   size_t exec_size;
+
+   native_code native;
+
+   private:
+   jit_code( const jit_code& );
+   jit_code& operator =( const jit_code& );
+};
+
+#ifdef AT_JIT
+struct jit_fixup
+{
+   size_t at;
+   int32_t pc;
+   int32_t target;
+};
+
+bool is_jit_supported( const decoded_op& d )
+{
+   switch( d.kind )
+   {
+      case e_op_kind_NOP:
+      case e_op_kind_SET_VAL:
+      case e_op_kind_SET_DAT:
+      case e_op_kind_CLR_DAT:
+      case e_op_kind_INC_DAT:
+      case e_op_kind_DEC_DAT:
+      case e_op_kind_NOT_DAT:
+      case e_op_kind_ADD_DAT:
+      case e_op_kind_SUB_DAT:
+      case e_op_kind_MUL_DAT:
+      case e_op_kind_BOR_DAT:
+      case e_op_kind_AND_DAT:
+      case e_op_kind_XOR_DAT:
+      case e_op_kind_JMP_ADR:
+      case e_op_kind_BZR_DAT:
+      case e_op_kind_BNZ_DAT:
+      case e_op_kind_BGT_DAT:
+      case e_op_kind_BLT_DAT:
+      case e_op_kind_BGE_DAT:
+      case e_op_kind_BLE_DAT:
+      case e_op_kind_BEQ_DAT:
+      case e_op_kind_BNE_DAT:
+      return true;
+
+      default:
+      return false;
+   }
+}
+
+bool is_jit_branch( const decoded_op& d )
+{
+   return d.kind >= e_op_kind_BZR_DAT && d.kind <= e_op_kind_BNE_DAT;
+}
+
+void emit_bytes( vector< uint8_t >& out, const char* p_bytes, size_t num )
+{
+   out.insert( out.end( ), ( const uint8_t* )p_bytes, ( const uint8_t* )p_bytes + num );
+}
+
+void emit_int32( vector< uint8_t >& out, int32_t val )
+{
+   emit_bytes( out, ( const char* )&val, sizeof( int32_t ) );
+}
+
+void emit_int64( vector< uint8_t >& out, int64_t val )
+{
+   emit_bytes( out, ( const char* )&val, sizeof( int64_t ) );
+}
+
+// NOTE: Emits an instruction with a "[rdi + disp32]" memory operand (where "rdi" is the data).
+void emit_data_op( vector< uint8_t >& out, const char* p_op, size_t op_size, int8_t modrm_reg, int32_t addr )
+{
+   emit_bytes( out, p_op, op_size );
+   out.push_back( 0x87 | ( modrm_reg << 3 ) );
+   emit_int32( out, addr * 8 );
+}
+
+void emit_jump( vector< uint8_t >& out, vector< jit_fixup >& fixups, int8_t cc, int32_t pc, int32_t target )
+{
+   if( cc < 0 )
+      out.push_back( 0xe9 );
+   else
+   {
+      out.push_back( 0x0f );
+      out.push_back( 0x80 | cc );
+   }
+
+   jit_fixup fixup;
+
+   fixup.at = out.size( );
+   fixup.pc = pc;
+   fixup.target = target;
+
+   fixups.push_back( fixup );
+
+   emit_int32( out, 0 );
+}
+
+bool jit_compile( jit_code& jit, const decoded_code& code )
+{
+   if( jit.native.version == code.version )
+      return true;
+
+   jit.release( );
+
+   size_t num_ops = code.ops.size( );
+
+   vector< bool > leaders;
+   find_block_leaders( code, is_jit_supported, leaders );
+
+   vector< uint8_t > out;
+   vector< jit_fixup > fixups;
+
+   vector< int32_t > entries( num_ops, -1 );
+
+   // NOTE: The entry stub just jumps to the block (as "rdi" and "rsi" already hold the data and
+   // frame pointers) and each block exit returns directly to the caller.
+   out.push_back( 0xff );
+   out.push_back( 0xe2 );
+
+   for( size_t i = 0; i < num_ops; i++ )
+   {
+      if( !leaders[ i ] || !is_jit_supported( code.ops[ i ] ) )
+         continue;
+
+      int32_t cost = 1;
+      int32_t last = get_block_last( code, is_jit_supported, leaders, i );
+
+      for( int32_t j = i; j != last; j = code.ops[ j ].next )
+         ++cost;
+
+      entries[ i ] = out.size( );
+
+      // cmp qword [rsi], cost / jl exit / sub qword [rsi], cost
+      emit_bytes( out, "\x48\x81\x3e", 3 );
+      emit_int32( out, cost );
+      emit_jump( out, fixups, 0x0c, code.ops[ i ].pc, -1 );
+      emit_bytes( out, "\x48\x81\x2e", 3 );
+      emit_int32( out, cost );
+
+      for( int32_t j = i; ; j = code.ops[ j ].next )
+      {
+         const decoded_op& d( code.ops[ j ] );
+
+         switch( d.kind )
+         {
+            case e_op_kind_SET_VAL:
+            emit_bytes( out, "\x48\xb8", 2 );
+            emit_int64( out, d.val );
+            emit_data_op( out, "\x48\x89", 2, 0, d.addr1 );
+            break;
+
+            case e_op_kind_SET_DAT:
+            emit_data_op( out, "\x48\x8b", 2, 0, d.addr2 );
+            emit_data_op( out, "\x48\x89", 2, 0, d.addr1 );
+            break;
+
+            case e_op_kind_CLR_DAT:
+            emit_data_op( out, "\x48\xc7", 2, 0, d.addr1 );
+            emit_int32( out, 0 );
+            break;
+
+            case e_op_kind_INC_DAT:
+            emit_data_op( out, "\x48\xff", 2, 0, d.addr1 );
+            break;
+
+            case e_op_kind_DEC_DAT:
+            emit_data_op( out, "\x48\xff", 2, 1, d.addr1 );
+            break;
+
+            case e_op_kind_NOT_DAT:
+            emit_data_op( out, "\x48\xf7", 2, 2, d.addr1 );
+            break;
+
+            case e_op_kind_ADD_DAT:
+            case e_op_kind_SUB_DAT:
+            case e_op_kind_BOR_DAT:
+            case e_op_kind_AND_DAT:
+            case e_op_kind_XOR_DAT:
+            emit_data_op( out, "\x48\x8b", 2, 0, d.addr2 );
+            emit_data_op( out, d.kind == e_op_kind_ADD_DAT ? "\x48\x01"
+             : d.kind == e_op_kind_SUB_DAT ? "\x48\x29" : d.kind == e_op_kind_BOR_DAT ? "\x48\x09"
+             : d.kind == e_op_kind_AND_DAT ? "\x48\x21" : "\x48\x31", 2, 0, d.addr1 );
+            break;
+
+            case e_op_kind_MUL_DAT:
+            emit_data_op( out, "\x48\x8b", 2, 0, d.addr1 );
+            emit_data_op( out, "\x48\x0f\xaf", 3, 0, d.addr2 );
+            emit_data_op( out, "\x48\x89", 2, 0, d.addr1 );
+            break;
+
+            case e_op_kind_BZR_DAT:
+            case e_op_kind_BNZ_DAT:
+            emit_data_op( out, "\x48\x83", 2, 7, d.addr1 );
+            out.push_back( 0 );
+            break;
+
+            case e_op_kind_BGT_DAT:
+            case e_op_kind_BLT_DAT:
+            case e_op_kind_BGE_DAT:
+            case e_op_kind_BLE_DAT:
+            case e_op_kind_BEQ_DAT:
+            case e_op_kind_BNE_DAT:
+            emit_data_op( out, "\x48\x8b", 2, 0, d.addr1 );
+            emit_data_op( out, "\x48\x3b", 2, 0, d.addr2 );
+            break;
+         }
+
+         if( j != last )
+            continue;
+
+         if( is_jit_branch( d ) )
+         {
+            int8_t cc = 0;
+
+            switch( d.kind )
+            {
+               case e_op_kind_BZR_DAT:
+               case e_op_kind_BEQ_DAT:
+               cc = 0x04;
+               break;
+
+               case e_op_kind_BNZ_DAT:
+               case e_op_kind_BNE_DAT:
+               cc = 0x05;
+               break;
+
+               case e_op_kind_BGT_DAT:
+               cc = 0x0f;
+               break;
+
+               case e_op_kind_BLT_DAT:
+               cc = 0x0c;
+               break;
+
+               case e_op_kind_BGE_DAT:
+               cc = 0x0d;
+               break;
+
+               case e_op_kind_BLE_DAT:
+               cc = 0x0e;
+               break;
+            }
+
+            emit_jump( out, fixups, cc, d.dest, d.target );
+         }
+
+         if( d.kind == e_op_kind_JMP_ADR )
+            emit_jump( out, fixups, -1, d.dest, d.target );
+         else
+            emit_jump( out, fixups, -1, d.pc + d.size, d.next );
+
+         break;
+      }
+   }
+
+   map< int32_t, int32_t > exits;
+
+   for( size_t i = 0; i < fixups.size( ); i++ )
+   {
+      const jit_fixup& fixup( fixups[ i ] );
+
+      int32_t dest = fixup.target >= 0 ? entries[ fixup.target ] : -1;
+
+      if( dest < 0 )
+      {
+         if( !exits.count( fixup.pc ) )
+         {
+            exits[ fixup.pc ] = out.size( );
+
+            // mov dword [rsi + 8], pc / ret
+            emit_bytes( out, "\xc7\x46\x08", 3 );
+            emit_int32( out, fixup.pc );
+            out.push_back( 0xc3 );
+         }
+
+         dest = exits[ fixup.pc ];
+      }
+
+      int32_t rel = dest - ( int32_t )( fixup.at + sizeof( int32_t ) );
+      memcpy( &out[ fixup.at ], &rel, sizeof( int32_t ) );
+   }
+
+   void* p_exec = mmap( 0, out.size( ), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+   if( p_exec == MAP_FAILED )
+      return false;
+
+   memcpy( p_exec, &out[ 0 ], out.size( ) );
+
+   if( mprotect( p_exec, out.size( ), PROT_READ | PROT_EXEC ) != 0 )
+   {
+      munmap( p_exec, out.size( ) );
+      return false;
+   }
+
+   jit.p_exec = ( uint8_t* )p_exec;
+   jit.exec_size = out.size( );
+
+   jit.native.version = code.version;
+
+   jit.native.p_base = jit.p_exec;
+   jit.native.p_enter = ( native_enter_func )jit.p_exec;
+
+   jit.native.entries.swap( entries );
+
+   return true;
+}
+#else
+bool jit_compile( jit_code& jit, const decoded_code& code )
+{
+   jit.release( );
+   return false;
+}
+#endif
+
+// NOTE: The AOT compiler translates blocks of ops (including those needing runtime checks) into C++
+// which is compiled into a shared object (named by the hash of the code and memory geometry) that
+// is loaded with "dlopen" (so later runs with the same code will simply load the shared object).
+// As loading a shared object runs its code the objects are only ever kept in (and loaded from) the
+// private directory given by the "AT_AOT_DIR" environment variable.
+struct aot_code
+{
+   aot_code( )
+   {
+      p_handle = 0;
+   }
+
+   ~aot_code( )
+   {
+      release( );
+   }
+
+   void release( )
+   {
+#ifdef AT_AOT
+      if( p_handle )
+         dlclose( p_handle );
+#endif
+      p_handle = 0;
+
+      hash.erase( );
+      native.clear( );
+   }
+
+   void* p_handle;
+
+   string hash;
+
+   native_code native;
+
+   private:
+   aot_code( const aot_code& );
+   aot_code& operator =( const aot_code& );
+};
+
+bool is_aot_supported( const decoded_op& d )
+{
+   switch( d.kind )
+   {
+      case e_op_kind_DIV_DAT:
+      case e_op_kind_SET_IND:
+      case e_op_kind_SET_IDX:
+      case e_op_kind_IND_DAT:
+      case e_op_kind_IDX_DAT:
+      case e_op_kind_PSH_DAT:
+      case e_op_kind_POP_DAT:
+      case e_op_kind_JMP_SUB:
+      return true;
+
+      default:
+      return is_jit_supported( d );
+   }
+}
+
+string get_aot_jump( const decoded_code& code, const vector< bool >& leaders, int32_t pc, int32_t target )
+{
+   ostringstream osstr;
+
+   if( target >= 0 && leaders[ target ] && is_aot_supported( code.ops[ target ] ) )
+      osstr << "goto b" << target << ";";
+   else
+      osstr << "X( " << pc << ", 0 );";
+
+   return osstr.str( );
+}
+
+void generate_aot_source( ostream& os, const decoded_code& code, int32_t cssize, int32_t ussize )
+{
+   vector< bool > leaders;
+   find_block_leaders( code, is_aot_supported, leaders );
+
+   int32_t dsize = code.dsize;
+
+   os << "#include <stdint.h>\n\n";
+
+   os << "struct native_frame\n{\n   int64_t remaining;\n   int32_t pc;\n   int32_t cs;\n   int32_t us;\n};\n\n";
+
+   os << "#define D( addr ) ( *( int64_t* )( p_data + ( ( addr ) * 8 ) ) )\n";
+   os << "#define CS( n ) ( *( int64_t* )( p_data + " << ( dsize + cssize ) << " - ( ( n ) * 8 ) ) )\n";
+   os << "#define US( n ) ( *( int64_t* )( p_data + " << ( dsize + cssize + ussize ) << " - ( ( n ) * 8 ) ) )\n";
+   os << "#define BAD( addr ) ( ( addr ) < 0 || ( addr ) > 0x1fffffff || ( ( addr ) * 8 ) + 8 > " << dsize << " )\n";
+   os << "#define X( exit_pc, refund ) do { p_frame->remaining = r + ( refund ); p_frame->pc = ( exit_pc ); return; } while( 0 )\n\n";
+
+   os << "extern \"C\" void at_aot_run( int8_t* p_data, native_frame* p_frame, const uint8_t* )\n{\n";
+   os << "   int64_t r = p_frame->remaining;\n\n";
+   os << "   switch( p_frame->pc )\n   {\n";
+
+   for( size_t i = 0; i < code.ops.size( ); i++ )
+   {
+      if( leaders[ i ] && is_aot_supported( code.ops[ i ] ) )
+         os << "      case " << code.ops[ i ].pc << ": goto b" << i << ";\n";
+   }
+
+   os << "   }\n\n   X( p_frame->pc, 0 );\n";
+
+   for( size_t i = 0; i < code.ops.size( ); i++ )
+   {
+      if( !leaders[ i ] || !is_aot_supported( code.ops[ i ] ) )
+         continue;
+
+      int32_t cost = 1;
+      int32_t last = get_block_last( code, is_aot_supported, leaders, i );
+
+      for( int32_t j = i; j != last; j = code.ops[ j ].next )
+         ++cost;
+
+      os << "\nb" << i << ":\n";
+      os << "   if( r < " << cost << " ) X( " << code.ops[ i ].pc << ", 0 );\n";
+      os << "   r -= " << cost << ";\n";
+
+      for( int32_t j = i, k = 0; ; j = code.ops[ j ].next, ++k )
+      {
+         const decoded_op& d( code.ops[ j ] );
+
+         // NOTE: If a runtime check fails then the op is left for the interpreter.
+         ostringstream fail;
+         fail << "X( " << d.pc << ", " << ( cost - k ) << " );";
+
+         os << "   ";
+
+         switch( d.kind )
+         {
+            case e_op_kind_SET_VAL:
+            os << "D( " << d.addr1 << " ) = ( int64_t )0x" << hex << ( uint64_t )d.val << dec << "ull;";
+            break;
+
+            case e_op_kind_SET_DAT:
+            os << "D( " << d.addr1 << " ) = D( " << d.addr2 << " );";
+            break;
+
+            case e_op_kind_CLR_DAT:
+            os << "D( " << d.addr1 << " ) = 0;";
+            break;
+
+            case e_op_kind_INC_DAT:
+            os << "D( " << d.addr1 << " ) = ( int64_t )( ( uint64_t )D( " << d.addr1 << " ) + 1 );";
+            break;
+
+            case e_op_kind_DEC_DAT:
+            os << "D( " << d.addr1 << " ) = ( int64_t )( ( uint64_t )D( " << d.addr1 << " ) - 1 );";
+            break;
+
+            case e_op_kind_NOT_DAT:
+            os << "D( " << d.addr1 << " ) = ~D( " << d.addr1 << " );";
+            break;
+
+            case e_op_kind_ADD_DAT:
+            case e_op_kind_SUB_DAT:
+            case e_op_kind_MUL_DAT:
+            os << "D( " << d.addr1 << " ) = ( int64_t )( ( uint64_t )D( " << d.addr1 << " ) "
+             << ( d.kind == e_op_kind_ADD_DAT ? '+' : d.kind == e_op_kind_SUB_DAT ? '-' : '*' )
+             << " ( uint64_t )D( " << d.addr2 << " ) );";
+            break;
+
+            case e_op_kind_BOR_DAT:
+            case e_op_kind_AND_DAT:
+            case e_op_kind_XOR_DAT:
+            os << "D( " << d.addr1 << " ) "
+             << ( d.kind == e_op_kind_BOR_DAT ? '|' : d.kind == e_op_kind_AND_DAT ? '&' : '^' )
+             << "= D( " << d.addr2 << " );";
+            break;
+
+            case e_op_kind_DIV_DAT:
+            os << "if( !D( " << d.addr2 << " ) ) " << fail.str( )
+             << " D( " << d.addr1 << " ) = D( " << d.addr2 << " ) == -1 ? ( int64_t )( 0 - ( uint64_t )D( "
+             << d.addr1 << " ) ) : D( " << d.addr1 << " ) / D( " << d.addr2 << " );";
+            break;
+
+            case e_op_kind_SET_IND:
+            case e_op_kind_SET_IDX:
+            os << "{ int64_t addr = D( " << d.addr2 << " )";
+            if( d.kind == e_op_kind_SET_IDX )
+               os << " + D( " << d.addr3 << " )";
+            os << "; if( BAD( addr ) ) " << fail.str( ) << " D( " << d.addr1 << " ) = D( addr ); }";
+            break;
+
+            case e_op_kind_IND_DAT:
+            case e_op_kind_IDX_DAT:
+            os << "{ int64_t addr = D( " << d.addr1 << " )";
+            if( d.kind == e_op_kind_IDX_DAT )
+               os << " + D( " << d.addr2 << " )";
+            os << "; if( BAD( addr ) ) " << fail.str( ) << " D( addr ) = D( "
+             << ( d.kind == e_op_kind_IDX_DAT ? d.addr3 : d.addr2 ) << " ); }";
+            break;
+
+            case e_op_kind_PSH_DAT:
+            os << "if( p_frame->us == " << ( ussize / 8 ) << " ) " << fail.str( )
+             << " US( ++p_frame->us ) = D( " << d.addr1 << " );";
+            break;
+
+            case e_op_kind_POP_DAT:
+            os << "if( p_frame->us == 0 ) " << fail.str( ) << " D( " << d.addr1 << " ) = US( p_frame->us-- );";
+            break;
+
+            case e_op_kind_JMP_SUB:
+            os << "if( p_frame->cs == " << ( cssize / 8 ) << " ) " << fail.str( )
+             << " CS( ++p_frame->cs ) = " << ( d.pc + d.size ) << ";";
+            break;
+
+            case e_op_kind_BZR_DAT:
+            os << "if( D( " << d.addr1 << " ) == 0 ) " << get_aot_jump( code, leaders, d.dest, d.target );
+            break;
+
+            case e_op_kind_BNZ_DAT:
+            os << "if( D( " << d.addr1 << " ) != 0 ) " << get_aot_jump( code, leaders, d.dest, d.target );
+            break;
+
+            case e_op_kind_BGT_DAT:
+            case e_op_kind_BLT_DAT:
+            case e_op_kind_BGE_DAT:
+            case e_op_kind_BLE_DAT:
+            case e_op_kind_BEQ_DAT:
+            case e_op_kind_BNE_DAT:
+            os << "if( D( " << d.addr1 << " ) " << ( d.kind == e_op_kind_BGT_DAT ? ">"
+             : d.kind == e_op_kind_BLT_DAT ? "<" : d.kind == e_op_kind_BGE_DAT ? ">="
+             : d.kind == e_op_kind_BLE_DAT ? "<=" : d.kind == e_op_kind_BEQ_DAT ? "==" : "!=" )
+             << " D( " << d.addr2 << " ) ) " << get_aot_jump( code, leaders, d.dest, d.target );
+            break;
+         }
+
+         os << '\n';
+
+         if( j != last )
+            continue;
+
+         if( d.kind == e_op_kind_JMP_ADR || d.kind == e_op_kind_JMP_SUB )
+            os << "   " << get_aot_jump( code, leaders, d.dest, d.target ) << '\n';
+         else
+            os << "   " << get_aot_jump( code, leaders, d.pc + d.size, d.next ) << '\n';
+
+         break;
+      }
+   }
+
+   os << "}\n";
+}
+
+#ifdef AT_AOT
+// NOTE: Returns true if "path" is a directory (or regular file) owned by this user that no other
+// user can write to (symbolic links are never accepted).
+bool is_private_path( const string& path, bool is_dir )
+{
+   struct stat st;
+
+   if( lstat( path.c_str( ), &st ) != 0 || st.st_uid != geteuid( ) || ( st.st_mode & ( S_IWGRP | S_IWOTH ) ) )
+      return false;
+
+   return is_dir ? S_ISDIR( st.st_mode ) : S_ISREG( st.st_mode );
+}
+
+// NOTE: Creates a new (empty) file with a unique name starting with "prefix" (returning false if
+// this failed).
+bool create_temporary_file( const string& prefix, string& name )
+{
+   string pattern( prefix + ".XXXXXX" );
+
+   vector< char > buffer( pattern.begin( ), pattern.end( ) );
+   buffer.push_back( '\0' );
+
+   int fd = mkstemp( &buffer[ 0 ] );
+
+   if( fd < 0 )
+      return false;
+
+   ::close( fd );
+   name = &buffer[ 0 ];
+
+   return true;
+}
+
+// NOTE: The compiler is run directly (rather than through a shell) so that neither "$CXX" nor any
+// path is ever interpreted. As the source is in a temporary file "-x c++" is used to identify it.
+bool run_aot_compiler( const string& so_name, const string& cpp_name )
+{
+   const char* p_cxx = getenv( "CXX" );
+
+   if( !p_cxx || !*p_cxx )
+      p_cxx = "c++";
+
+   pid_t pid = fork( );
+
+   if( pid < 0 )
+      return false;
+
+   if( pid == 0 )
+   {
+      execlp( p_cxx, p_cxx, "-O2", "-shared", "-fPIC",
+       "-o", so_name.c_str( ), "-x", "c++", cpp_name.c_str( ), ( char* )0 );
+
+      _exit( 127 );
+   }
+
+   int status = 0;
+
+   while( waitpid( pid, &status, 0 ) < 0 )
+   {
+      if( errno != EINTR )
+         return false;
+   }
+
+   return WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+}
+
+// NOTE: Compiles the source into temporary files that are then renamed into place (so that other
+// processes compiling the same code can never see a partially written shared object).
+bool build_aot_object( const decoded_code& code, int32_t cssize, int32_t ussize, const string& base )
+{
+   string cpp_temp, so_temp;
+
+   if( !create_temporary_file( base + ".cpp", cpp_temp ) )
+      return false;
+
+   if( !create_temporary_file( base + ".so", so_temp ) )
+   {
+      unlink( cpp_temp.c_str( ) );
+      return false;
+   }
+
+   ofstream outf( cpp_temp.c_str( ) );
+   generate_aot_source( outf, code, cssize, ussize );
+   outf.close( );
+
+   bool okay = outf.good( ) && run_aot_compiler( so_temp, cpp_temp )
+    && chmod( so_temp.c_str( ), S_IRWXU ) == 0 && rename( so_temp.c_str( ), ( base + ".so" ).c_str( ) ) == 0;
+
+   if( okay )
+      rename( cpp_temp.c_str( ), ( base + ".cpp" ).c_str( ) );
+   else
+   {
+      unlink( so_temp.c_str( ) );
+      unlink( cpp_temp.c_str( ) );
+   }
+
+   return okay;
+}
+
+bool aot_compile( aot_code& aot, const decoded_code& code, int8_t* p_code, int32_t cssize, int32_t ussize )
+{
+   if( aot.native.version == code.version )
+      return true;
+
+   sha256 hash;
+
+   hash.update( p_code, code.csize );
+
+   int32_t sizes[ ] = { code.csize, code.dsize, cssize, ussize };
+   hash.update( sizes, sizeof( sizes ) );
+
+   string digest( hash.hex_digest( ) );
+
+   if( aot.hash != digest )
+   {
+      aot.release( );
+
+      // NOTE: There is no default directory (as the current one could be writable by others).
+      const char* p_dir = getenv( "AT_AOT_DIR" );
+
+      if( !p_dir || !*p_dir || !is_private_path( p_dir, true ) )
+         return false;
+
+      string base( string( p_dir ) + "/at_" + digest );
+      string so_name( base + ".so" );
+
+      struct stat st;
+
+      if( lstat( so_name.c_str( ), &st ) != 0 && !build_aot_object( code, cssize, ussize, base ) )
+         return false;
+
+      if( !is_private_path( so_name, false ) )
+         return false;
+
+      void* p_handle = dlopen( so_name.c_str( ), RTLD_NOW | RTLD_LOCAL );
+
+      if( !p_handle )
+         return false;
+
+      void* p_run = dlsym( p_handle, "at_aot_run" );
+
+      if( !p_run )
+      {
+         dlclose( p_handle );
+         return false;
+      }
+
+      aot.p_handle = p_handle;
+      aot.hash = digest;
+
+      aot.native.p_enter = ( native_enter_func )p_run;
+   }
+
+   vector< bool > leaders;
+   find_block_leaders( code, is_aot_supported, leaders );
+
+   aot.native.entries.assign( code.ops.size( ), -1 );
+
+   for( size_t i = 0; i < code.ops.size( ); i++ )
+   {
+      if( leaders[ i ] && is_aot_supported( code.ops[ i ] ) )
+         aot.native.entries[ i ] = 0;
+   }
+
+   aot.native.version = code.version;
+
+   return true;
+}
+#else
+bool aot_compile( aot_code& aot, const decoded_code& code, int8_t* p_code, int32_t cssize, int32_t ussize )
+{
+   aot.release( );
+   return false;
+}
+#endif
+
+// NOTE: The code of an AT (along with its decoded ops, jump targets and JIT compiled form) that is
+// shared (read-only) by all ATs with the same code and memory geometry.
+struct shared_code
+{
+   shared_code( )
+    :
+    ref_count( 1 )
+   {
+   }
+
+   int32_t volatile ref_count;
+
+   string hash;
+
+   int32_t code_pages;
+   int32_t data_pages;
+
+   int32_t call_stack_pages;
+   int32_t user_stack_pages;
+
+   decoded_code code; // (which holds the code bytes)
+
+   jit_code jit;
+
+   // NOTE: Compiles the code if this hasn't already been done (and as this is not thread safe it
+   // should be called before ATs with the code are executed by multiple threads).
+   const native_code* get_native( )
+   {
+      if( jit_compile( jit, code ) && jit.native.p_enter )
+         return &jit.native;
+
+      return 0;
+   }
+};
+
+void release_shared_code( shared_code* p_shared )
+{
+   if( p_shared && atomic_decrement( &p_shared->ref_count ) == 0 )
+      delete p_shared;
+}
+
+const decoded_code& at_context::get_code( ) const
+{
+   return p_shared_code ? p_shared_code->code : code;
+}
+
+void at_context::set_shared_code( shared_code* p_new_shared )
+{
+   if( p_new_shared )
+      atomic_increment( &p_new_shared->ref_count );
+
+   // NOTE: If no longer sharing then the AT gets its own copy of the code (as it is probably about
+   // to be changed).
+   if( p_shared_code && !p_new_shared )
+   {
+      const vector< int8_t >& bytes( p_shared_code->code.bytes );
+
+      ap_code.allocate( bytes.size( ), p_pools );
+      memcpy( ap_code.get( ), &bytes[ 0 ], bytes.size( ) );
+
+      code = p_shared_code->code;
+      state.p_jumps = &code.jumps;
+   }
+
+   release_shared_code( p_shared_code );
+   p_shared_code = p_new_shared;
+
+   if( p_shared_code )
+   {
+      ap_code.reset( &p_shared_code->code.bytes[ 0 ], false );
+      state.p_jumps = &p_shared_code->code.jumps;
+   }
+}
+
+// NOTE: A cache of shared code keyed by the hash of the code and memory geometry. As ATs are often
+// created from the same templates (with only their initial data differing) the code for these is
+// only ever decoded and verified (and compiled) once with every AT using the same copy.
+struct code_cache
+{
+   code_cache( )
+   {
+      num_hits = 0;
+      num_misses = 0;
+   }
+
+   ~code_cache( )
+   {
+      clear( );
+   }
+
+   static string get_hash( const int8_t* p_code, int32_t code_pages,
+    int32_t data_pages, int32_t call_stack_pages, int32_t user_stack_pages )
+   {
+      sha256 hash;
+
+      int32_t pages[ ] = { code_pages, data_pages, call_stack_pages, user_stack_pages };
+
+      hash.update( pages, sizeof( pages ) );
+      hash.update( p_code, code_pages * c_code_page_bytes );
+
+      return hash.hex_digest( );
+   }
+
+   // NOTE: Changes the AT to use the cached copy of its code (first adding this to the cache if it
+   // was not already present). Returns the hash of the code (to use with "use_template").
+   string share( at_context& context );
+
+   // NOTE: Sets an AT's code and memory geometry to that of cached code (returning false if it has
+   // not been cached) and resets its state (with its data being cleared). Neither hashing nor any
+   // decoding or verification of the code is needed.
+   bool use_template( at_context& context, const string& hash );
+
+   // NOTE: Removes any cached code that isn't being used by any ATs.
+   void purge( );
+
+   void clear( );
+
+   size_t size( ) const { return entries.size( ); }
+
+   size_t num_hits;
+   size_t num_misses;
+
+   private:
+   map< string, shared_code* > entries;
+};
+
+string code_cache::share( at_context& context )
+{
+   string hash( get_hash( context.ap_code.get( ), context.code_pages,
+    context.data_pages, context.call_stack_pages, context.user_stack_pages ) );
+
+   map< string, shared_code* >::iterator i = entries.find( hash );
+
+   shared_code* p_shared = 0;
+
+   if( i != entries.end( ) )
+   {
+      ++num_hits;
+      p_shared = i->second;
+   }
+   else
+   {
+      ++num_misses;
+
+      p_shared = new shared_code;
+
+      p_shared->hash = hash;
+
+      p_shared->code_pages = context.code_pages;
+      p_shared->data_pages = context.data_pages;
+      p_shared->call_stack_pages = context.call_stack_pages;
+      p_shared->user_stack_pages = context.user_stack_pages;
+
+      decode_code( p_shared->code, context.ap_code.get( ),
+       context.csize( ), context.dsize( ), context.cssize( ), context.ussize( ) );
+
+      entries.insert( make_pair( hash, p_shared ) );
+   }
+
+   if( context.p_shared_code != p_shared )
+      context.set_shared_code( p_shared );
+
+   return hash;
+}
+
+bool code_cache::use_template( at_context& context, const string& hash )
+{
+   map< string, shared_code* >::iterator i = entries.find( hash );
+
+   if( i == entries.end( ) )
+      return false;
+
+   ++num_hits;
+
+   shared_code& shared( *i->second );
+
+   if( context.data_pages != shared.data_pages
+    || context.call_stack_pages != shared.call_stack_pages || context.user_stack_pages != shared.user_stack_pages )
+   {
+      context.data_pages = shared.data_pages;
+      context.call_stack_pages = shared.call_stack_pages;
+      context.user_stack_pages = shared.user_stack_pages;
+
+      context.allocate_data( );
+   }
+   else
+   {
+      memset( context.ap_data.get( ), 0, context.dsize( ) + context.cssize( ) + context.ussize( ) );
+      context.mark_all_dirty( );
+   }
+
+   context.code_pages = shared.code_pages;
+
+   if( context.p_shared_code != &shared )
+      context.set_shared_code( &shared );
+
+   context.state.reset( );
+
+   return true;
+}
+
+void code_cache::purge( )
+{
+   for( map< string, shared_code* >::iterator i = entries.begin( ); i != entries.end( ); )
+   {
+      if( i->second->ref_count == 1 )
+      {
+         release_shared_code( i->second );
+         entries.erase( i++ );
+      }
+      else
+         ++i;
+   }
+}
+
+void code_cache::clear( )
+{
+   for( map< string, shared_code* >::iterator i = entries.begin( ); i != entries.end( ); ++i )
+      release_shared_code( i->second );
+
+   entries.clear( );
+}
+
+// NOTE: Executes in the same manner as "run_decoded" but using any native code that has been
+// compiled (if "p_native" is null or has not been compiled then this is just "run_decoded").
+int run_native( const native_code* p_native, at_context& context, int32_t max_steps, int32_t& steps )
+{
+   const decoded_code& code( context.get_code( ) );
+   machine_state& state( context.state );
+
+   if( !p_native || !p_native->p_enter || p_native->version != code.version || state.stopped || state.finished )
+      return run_decoded( context, max_steps, steps );
+
+   int8_t* p_data = context.ap_data.get( );
+   int32_t csize = context.csize( );
+
+   int rc = 0;
+
+   steps = 0;
+
+   while( true )
+   {
+      int32_t i = ( state.pc >= 0 && state.pc < csize ) ? code.index[ state.pc ] : -1;
+
+      if( i >= 0 && p_native->entries[ i ] >= 0 )
+      {
+         native_frame frame;
+
+         frame.remaining = max_steps - steps;
+         frame.pc = state.pc;
+         frame.cs = state.cs;
+         frame.us = state.us;
+
+         ( *p_native->p_enter )( p_data, &frame, p_native->p_base + p_native->entries[ i ] );
+
+         // NOTE: Native code doesn't track which pages it writes to.
+         context.mark_all_dirty( );
+
+         int32_t executed = ( int32_t )( max_steps - steps - frame.remaining );
+
+         state.pc = frame.pc;
+         state.cs = frame.cs;
+         state.us = frame.us;
+
+         state.steps += executed;
+
+         steps += executed;
+
+         if( steps >= max_steps )
+            return rc;
+
+         i = ( state.pc >= 0 && state.pc < csize ) ? code.index[ state.pc ] : -1;
+      }
+
+      // NOTE: As with "run_decoded" an external function call (or anything that isn't the start
+      // of an op) will only be executed if nothing has yet been executed.
+      bool ext_fun = i >= 0 && is_ext_fun( code.ops[ i ] );
+
+      if( steps && ( i < 0 || ext_fun ) )
+         return rc;
+
+      int32_t executed = 0;
+
+      rc = run_decoded( context, i < 0 ? max_steps - steps : 1, executed );
+
+      steps += executed;
+
+      if( i < 0 || ext_fun || steps >= max_steps || rc < 0 || state.stopped || state.finished || is_sleeping( context ) )
+         return rc;
+   }
+}
+
+void dump_state( const machine_state& state )
+{
+   cout << "pc: " << hex << setw( 8 ) << setfill( '0' ) << state.pc << '\n';
+
+   cout << "cs: " << dec << state.cs << '\n';
+   cout << "us: " << dec << state.us << '\n';
+
+   cout << "pce: " << hex << setw( 8 ) << setfill( '0' ) << state.pcs << '\n';
+   cout << "pcs: " << hex << setw( 8 ) << setfill( '0' ) << state.pcs << '\n';
+
+   cout << "steps: " << dec << state.steps << '\n';
+
+   cout << "a1: " << hex << setw( 16 ) << setfill( '0' ) << state.a1 << '\n';
+   cout << "a2: " << hex << setw( 16 ) << setfill( '0' ) << state.a2 << '\n';
+   cout << "a3: " << hex << setw( 16 ) << setfill( '0' ) << state.a3 << '\n';
+   cout << "a4: " << hex << setw( 16 ) << setfill( '0' ) << state.a4 << '\n';
+
+   cout << "b1: " << hex << setw( 16 ) << setfill( '0' ) << state.b1 << '\n';
+   cout << "b2: " << hex << setw( 16 ) << setfill( '0' ) << state.b2 << '\n';
+   cout << "b3: " << hex << setw( 16 ) << setfill( '0' ) << state.b3 << '\n';
+   cout << "b4: " << hex << setw( 16 ) << setfill( '0' ) << state.b4 << '\n';
+}
+
+void dump_bytes( int8_t* p_bytes, int num )
+{
+   for( int i = 0; i < num; i += 16 )
+   {
+      cout << hex << setw( 8 ) << setfill( '0' ) << i << ' ';
+
+      for( int j = 0; j < 16; j++ )
+      {
+         int val = ( unsigned char )p_bytes[ i + j ];
+
+         cout << ' ' << hex << setw( 2 ) << setfill( '0' ) << val;
+      }
+
+      cout << '\n';
+   }
+}
+
+void list_code( at_context& context )
+{
+   machine_state& state( context.state );
+
+   int32_t opc = state.pc;
+   int32_t osteps = state.steps;
+
+   state.pc = 0;
+   state.opc = opc;
+
+   while( true )
+   {
+      int rc = process_op( context, true );
+
+      if( rc <= 0 )
+         break;
+
+      state.pc += rc;
+   }
+
+   state.steps = osteps;
+   state.pc = opc;
+}
+
+void list_verified( const decoded_code& code )
+{
+   int32_t num_reachable = 0;
+   int32_t num_runtime_checked = 0;
+
+   for( size_t i = 0; i < code.ops.size( ); i++ )
+   {
+      const decoded_op& d( code.ops[ i ] );
+
+      if( !( d.flags & e_verify_flag_reachable ) )
+         continue;
+
+      ++num_reachable;
+
+      if( !( d.flags & ( e_verify_flag_indirect | e_verify_flag_stack | e_verify_flag_invalid ) ) )
+         continue;
+
+      ++num_runtime_checked;
+
+      cout << hex << setw( 8 ) << setfill( '0' ) << d.pc;
+
+      if( d.flags & e_verify_flag_indirect )
+         cout << " indirect";
+
+      if( d.flags & e_verify_flag_stack )
+         cout << " stack";
+
+      if( d.flags & e_verify_flag_invalid )
+         cout << " invalid";
+
+      cout << '\n';
+   }
+
+   cout << "ops: " << dec << code.ops.size( ) << ", reachable: "
+    << num_reachable << ", runtime checked: " << num_runtime_checked << '\n';
+}
+
+bool check_has_balance( const at_context& context )
+{
+   if( context.balance == 0 )
+   {
+      cout << "(stopped - zero balance)\n";
+      return false;
+   }
+   else
+      return true;
+}
+
+int32_t get_max_steps( const at_context& context, int32_t max_steps )
+{
+   if( context.balance > 0 && context.balance < max_steps )
+      return ( int32_t )context.balance;
+   else
+      return max_steps;
+}
+
+void reset_machine( at_context& context )
+{
+   context.state.reset( );
+
+   // NOTE: Shared code is never changed and other code only needs to be decoded again if it (or
+   // the memory geometry) has changed since it was last decoded (so its version is unchanged and
+   // any JIT compiled code for it can continue to be used).
+   if( !context.p_shared_code && !context.code.is_decoded_from( context.ap_code.get( ),
+    context.csize( ), context.dsize( ), context.cssize( ), context.ussize( ) ) )
+      decode_code( context.code, context.ap_code.get( ),
+       context.csize( ), context.dsize( ), context.cssize( ), context.ussize( ) );
+
+   // NOTE: Only the pages written since the last reset need to be cleared (as the rest are already
+   // all zeroes).
+   int8_t* p_data = context.ap_data.get( );
+   size_t size = context.dsize( ) + context.cssize( ) + context.ussize( );
+
+   for( size_t i = 0; i < context.dirty_pages.size( ); i++ )
+   {
+      if( context.dirty_pages[ i ] & e_page_flag_written )
+      {
+         size_t offset = i * c_data_page_bytes;
+
+         memset( p_data + offset, 0, min( size - offset, ( size_t )c_data_page_bytes ) );
+         context.dirty_pages[ i ] = e_page_flag_unhashed;
+      }
+   }
+
+   context.first_call = true;
+
+   for( map< int32_t, function_data >::iterator i = context.func_data.begin( ); i != context.func_data.end( ); ++i )
+      i->second.offset = 0;
+
+   context.payments.clear( );
+}
+
+void load_context( at_context& context, istream& is )
+{
+   machine_state& state( context.state );
+
+   is.read( ( char* )&context.val, sizeof( context.val ) );
+   is.read( ( char* )&context.val1, sizeof( context.val1 ) );
+   is.read( ( char* )&context.balance, sizeof( context.balance ) );
+   is.read( ( char* )&context.first_call, sizeof( context.first_call ) );
+   is.read( ( char* )&context.increment_func, sizeof( context.increment_func ) );
+
+   is.read( ( char* )&state.pc, sizeof( state.pc ) );
+   is.read( ( char* )&state.cs, sizeof( state.cs ) );
+   is.read( ( char* )&state.us, sizeof( state.us ) );
+   is.read( ( char* )&state.pce, sizeof( state.pce ) );
+   is.read( ( char* )&state.pcs, sizeof( state.pcs ) );
+   is.read( ( char* )&state.steps, sizeof( state.steps ) );
+
+   is.read( ( char* )&state.a1, sizeof( state.a1 ) );
+   is.read( ( char* )&state.a2, sizeof( state.a2 ) );
+   is.read( ( char* )&state.a3, sizeof( state.a3 ) );
+   is.read( ( char* )&state.a4, sizeof( state.a4 ) );
+
+   is.read( ( char* )&state.b1, sizeof( state.b1 ) );
+   is.read( ( char* )&state.b2, sizeof( state.b2 ) );
+   is.read( ( char* )&state.b3, sizeof( state.b3 ) );
+   is.read( ( char* )&state.b4, sizeof( state.b4 ) );
+
+   is.read( ( char* )&context.code_pages, sizeof( context.code_pages ) );
+   context.allocate_code( );
+
+   is.read( ( char* )context.ap_code.get( ), context.csize( ) );
+
+   is.read( ( char* )&context.data_pages, sizeof( context.data_pages ) );
+   is.read( ( char* )&context.call_stack_pages, sizeof( context.call_stack_pages ) );
+   is.read( ( char* )&context.user_stack_pages, sizeof( context.user_stack_pages ) );
+
+   context.allocate_data( );
+
+   is.read( ( char* )context.ap_data.get( ), context.dsize( ) + context.cssize( ) + context.ussize( ) );
+   context.mark_all_dirty( );
+
+   context.func_data.clear( );
+
+   size_t size;
+   is.read( ( char* )&size, sizeof( size_t ) );
+
+   for( size_t i = 0; i < size; i++ )
+   {
+      int32_t func;
+      is.read( ( char* )&func, sizeof( int32_t ) );
+
+      bool loop;
+      is.read( ( char* )&loop, sizeof( bool ) );
+
+      size_t offset;
+      is.read( ( char* )&offset, sizeof( size_t ) );
+
+      context.func_data[ func ].loop = loop;
+      context.func_data[ func ].offset = offset;
+
+      size_t dsize;
+      is.read( ( char* )&dsize, sizeof( size_t ) );
+
+      for( size_t j = 0; j < dsize; j++ )
+      {
+         int64_t next;
+         is.read( ( char* )&next, sizeof( int64_t ) );
+
+         context.func_data[ func ].data.push_back( next );
+      }
+   }
+
+   decode_code( context.code, context.ap_code.get( ),
+    context.csize( ), context.dsize( ), context.cssize( ), context.ussize( ) );
+}
+
+void save_context( const at_context& context, ostream& os )
+{
+   const machine_state& state( context.state );
+
+   os.write( ( const char* )&context.val, sizeof( context.val ) );
+   os.write( ( const char* )&context.val1, sizeof( context.val1 ) );
+   os.write( ( const char* )&context.balance, sizeof( context.balance ) );
+   os.write( ( const char* )&context.first_call, sizeof( context.first_call ) );
+   os.write( ( const char* )&context.increment_func, sizeof( context.increment_func ) );
+
+   os.write( ( const char* )&state.pc, sizeof( state.pc ) );
+   os.write( ( const char* )&state.cs, sizeof( state.cs ) );
+   os.write( ( const char* )&state.us, sizeof( state.us ) );
+   os.write( ( const char* )&state.pce, sizeof( state.pce ) );
+   os.write( ( const char* )&state.pcs, sizeof( state.pcs ) );
+   os.write( ( const char* )&state.steps, sizeof( state.steps ) );
+
+   os.write( ( const char* )&state.a1, sizeof( state.a1 ) );
+   os.write( ( const char* )&state.a2, sizeof( state.a2 ) );
+   os.write( ( const char* )&state.a3, sizeof( state.a3 ) );
+   os.write( ( const char* )&state.a4, sizeof( state.a4 ) );
+
+   os.write( ( const char* )&state.b1, sizeof( state.b1 ) );
+   os.write( ( const char* )&state.b2, sizeof( state.b2 ) );
+   os.write( ( const char* )&state.b3, sizeof( state.b3 ) );
+   os.write( ( const char* )&state.b4, sizeof( state.b4 ) );
+
+   os.write( ( const char* )&context.code_pages, sizeof( context.code_pages ) );
+   os.write( ( const char* )context.ap_code.get( ), context.csize( ) );
+
+   os.write( ( const char* )&context.data_pages, sizeof( context.data_pages ) );
+   os.write( ( const char* )&context.call_stack_pages, sizeof( context.call_stack_pages ) );
+   os.write( ( const char* )&context.user_stack_pages, sizeof( context.user_stack_pages ) );
+
+   os.write( ( const char* )context.ap_data.get( ), context.dsize( ) + context.cssize( ) + context.ussize( ) );
+
+   size_t size = context.func_data.size( );
+   os.write( ( const char* )&size, sizeof( size_t ) );
+
+   for( map< int32_t, function_data >::const_iterator i = context.func_data.begin( ); i != context.func_data.end( ); ++i )
+   {
+      os.write( ( const char* )&i->first, sizeof( int32_t ) );
+      os.write( ( const char* )&i->second.loop, sizeof( bool ) );
+      os.write( ( const char* )&i->second.offset, sizeof( size_t ) );
+
+      size_t dsize = i->second.data.size( );
+      os.write( ( const char* )&dsize, sizeof( size_t ) );
+
+      for( size_t j = 0; j < dsize; j++ )
+         os.write( ( const char* )&i->second.data[ j ], sizeof( int64_t ) );
+   }
+}
+
+// NOTE: The AT image format (all values being little-endian) is as follows:
+//
+// [Header]
+// 0x4d495441 ; magic ("ATIM") (32 bits)
+// 0x0001     ; image version (16 bits)
+// 0x0001     ; AT version (16 bits)
+// 0x0000     ; (reserved) (16 bits)
+// 0x0001     ; code pages (16 bits)
+// 0x0001     ; data pages (16 bits)
+// 0x0001     ; call stack pages (16 bits)
+// 0x0001     ; user stack pages (16 bits)
+//
+// [Code] (32 bit length prefixed with trailing zero bytes omitted)
+// [Data] (32 bit length prefixed with trailing zero bytes omitted)
+//
+// [State]
+// 0x00000000 ; flags (32 bits) (see "image_flag")
+// 0x00000000 ; pc (32 bits)
+// 0x00000000 ; cs (32 bits)
+// 0x00000000 ; us (32 bits)
+// 0x00000000 ; pce (32 bits)
+// 0x00000000 ; pcs (32 bits)
+// 0x00000000 ; sleep_until (32 bits)
+// 0x00000000 ; steps (32 bits)
+// 0x0000000000000000 ; balance (64 bits)
+// pseudo register A (256 bits) (omitted if A is zero)
+// pseudo register B (256 bits) (omitted if B is zero)
+//
+// [Call Stack] (32 bit length prefixed being the end of the stack with leading zero bytes omitted)
+// [User Stack] (32 bit length prefixed being the end of the stack with leading zero bytes omitted)
+//
+// The REPL test function data is not included (unlike with "save_context").
+const uint32_t c_image_magic = 0x4d495441;
+
+const uint16_t c_image_version = 1;
+const uint16_t c_image_at_version = 1;
+
+const size_t c_image_header_bytes = 18;
+const size_t c_image_state_bytes = 40;
+
+enum image_flag
+{
+   e_image_flag_stopped = 0x01,
+   e_image_flag_finished = 0x02,
+   e_image_flag_a_is_zero = 0x04,
+   e_image_flag_b_is_zero = 0x08,
+   e_image_flag_all = 0x0f
+};
+
+uint64_t get_le( const uint8_t*& p_bytes, size_t size )
+{
+   uint64_t value = 0;
+
+   for( size_t i = 0; i < size; i++ )
+      value |= ( uint64_t )*p_bytes++ << ( i * 8 );
+
+   return value;
+}
+
+size_t get_trimmed_size( const int8_t* p_bytes, size_t size )
+{
+   while( size && !p_bytes[ size - 1 ] )
+      --size;
+
+   return size;
+}
+
+size_t get_stack_size( const int8_t* p_bytes, size_t size )
+{
+   size_t start = 0;
+
+   while( start < size && !p_bytes[ start ] )
+      ++start;
+
+   return size - start;
+}
+
+// NOTE: Serializes an AT into "image" (which is sized once to fit the whole image).
+void save_image( const at_context& context, string& image )
+{
+   const machine_state& state( context.state );
+
+   const int8_t* p_code = context.ap_code.get( );
+   const int8_t* p_data = context.ap_data.get( );
+
+   size_t code_bytes = get_trimmed_size( p_code, context.csize( ) );
+   size_t data_bytes = get_trimmed_size( p_data, context.dsize( ) );
+
+   size_t call_bytes = get_stack_size( p_data + context.dsize( ), context.cssize( ) );
+   size_t user_bytes = get_stack_size( p_data + context.dsize( ) + context.cssize( ), context.ussize( ) );
+
+   uint32_t flags = 0;
+
+   if( state.stopped )
+      flags |= e_image_flag_stopped;
+
+   if( state.finished )
+      flags |= e_image_flag_finished;
+
+   if( !state.a1 && !state.a2 && !state.a3 && !state.a4 )
+      flags |= e_image_flag_a_is_zero;
+
+   if( !state.b1 && !state.b2 && !state.b3 && !state.b4 )
+      flags |= e_image_flag_b_is_zero;
+
+   size_t size = c_image_header_bytes + c_image_state_bytes
+    + sizeof( uint32_t ) * 4 + code_bytes + data_bytes + call_bytes + user_bytes;
+
+   if( !( flags & e_image_flag_a_is_zero ) )
+      size += sizeof( int64_t ) * 4;
+
+   if( !( flags & e_image_flag_b_is_zero ) )
+      size += sizeof( int64_t ) * 4;
+
+   image.resize( size );
+
+   uint8_t* p_bytes = ( uint8_t* )&image[ 0 ];
+
+   put_le( p_bytes, c_image_magic, sizeof( uint32_t ) );
+   put_le( p_bytes, c_image_version, sizeof( uint16_t ) );
+   put_le( p_bytes, c_image_at_version, sizeof( uint16_t ) );
+   put_le( p_bytes, 0, sizeof( uint16_t ) );
+
+   put_le( p_bytes, context.code_pages, sizeof( uint16_t ) );
+   put_le( p_bytes, context.data_pages, sizeof( uint16_t ) );
+   put_le( p_bytes, context.call_stack_pages, sizeof( uint16_t ) );
+   put_le( p_bytes, context.user_stack_pages, sizeof( uint16_t ) );
+
+   put_le( p_bytes, code_bytes, sizeof( uint32_t ) );
+   memcpy( p_bytes, p_code, code_bytes );
+   p_bytes += code_bytes;
+
+   // NOTE: The data (and stacks) are copied as is (being little-endian on all supported platforms).
+   put_le( p_bytes, data_bytes, sizeof( uint32_t ) );
+   memcpy( p_bytes, p_data, data_bytes );
+   p_bytes += data_bytes;
+
+   put_le( p_bytes, flags, sizeof( uint32_t ) );
+   put_le( p_bytes, ( uint32_t )state.pc, sizeof( uint32_t ) );
+   put_le( p_bytes, ( uint32_t )state.cs, sizeof( uint32_t ) );
+   put_le( p_bytes, ( uint32_t )state.us, sizeof( uint32_t ) );
+   put_le( p_bytes, ( uint32_t )state.pce, sizeof( uint32_t ) );
+   put_le( p_bytes, ( uint32_t )state.pcs, sizeof( uint32_t ) );
+   put_le( p_bytes, ( uint32_t )state.sleep_until, sizeof( uint32_t ) );
+   put_le( p_bytes, ( uint32_t )state.steps, sizeof( uint32_t ) );
+   put_le( p_bytes, context.balance, sizeof( int64_t ) );
+
+   if( !( flags & e_image_flag_a_is_zero ) )
+   {
+      put_le( p_bytes, state.a1, sizeof( int64_t ) );
+      put_le( p_bytes, state.a2, sizeof( int64_t ) );
+      put_le( p_bytes, state.a3, sizeof( int64_t ) );
+      put_le( p_bytes, state.a4, sizeof( int64_t ) );
+   }
+
+   if( !( flags & e_image_flag_b_is_zero ) )
+   {
+      put_le( p_bytes, state.b1, sizeof( int64_t ) );
+      put_le( p_bytes, state.b2, sizeof( int64_t ) );
+      put_le( p_bytes, state.b3, sizeof( int64_t ) );
+      put_le( p_bytes, state.b4, sizeof( int64_t ) );
+   }
+
+   put_le( p_bytes, call_bytes, sizeof( uint32_t ) );
+   memcpy( p_bytes, p_data + context.dsize( ) + context.cssize( ) - call_bytes, call_bytes );
+   p_bytes += call_bytes;
+
+   put_le( p_bytes, user_bytes, sizeof( uint32_t ) );
+   memcpy( p_bytes, p_data + context.dsize( ) + context.cssize( ) + context.ussize( ) - user_bytes, user_bytes );
+}
+
+inline bool is_image( const char* p_image, size_t size )
+{
+   const uint8_t* p_bytes = ( const uint8_t* )p_image;
+
+   return size >= sizeof( uint32_t ) && get_le( p_bytes, sizeof( uint32_t ) ) == c_image_magic;
+}
+
+// NOTE: Checks that the pc values and stack counters of a saved state are within the AT's memory
+// geometry (as they are not otherwise checked before use).
+inline bool is_valid_saved_state( const machine_state& state, int32_t csize, int32_t cssize, int32_t ussize )
+{
+   return state.pc >= 0 && state.pc <= csize && state.pce >= 0 && state.pce <= csize
+    && state.pcs >= 0 && state.pcs <= csize && state.cs >= 0 && state.cs <= cssize / 8
+    && state.us >= 0 && state.us <= ussize / 8;
+}
+
+// NOTE: Loads an AT from an image (returning false without changing the AT if the image is not
+// valid). The whole image is validated before anything is changed with the code and data then
+// being copied directly from the image into the AT.
+bool load_image( at_context& context, const char* p_image, size_t size )
+{
+   const uint8_t* p_bytes = ( const uint8_t* )p_image;
+   const uint8_t* p_end = p_bytes + size;
+
+   if( size < c_image_header_bytes || !is_image( p_image, size ) )
+      return false;
+
+   p_bytes += sizeof( uint32_t );
+
+   if( get_le( p_bytes, sizeof( uint16_t ) ) != c_image_version
+    || get_le( p_bytes, sizeof( uint16_t ) ) != c_image_at_version || get_le( p_bytes, sizeof( uint16_t ) ) != 0 )
+      return false;
+
+   int32_t code_pages = ( int32_t )get_le( p_bytes, sizeof( uint16_t ) );
+   int32_t data_pages = ( int32_t )get_le( p_bytes, sizeof( uint16_t ) );
+   int32_t call_stack_pages = ( int32_t )get_le( p_bytes, sizeof( uint16_t ) );
+   int32_t user_stack_pages = ( int32_t )get_le( p_bytes, sizeof( uint16_t ) );
+
+   if( !code_pages || !data_pages || !call_stack_pages || !user_stack_pages )
+      return false;
+
+   int32_t csize = code_pages * c_code_page_bytes;
+   int32_t dsize = data_pages * c_data_page_bytes;
+   int32_t cssize = call_stack_pages * c_call_stack_page_bytes;
+   int32_t ussize = user_stack_pages * c_user_stack_page_bytes;
+
+   if( p_end - p_bytes < ( ptrdiff_t )sizeof( uint32_t ) )
+      return false;
+
+   size_t code_bytes = ( size_t )get_le( p_bytes, sizeof( uint32_t ) );
+
+   if( code_bytes > ( size_t )csize || ( size_t )( p_end - p_bytes ) < code_bytes + sizeof( uint32_t ) )
+      return false;
+
+   const uint8_t* p_code = p_bytes;
+   p_bytes += code_bytes;
+
+   size_t data_bytes = ( size_t )get_le( p_bytes, sizeof( uint32_t ) );
+
+   if( data_bytes > ( size_t )dsize || ( size_t )( p_end - p_bytes ) < data_bytes + c_image_state_bytes )
+      return false;
+
+   const uint8_t* p_data = p_bytes;
+   p_bytes += data_bytes;
+
+   machine_state state;
+
+   uint32_t flags = ( uint32_t )get_le( p_bytes, sizeof( uint32_t ) );
+
+   state.pc = ( int32_t )get_le( p_bytes, sizeof( uint32_t ) );
+   state.cs = ( int32_t )get_le( p_bytes, sizeof( uint32_t ) );
+   state.us = ( int32_t )get_le( p_bytes, sizeof( uint32_t ) );
+   state.pce = ( int32_t )get_le( p_bytes, sizeof( uint32_t ) );
+   state.pcs = ( int32_t )get_le( p_bytes, sizeof( uint32_t ) );
+   state.sleep_until = ( int32_t )get_le( p_bytes, sizeof( uint32_t ) );
+   state.steps = ( int32_t )get_le( p_bytes, sizeof( uint32_t ) );
+
+   int64_t balance = ( int64_t )get_le( p_bytes, sizeof( int64_t ) );
+
+   if( flags & ~e_image_flag_all || !is_valid_saved_state( state, csize, cssize, ussize ) )
+      return false;
+
+   state.stopped = ( flags & e_image_flag_stopped ) != 0;
+   state.finished = ( flags & e_image_flag_finished ) != 0;
+
+   size_t register_bytes = 0;
+
+   if( !( flags & e_image_flag_a_is_zero ) )
+      register_bytes += sizeof( int64_t ) * 4;
+
+   if( !( flags & e_image_flag_b_is_zero ) )
+      register_bytes += sizeof( int64_t ) * 4;
+
+   if( ( size_t )( p_end - p_bytes ) < register_bytes + sizeof( uint32_t ) )
+      return false;
+
+   if( !( flags & e_image_flag_a_is_zero ) )
+   {
+      state.a1 = ( int64_t )get_le( p_bytes, sizeof( int64_t ) );
+      state.a2 = ( int64_t )get_le( p_bytes, sizeof( int64_t ) );
+      state.a3 = ( int64_t )get_le( p_bytes, sizeof( int64_t ) );
+      state.a4 = ( int64_t )get_le( p_bytes, sizeof( int64_t ) );
+   }
+
+   if( !( flags & e_image_flag_b_is_zero ) )
+   {
+      state.b1 = ( int64_t )get_le( p_bytes, sizeof( int64_t ) );
+      state.b2 = ( int64_t )get_le( p_bytes, sizeof( int64_t ) );
+      state.b3 = ( int64_t )get_le( p_bytes, sizeof( int64_t ) );
+      state.b4 = ( int64_t )get_le( p_bytes, sizeof( int64_t ) );
+   }
+
+   size_t call_bytes = ( size_t )get_le( p_bytes, sizeof( uint32_t ) );
+
+   if( call_bytes > ( size_t )cssize || ( size_t )( p_end - p_bytes ) < call_bytes + sizeof( uint32_t ) )
+      return false;
+
+   const uint8_t* p_call = p_bytes;
+   p_bytes += call_bytes;
+
+   size_t user_bytes = ( size_t )get_le( p_bytes, sizeof( uint32_t ) );
+
+   if( user_bytes > ( size_t )ussize || ( size_t )( p_end - p_bytes ) != user_bytes )
+      return false;
+
+   const uint8_t* p_user = p_bytes;
+
+   context.code_pages = code_pages;
+   context.data_pages = data_pages;
+   context.call_stack_pages = call_stack_pages;
+   context.user_stack_pages = user_stack_pages;
+
+   context.allocate_code( );
+   context.allocate_data( );
+
+   memcpy( context.ap_code.get( ), p_code, code_bytes );
+
+   int8_t* p_dest = context.ap_data.get( );
+
+   memcpy( p_dest, p_data, data_bytes );
+   memcpy( p_dest + dsize + cssize - call_bytes, p_call, call_bytes );
+   memcpy( p_dest + dsize + cssize + ussize - user_bytes, p_user, user_bytes );
+
+   context.mark_all_dirty( );
+
+   state.p_jumps = context.state.p_jumps;
+   context.state = state;
+
+   context.balance = balance;
+
+   decode_code( context.code, context.ap_code.get( ), csize, dsize, cssize, ussize );
+
+   return true;
+}
+
+#ifdef AT_STORE
+// NOTE: A record in the image store (which is followed by the AT's code and then its data).
+struct store_record
+{
+   int64_t id;
+   int64_t balance;
+
+   uint16_t code_pages;
+   uint16_t data_pages;
+   uint16_t call_stack_pages;
+   uint16_t user_stack_pages;
+
+   uint32_t flags; // see "image_flag" (only the stopped and finished flags are used)
+
+   int32_t pc;
+   int32_t cs;
+   int32_t us;
+   int32_t pce;
+   int32_t pcs;
+   int32_t sleep_until;
+   int32_t steps;
+
+   int64_t a1;
+   int64_t a2;
+   int64_t a3;
+   int64_t a4;
+
+   int64_t b1;
+   int64_t b2;
+   int64_t b3;
+   int64_t b4;
+};
+
+struct store_header
+{
+   uint32_t magic;
+   uint32_t version;
+
+   uint64_t index_capacity; // a power of two
+   uint64_t num_records;
+   uint64_t end; // the offset at which the next record will be added
+};
+
+struct store_index_entry
+{
+   int64_t id;
+   uint64_t offset; // zero if the entry is not in use
+};
+
+enum store_sync
+{
+   e_store_sync_none, // leave the written pages to be written back by the OS (or by "flush")
+   e_store_sync_record, // wait for the record just committed to be written
+   e_store_sync_all // wait for all written pages to be written
+};
+
+// NOTE: Called after every commit with the number of commits since the store was last synced.
+typedef store_sync ( *store_sync_policy )( size_t num_unsynced );
+
+store_sync sync_never( size_t )
+{
+   return e_store_sync_none;
+}
+
+store_sync sync_every_commit( size_t )
+{
+   return e_store_sync_record;
+}
+
+const uint32_t c_store_magic = 0x53544154; // "TATS" (when written as little-endian)
+const uint32_t c_store_version = 1;
+
+const size_t c_store_header_bytes = 4096;
+const size_t c_store_record_alignment = 64;
+
+// NOTE: A persistent store of ATs held in a single memory mapped file that consists of a header,
+// a hash index (by AT id) and then the records (each of which is a "store_record" followed by the
+// AT's code and data). The whole of "max_bytes" is mapped when opened (and the file is extended
+// as records are added) so records never move and ATs that are attached to their records execute
+// directly against the mapping. Opening a store only reads its header (with the index and records
+// being paged in by the OS as they are used) and as the AT data is written in place only the pages
+// that have been changed will ever be written back.
+struct at_image_store
+{
+   at_image_store( )
+    :
+    fd( -1 ),
+    p_base( 0 ),
+    mapped_bytes( 0 ),
+    file_bytes( 0 ),
+    num_unsynced( 0 ),
+    p_sync_policy( sync_never )
+   {
+   }
+
+   ~at_image_store( )
+   {
+      close( );
+   }
+
+   bool is_open( ) const { return p_base != 0; }
+
+   size_t size( ) const { return p_base ? header( ).num_records : 0; }
+
+   // NOTE: If the file does not exist then it is created with an index for "index_capacity" ATs.
+   bool open( const string& file_name, size_t index_capacity = 1 << 20, size_t max_bytes = ( size_t )1 << 36 );
+
+   void close( );
+
+   bool has( int64_t id ) const { return find( id ) != 0; }
+
+   // NOTE: Copies an AT into a new record (throwing if it already exists or the store is full) and
+   // then attaches it to that record.
+   void add( at_context& context );
+
+   // NOTE: Attaches an AT to its record (returning false without changing the AT if it is not found
+   // or its record is not valid) so its code and data point into the mapping (which must therefore remain open for as long as the AT is used). If a cache
+   // is provided then the AT will use the cached code (rather than that in the mapping).
+   bool attach( at_context& context, int64_t id, code_cache* p_cache = 0 );
+
+   // NOTE: Writes the state of an attached AT into its record (its data being already in place).
+   void commit( const at_context& context );
+
+   void flush( );
+
+   private:
+   at_image_store( const at_image_store& );
+   at_image_store& operator =( const at_image_store& );
+
+   store_header& header( ) const { return *( store_header* )p_base; }
+
+   store_index_entry* index( ) const { return ( store_index_entry* )( p_base + c_store_header_bytes ); }
+
+   size_t records_start( ) const { return c_store_header_bytes + header( ).index_capacity * sizeof( store_index_entry ); }
+
+   store_index_entry* find( int64_t id ) const;
+
+   void sync( size_t offset, size_t bytes, bool wait );
+
+   int fd;
+
+   int8_t* p_base;
+
+   size_t mapped_bytes;
+   size_t file_bytes;
+
+   size_t num_unsynced;
+
+   public:
+   store_sync_policy p_sync_policy;
+};
+
+bool at_image_store::open( const string& file_name, size_t index_capacity, size_t max_bytes )
+{
+   close( );
+
+   if( !index_capacity )
+      return false;
+
+   fd = ::open( file_name.c_str( ), O_RDWR | O_CREAT, 0644 );
+
+   if( fd < 0 )
+      return false;
+
+   struct stat st;
+
+   if( fstat( fd, &st ) != 0 )
+   {
+      close( );
+      return false;
+   }
+
+   bool created = ( st.st_size == 0 );
+
+   if( created )
+   {
+      size_t capacity = 1;
+
+      while( capacity < index_capacity )
+         capacity <<= 1;
+
+      file_bytes = c_store_header_bytes + capacity * sizeof( store_index_entry );
+
+      if( ftruncate( fd, file_bytes ) != 0 )
+      {
+         close( );
+         return false;
+      }
+   }
+   else
+      file_bytes = st.st_size;
+
+   if( file_bytes > max_bytes )
+      max_bytes = file_bytes;
+
+   void* p_map = mmap( 0, max_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+
+   if( p_map == MAP_FAILED )
+   {
+      close( );
+      return false;
+   }
+
+   p_base = ( int8_t* )p_map;
+   mapped_bytes = max_bytes;
+
+   store_header& hdr( header( ) );
+
+   if( created )
+   {
+      hdr.magic = c_store_magic;
+      hdr.version = c_store_version;
+
+      hdr.index_capacity = ( file_bytes - c_store_header_bytes ) / sizeof( store_index_entry );
+      hdr.num_records = 0;
+      hdr.end = file_bytes;
+   }
+   // NOTE: The index capacity is checked before it is used (so that a corrupt value cannot overflow
+   // the index size or produce a hash mask that is not all ones).
+   else if( file_bytes < c_store_header_bytes || hdr.magic != c_store_magic || hdr.version != c_store_version
+    || !hdr.index_capacity || ( hdr.index_capacity & ( hdr.index_capacity - 1 ) )
+    || hdr.index_capacity > ( file_bytes - c_store_header_bytes ) / sizeof( store_index_entry )
+    || hdr.end < records_start( ) || hdr.end > file_bytes )
+   {
+      close( );
+      return false;
+   }
+
+   return true;
+}
+
+void at_image_store::close( )
+{
+   if( p_base )
+   {
+      msync( p_base, file_bytes, MS_SYNC );
+      munmap( p_base, mapped_bytes );
+   }
+
+   if( fd >= 0 )
+      ::close( fd );
+
+   fd = -1;
+   p_base = 0;
+
+   mapped_bytes = file_bytes = 0;
+   num_unsynced = 0;
+}
+
+store_index_entry* at_image_store::find( int64_t id ) const
+{
+   if( !p_base )
+      return 0;
+
+   uint64_t mask = header( ).index_capacity - 1;
+
+   store_index_entry* p_index = index( );
+
+   for( uint64_t i = ( ( uint64_t )id * 0x9e3779b97f4a7c15ULL ) >> 20; ; ++i )
+   {
+      store_index_entry& entry( p_index[ i & mask ] );
+
+      if( !entry.offset )
+         return 0;
+
+      if( entry.id == id )
+         return &entry;
+   }
+}
+
+void at_image_store::add( at_context& context )
+{
+   store_header& hdr( header( ) );
+
+   if( find( context.id ) )
+      throw runtime_error( "AT already exists in store" );
+
+   // NOTE: The index is never allowed to become more than three quarters full.
+   if( ( hdr.num_records + 1 ) * 4 > hdr.index_capacity * 3 )
+      throw runtime_error( "AT store index is full" );
+
+   size_t csize = context.csize( );
+   size_t data_bytes = context.dsize( ) + context.cssize( ) + context.ussize( );
+
+   size_t offset = hdr.end;
+   size_t bytes = sizeof( store_record ) + csize + data_bytes;
+
+   size_t end = offset + ( bytes + c_store_record_alignment - 1 ) / c_store_record_alignment * c_store_record_alignment;
+
+   if( end > mapped_bytes )
+      throw runtime_error( "AT store is full" );
+
+   if( end > file_bytes )
+   {
+      // NOTE: The file is extended by at least 1/8th to avoid resizing it for every record.
+      size_t new_bytes = max( end, file_bytes + file_bytes / 8 );
+
+      if( new_bytes > mapped_bytes )
+         new_bytes = mapped_bytes;
+
+      if( ftruncate( fd, new_bytes ) != 0 )
+         throw runtime_error( "unable to extend AT store" );
+
+      file_bytes = new_bytes;
+   }
+
+   store_record& record( *( store_record* )( p_base + offset ) );
+
+   record.id = context.id;
+
+   record.code_pages = ( uint16_t )context.code_pages;
+   record.data_pages = ( uint16_t )context.data_pages;
+   record.call_stack_pages = ( uint16_t )context.call_stack_pages;
+   record.user_stack_pages = ( uint16_t )context.user_stack_pages;
+
+   int8_t* p_code = p_base + offset + sizeof( store_record );
+
+   memcpy( p_code, context.ap_code.get( ), csize );
+   memcpy( p_code + csize, context.ap_data.get( ), data_bytes );
+
+   hdr.end = end;
+   ++hdr.num_records;
+
+   store_index_entry* p_index = index( );
+   uint64_t mask = hdr.index_capacity - 1;
+
+   for( uint64_t i = ( ( uint64_t )context.id * 0x9e3779b97f4a7c15ULL ) >> 20; ; ++i )
+   {
+      store_index_entry& entry( p_index[ i & mask ] );
+
+      if( !entry.offset )
+      {
+         entry.id = context.id;
+         entry.offset = offset;
+         break;
+      }
+   }
+
+   commit( context );
+
+   attach( context, context.id );
+}
+
+bool at_image_store::attach( at_context& context, int64_t id, code_cache* p_cache )
+{
+   store_index_entry* p_entry = find( id );
+
+   if( !p_entry )
+      return false;
+
+   const store_header& hdr( header( ) );
+
+   // NOTE: The record is validated (in the same way as "load_image" validates an image) before the
+   // AT is changed to point into it.
+   if( p_entry->offset < records_start( ) || p_entry->offset > hdr.end
+    || hdr.end - p_entry->offset < sizeof( store_record ) )
+      return false;
+
+   const store_record& record( *( const store_record* )( p_base + p_entry->offset ) );
+
+   if( record.id != id || !record.code_pages || !record.data_pages
+    || !record.call_stack_pages || !record.user_stack_pages
+    || record.flags & ~( e_image_flag_stopped | e_image_flag_finished ) )
+      return false;
+
+   int32_t csize = record.code_pages * c_code_page_bytes;
+   int32_t dsize = record.data_pages * c_data_page_bytes;
+   int32_t cssize = record.call_stack_pages * c_call_stack_page_bytes;
+   int32_t ussize = record.user_stack_pages * c_user_stack_page_bytes;
+
+   if( hdr.end - p_entry->offset - sizeof( store_record ) < ( size_t )csize + dsize + cssize + ussize )
+      return false;
+
+   machine_state saved;
+
+   saved.pc = record.pc;
+   saved.cs = record.cs;
+   saved.us = record.us;
+   saved.pce = record.pce;
+   saved.pcs = record.pcs;
+
+   if( !is_valid_saved_state( saved, csize, cssize, ussize ) )
+      return false;
+
+   context.set_shared_code( 0 );
+
+   context.id = record.id;
+
+   context.code_pages = record.code_pages;
+   context.data_pages = record.data_pages;
+   context.call_stack_pages = record.call_stack_pages;
+   context.user_stack_pages = record.user_stack_pages;
+
+   int8_t* p_code = p_base + p_entry->offset + sizeof( store_record );
+
+   context.ap_code.reset( p_code, false );
+   context.ap_data.reset( p_code + context.csize( ), false );
+
+   context.allocate_dirty_pages( e_page_flag_all );
+
+   machine_state& state( context.state );
+
+   state.reset( );
+
+   state.stopped = ( record.flags & e_image_flag_stopped ) != 0;
+   state.finished = ( record.flags & e_image_flag_finished ) != 0;
+
+   state.pc = record.pc;
+   state.cs = record.cs;
+   state.us = record.us;
+   state.pce = record.pce;
+   state.pcs = record.pcs;
+   state.sleep_until = record.sleep_until;
+   state.steps = record.steps;
+
+   state.a1 = record.a1;
+   state.a2 = record.a2;
+   state.a3 = record.a3;
+   state.a4 = record.a4;
+
+   state.b1 = record.b1;
+   state.b2 = record.b2;
+   state.b3 = record.b3;
+   state.b4 = record.b4;
+
+   context.balance = record.balance;
+
+   if( p_cache )
+      p_cache->share( context );
+   else
+      decode_code( context.code, context.ap_code.get( ),
+       context.csize( ), context.dsize( ), context.cssize( ), context.ussize( ) );
+
+   return true;
+}
+
+void at_image_store::commit( const at_context& context )
+{
+   store_index_entry* p_entry = find( context.id );
+
+   if( !p_entry )
+      throw runtime_error( "AT not found in store" );
+
+   store_record& record( *( store_record* )( p_base + p_entry->offset ) );
+
+   const machine_state& state( context.state );
+
+   record.balance = context.balance;
+
+   record.flags = ( state.stopped ? e_image_flag_stopped : 0 ) | ( state.finished ? e_image_flag_finished : 0 );
+
+   record.pc = state.pc;
+   record.cs = state.cs;
+   record.us = state.us;
+   record.pce = state.pce;
+   record.pcs = state.pcs;
+   record.sleep_until = state.sleep_until;
+   record.steps = state.steps;
+
+   record.a1 = state.a1;
+   record.a2 = state.a2;
+   record.a3 = state.a3;
+   record.a4 = state.a4;
+
+   record.b1 = state.b1;
+   record.b2 = state.b2;
+   record.b3 = state.b3;
+   record.b4 = state.b4;
+
+   // NOTE: The data of an AT that isn't attached to its record is copied into it.
+   int8_t* p_data = p_base + p_entry->offset + sizeof( store_record ) + context.csize( );
+   size_t data_bytes = context.dsize( ) + context.cssize( ) + context.ussize( );
+
+   if( context.ap_data.get( ) != p_data )
+      memcpy( p_data, context.ap_data.get( ), data_bytes );
+
+   ++num_unsynced;
+
+   store_sync sync_type = p_sync_policy ? ( *p_sync_policy )( num_unsynced ) : e_store_sync_none;
+
+   if( sync_type == e_store_sync_record )
+      sync( p_entry->offset, sizeof( store_record ) + context.csize( ) + data_bytes, true );
+   else if( sync_type == e_store_sync_all )
+      flush( );
+}
+
+void at_image_store::flush( )
+{
+   if( p_base )
+      sync( 0, file_bytes, true );
+
+   num_unsynced = 0;
+}
+
+void at_image_store::sync( size_t offset, size_t bytes, bool wait )
+{
+   static size_t page_size = sysconf( _SC_PAGESIZE );
+
+   size_t start = offset / page_size * page_size;
+
+   msync( p_base + start, offset + bytes - start, wait ? MS_SYNC : MS_ASYNC );
+}
+#endif
+
+// NOTE: Runs an AT for a block (until it stops, finishes, fails, runs out of balance or has used up
+// "max_steps") charging its balance in the same way as the REPL's "run" does.
+int run_block( at_context& context, int32_t max_steps )
+{
+   int rc = 0;
+
+   machine_state& state( context.state );
+
+   state.stopped = false;
+
+   int32_t total = 0;
+
+   while( !state.finished && total < max_steps )
+   {
+      // NOTE: If the balance stops the AT (or limits the steps it can run) then it has been read.
+      if( context.balance <= max_steps - total )
+         context.balance_read = true;
+
+      if( context.balance <= 0 )
+         break;
+
+      int32_t steps = 0;
+
+      rc = run_decoded( context, get_max_steps( context, max_steps - total ), steps );
+
+      total += steps;
+
+      context.balance -= steps - 1;
+
+      if( context.balance == 0 )
+         break;
+
+      --context.balance;
+
+      if( rc < 0 || state.stopped || is_sleeping( context ) )
+         break;
+   }
+
+   return rc;
+}
+
+bool at_id_less( const at_context* p_lhs, const at_context* p_rhs )
+{
+   return p_lhs->id < p_rhs->id;
+}
+
+// NOTE: Returns the position of the AT with "id" in "ordered" (which is sorted by AT id) or npos.
+size_t find_at( const vector< at_context* >& ordered, int64_t id )
+{
+   size_t low = 0;
+   size_t high = ordered.size( );
+
+   while( low < high )
+   {
+      size_t mid = low + ( high - low ) / 2;
+
+      if( ordered[ mid ]->id < id )
+         low = mid + 1;
+      else
+         high = mid;
+   }
+
+   return ( low < ordered.size( ) && ordered[ low ]->id == id ) ? low : string::npos;
+}
+
+// NOTE: Copy-on-write storage for the data of an AT (which includes its stacks) that is split into
+// pages of "c_data_page_bytes". Copying is O(1) (as the page table is shared) with the page table
+// and then only those pages that are written to being copied when a shared copy is changed. This
+// allows AT states to be forked cheaply (for speculative execution or for keeping checkpoints) as
+// unchanged pages are shared between all of the copies.
+struct cow_data
+{
+   cow_data( )
+    :
+    p_table( 0 )
+   {
+   }
+
+   cow_data( const cow_data& src )
+    :
+    p_table( src.p_table )
+   {
+      if( p_table )
+         atomic_increment( &p_table->ref_count );
+   }
+
+   ~cow_data( )
+   {
+      release( p_table );
+   }
+
+   cow_data& operator =( const cow_data& src )
+   {
+      if( src.p_table )
+         atomic_increment( &src.p_table->ref_count );
+
+      release( p_table );
+      p_table = src.p_table;
+
+      return *this;
+   }
+
+   size_t size( ) const { return p_table ? p_table->size : 0; }
+
+   // NOTE: Changes the data to be the same as "p_data" copying only those pages that differ (and
+   // returns the number of pages that were copied).
+   size_t update( const int8_t* p_data, size_t size )
+   {
+      size_t num_pages = ( size + c_data_page_bytes - 1 ) / c_data_page_bytes;
+
+      if( !p_table || p_table->size != size )
+      {
+         release( p_table );
+
+         p_table = new table;
+         p_table->size = size;
+         p_table->pages.resize( num_pages );
+      }
+
+      size_t num_copied = 0;
+
+      for( size_t i = 0; i < num_pages; i++ )
+      {
+         size_t offset = i * c_data_page_bytes;
+         size_t bytes = min( size - offset, ( size_t )c_data_page_bytes );
+
+         const page* p_page = p_table->pages[ i ];
+
+         if( p_page && memcmp( p_page->bytes, p_data + offset, bytes ) == 0 )
+            continue;
+
+         memcpy( write_page( i )->bytes, p_data + offset, bytes );
+         ++num_copied;
+      }
+
+      return num_copied;
+   }
+
+   void copy_to( int8_t* p_data ) const
    {
-      int32_t addr;
-      rc = get_addr( p_code, csize, dsize, state, addr );
+      if( !p_table )
+         return;
 
-      if( rc == 0 || disassemble )
+      for( size_t i = 0; i < p_table->pages.size( ); i++ )
       {
-         rc = 1 + sizeof( int32_t );
+         size_t offset = i * c_data_page_bytes;
+         memcpy( p_data + offset, p_table->pages[ i ]->bytes, min( p_table->size - offset, ( size_t )c_data_page_bytes ) );
+      }
+   }
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-               cout << "CLR @" << hex << setw( 8 ) << setfill( '0' ) << addr << '\n';
-         }
-         else
-         {
-            state.pc += rc;
-            *( int64_t* )( p_data + ( addr * 8 ) ) = 0;
-         }
+   private:
+   struct page
+   {
+      page( )
+       :
+       ref_count( 1 )
+      {
+      }
+
+      int32_t volatile ref_count;
+
+      int8_t bytes[ c_data_page_bytes ];
+   };
+
+   struct table
+   {
+      table( )
+       :
+       ref_count( 1 ),
+       size( 0 )
+      {
+      }
+
+      ~table( )
+      {
+         for( size_t i = 0; i < pages.size( ); i++ )
+            release( pages[ i ] );
       }
+
+      int32_t volatile ref_count;
+
+      size_t size;
+      vector< page* > pages;
+   };
+
+   static void release( page* p_page )
+   {
+      if( p_page && atomic_decrement( &p_page->ref_count ) == 0 )
+         delete p_page;
    }
-   else if( op == e_op_code_INC_DAT || op == e_op_code_DEC_DAT || op == e_op_code_NOT_DAT )
+
+   static void release( table* p_table )
    {
-      int32_t addr;
-      rc = get_addr( p_code, csize, dsize, state, addr );
+      if( p_table && atomic_decrement( &p_table->ref_count ) == 0 )
+         delete p_table;
+   }
 
-      if( rc == 0 || disassemble )
+   // NOTE: Returns a page that is only used by this copy (first copying the page table and/or the
+   // page itself if they are shared).
+   page* write_page( size_t i )
+   {
+      if( p_table->ref_count > 1 )
       {
-         rc = 1 + sizeof( int32_t );
+         table* p_copy = new table;
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-            {
-               if( op == e_op_code_INC_DAT )
-                  cout << "INC @";
-               else if( op == e_op_code_DEC_DAT )
-                  cout << "DEC @";
-               else
-                  cout << "NOT @";
+         p_copy->size = p_table->size;
+         p_copy->pages = p_table->pages;
 
-               cout << hex << setw( 8 ) << setfill( '0' ) << addr << '\n';
-            }
-         }
-         else
+         for( size_t j = 0; j < p_copy->pages.size( ); j++ )
          {
-            state.pc += rc;
-
-            if( op == e_op_code_INC_DAT )
-               ++*( int64_t* )( p_data + ( addr * 8 ) );
-            else if( op == e_op_code_DEC_DAT )
-               --*( int64_t* )( p_data + ( addr * 8 ) );
-            else
-               *( int64_t* )( p_data + ( addr * 8 ) ) = ~*( int64_t* )( p_data + ( addr * 8 ) );
+            if( p_copy->pages[ j ] )
+               atomic_increment( &p_copy->pages[ j ]->ref_count );
          }
+
+         release( p_table );
+         p_table = p_copy;
+      }
+
+      page*& p_page( p_table->pages[ i ] );
+
+      if( !p_page )
+         p_page = new page;
+      else if( p_page->ref_count > 1 )
+      {
+         page* p_copy = new page;
+         memcpy( p_copy->bytes, p_page->bytes, c_data_page_bytes );
+
+         // NOTE: The other holder of the page could have released it after it was checked above.
+         release( p_page );
+         p_page = p_copy;
       }
+
+      return p_page;
    }
-   else if( op == e_op_code_ADD_DAT || op == e_op_code_SUB_DAT
-    || op == e_op_code_MUL_DAT || op == e_op_code_DIV_DAT )
+
+   table* p_table;
+};
+
+// NOTE: The state of an AT at the start of a block (so that it can be executed again). The code is
+// not included as it can't be changed by executing the AT. As the data is copy-on-write a snapshot
+// can be copied in order to fork the AT's state cheaply and when a snapshot is taken again (such as
+// for the next block) only the pages that have changed since it was last taken are copied.
+struct at_snapshot
+{
+   void take( const at_context& context )
    {
-      int32_t addr1, addr2;
-      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
+      state = context.state;
 
-      if( rc == 0 || disassemble )
+      balance = context.balance;
+
+      val = context.val;
+      val1 = context.val1;
+
+      first_call = context.first_call;
+
+      waiting_for_tx = context.waiting_for_tx;
+
+      func_data = context.func_data;
+
+      num_payments = context.payments.size( );
+
+      data.update( context.ap_data.get( ), context.dsize( ) + context.cssize( ) + context.ussize( ) );
+   }
+
+   void restore( at_context& context ) const
+   {
+      context.state = state;
+
+      context.balance = balance;
+
+      context.val = val;
+      context.val1 = val1;
+
+      context.first_call = first_call;
+
+      context.waiting_for_tx = waiting_for_tx;
+
+      context.func_data = func_data;
+
+      context.payments.resize( num_payments, at_payment( 0, 0, 0 ) );
+
+      data.copy_to( context.ap_data.get( ) );
+   }
+
+   machine_state state;
+
+   int64_t balance;
+
+   int64_t val;
+   int64_t val1;
+
+   bool first_call;
+
+   bool waiting_for_tx;
+
+   map< int32_t, function_data > func_data;
+
+   size_t num_payments;
+
+   cow_data data;
+};
+
+// NOTE: Executes a block by running each AT in AT id order with any payment made to an AT in
+// the block being added to its balance immediately after the paying AT has been run (so it is
+// seen by the ATs that are run after the paying AT but not by those that were run before it).
+void execute_sequential( vector< at_context* >& contexts, int32_t max_steps, vector< at_payment >& payments )
+{
+   vector< at_context* > ordered( contexts );
+   stable_sort( ordered.begin( ), ordered.end( ), at_id_less );
+
+   for( size_t i = 0; i < ordered.size( ); i++ )
+   {
+      at_context& context( *ordered[ i ] );
+
+      run_block( context, max_steps );
+
+      for( size_t j = 0; j < context.payments.size( ); j++ )
       {
-         rc = 1 + sizeof( int32_t ) + sizeof( int32_t );
+         const at_payment& payment( context.payments[ j ] );
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-            {
-               if( op == e_op_code_ADD_DAT )
-                  cout << "ADD @";
-               else if( op == e_op_code_SUB_DAT )
-                  cout << "SUB @";
-               else if( op == e_op_code_MUL_DAT )
-                  cout << "MUL @";
-               else
-                  cout << "DIV @";
+         payments.push_back( payment );
+
+         size_t pos = find_at( ordered, payment.account );
+
+         if( pos != string::npos )
+            ordered[ pos ]->balance += payment.amount;
+      }
+
+      context.payments.clear( );
+   }
+}
+
+// NOTE: The block executor runs a set of ATs for a block across a number of threads. Each thread
+// starts with an equal share of the ATs (as a range) which it works through from the front with an
+// idle thread stealing the back half of the range from another thread.
+//
+// As ATs can pay each other the ATs are run optimistically (each against its balance at the start
+// of the block) and then committed in AT id order. An AT that was paid by an AT before it (in AT id
+// order) is executed again (from its snapshot and with the payments added to its balance) if its
+// balance was read, otherwise the payments are just added to its balance. The results (the final
+// states and the merged payments) are identical to "execute_sequential" no matter how many threads
+// are used or how the ATs were shared out.
+struct block_executor
+{
+   block_executor( size_t num_threads = 0 )
+    :
+    num_threads( num_threads ),
+    num_executed_again( 0 )
+   {
+#ifdef AT_THREADS
+      if( !num_threads )
+      {
+         long num_cpus = sysconf( _SC_NPROCESSORS_ONLN );
+         this->num_threads = num_cpus > 0 ? ( size_t )num_cpus : 1;
+      }
+#else
+      this->num_threads = 1;
+#endif
+   }
+
+   void execute( vector< at_context* >& contexts, int32_t max_steps, vector< at_payment >& payments );
+
+   size_t num_threads;
+   size_t num_executed_again; // the number of ATs executed again by the last "execute"
+
+   private:
+#ifdef AT_THREADS
+   struct worker
+   {
+      pthread_t thread;
+      pthread_mutex_t mutex;
+
+      size_t begin; // the next AT to run
+      size_t end; // one past the last AT to run
+
+      size_t index;
+
+      block_executor* p_executor;
+   };
+
+   static void* run_worker( void* p_arg );
+
+   bool claim( worker& w, size_t& begin, size_t& end );
+   bool steal( worker& w );
+
+   vector< worker > workers;
+#endif
+
+   void run( size_t i );
+
+   vector< at_context* >* p_contexts;
+   vector< at_snapshot > snapshots;
+
+   int32_t max_steps;
+};
+
+void block_executor::run( size_t i )
+{
+   at_context& context( *( *p_contexts )[ i ] );
+
+   snapshots[ i ].take( context );
+   context.balance_read = false;
+
+   run_block( context, max_steps );
+}
+
+#ifdef AT_THREADS
+const size_t c_block_executor_grain = 16;
+
+bool block_executor::claim( worker& w, size_t& begin, size_t& end )
+{
+   pthread_mutex_lock( &w.mutex );
+
+   begin = w.begin;
+   end = min( w.end, w.begin + c_block_executor_grain );
+
+   w.begin = end;
+
+   pthread_mutex_unlock( &w.mutex );
+
+   return begin < end;
+}
 
-               cout << hex << setw( 8 ) << setfill( '0' )
-                << addr1 << " $" << setw( 8 ) << setfill( '0' ) << addr2 << '\n';
-            }
-         }
-         else
-         {
-            int64_t val = *( int64_t* )( p_data + ( addr2 * 8 ) );
+bool block_executor::steal( worker& w )
+{
+   for( size_t i = 1; i < workers.size( ); i++ )
+   {
+      worker& victim( workers[ ( w.index + i ) % workers.size( ) ] );
 
-            if( op == e_op_code_DIV_DAT && val == 0 )
-               rc = -2;
-            else
-            {
-               state.pc += rc;
+      pthread_mutex_lock( &victim.mutex );
 
-               if( op == e_op_code_ADD_DAT )
-                  *( int64_t* )( p_data + ( addr1 * 8 ) ) += *( int64_t* )( p_data + ( addr2 * 8 ) );
-               else if( op == e_op_code_SUB_DAT )
-                  *( int64_t* )( p_data + ( addr1 * 8 ) ) -= *( int64_t* )( p_data + ( addr2 * 8 ) );
-               else if( op == e_op_code_MUL_DAT )
-                  *( int64_t* )( p_data + ( addr1 * 8 ) ) *= *( int64_t* )( p_data + ( addr2 * 8 ) );
-               else
-                  *( int64_t* )( p_data + ( addr1 * 8 ) ) /= *( int64_t* )( p_data + ( addr2 * 8 ) );
-            }
-         }
+      size_t begin = victim.begin;
+      size_t end = victim.end;
+
+      if( begin < end )
+      {
+         begin += ( end - begin ) / 2;
+         victim.end = begin;
       }
-   }
-   else if( op == e_op_code_BOR_DAT
-    || op == e_op_code_AND_DAT || op == e_op_code_XOR_DAT )
-   {
-      int32_t addr1, addr2;
-      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
 
-      if( rc == 0 || disassemble )
+      pthread_mutex_unlock( &victim.mutex );
+
+      if( begin < end )
       {
-         rc = 1 + sizeof( int32_t ) + sizeof( int32_t );
+         pthread_mutex_lock( &w.mutex );
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-            {
-               if( op == e_op_code_BOR_DAT )
-                  cout << "BOR @";
-               else if( op == e_op_code_AND_DAT )
-                  cout << "AND @";
-               else
-                  cout << "XOR @";
+         w.begin = begin;
+         w.end = end;
 
-               cout << hex << setw( 8 ) << setfill( '0' )
-                << addr1 << " $" << setw( 8 ) << setfill( '0' ) << addr2 << '\n';
-            }
-         }
-         else
-         {
-            state.pc += rc;
-            int64_t val = *( int64_t* )( p_data + ( addr2 * 8 ) );
+         pthread_mutex_unlock( &w.mutex );
 
-            if( op == e_op_code_BOR_DAT )
-               *( int64_t* )( p_data + ( addr1 * 8 ) ) |= val;
-            else if( op == e_op_code_AND_DAT )
-               *( int64_t* )( p_data + ( addr1 * 8 ) ) &= val;
-            else
-               *( int64_t* )( p_data + ( addr1 * 8 ) ) ^= val;
-         }
+         return true;
       }
    }
-   else if( op == e_op_code_SET_IND )
+
+   return false;
+}
+
+void* block_executor::run_worker( void* p_arg )
+{
+   worker& w( *( worker* )p_arg );
+   block_executor& executor( *w.p_executor );
+
+   while( true )
    {
-      int32_t addr1, addr2;
-      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
+      size_t begin, end;
 
-      if( rc == 0 || disassemble )
+      if( !executor.claim( w, begin, end ) )
       {
-         rc = 1 + sizeof( int32_t ) + sizeof( int32_t );
-
-         if( disassemble )
-         {
-            if( !determine_jumps )
-               cout << "SET @" << hex << setw( 8 ) << setfill( '0' )
-                << addr1 << " $($" << setw( 8 ) << setfill( '0' ) << addr2 << ")\n";
-         }
-         else
-         {
-            int64_t addr = *( int64_t* )( p_data + ( addr2 * 8 ) );
+         if( !executor.steal( w ) )
+            break;
 
-            if( addr < 0 || addr > c_max_to_multiply
-             || ( addr * 8 ) < 0 || ( addr * 8 ) + ( int32_t )sizeof( int64_t ) > dsize )
-               rc = -1;
-            else
-            {
-               state.pc += rc;
-              *( int64_t* )( p_data + ( addr1 * 8 ) ) = *( int64_t* )( p_data + ( addr * 8 ) );
-            }
-         }
+         continue;
       }
+
+      for( size_t i = begin; i < end; i++ )
+         executor.run( i );
    }
-   else if( op == e_op_code_SET_IDX )
-   {
-      int32_t addr1, addr2;
-      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
 
-      int32_t size = sizeof( int32_t ) + sizeof( int32_t );
+   // NOTE: As the worker threads only exist for the one block their trace records are discarded.
+   release_trace_buffer( );
 
-      if( rc == 0 || disassemble )
-      {
-         int32_t addr3;
-         rc = get_addr( p_code + size, csize, dsize, state, addr3 );
+   return 0;
+}
+#endif
 
-         if( rc == 0 || disassemble )
-         {
-            rc = 1 + size + sizeof( int32_t );
+void block_executor::execute( vector< at_context* >& contexts, int32_t max_steps, vector< at_payment >& payments )
+{
+   p_contexts = &contexts;
+   this->max_steps = max_steps;
 
-            if( disassemble )
-            {
-               if( !determine_jumps )
-                  cout << "SET @" << hex << setw( 8 ) << setfill( '0' )
-                   << addr1 << " $($" << setw( 8 ) << setfill( '0' ) << addr2
-                   << "+$" << setw( 8 ) << setfill( '0' ) << addr3 << ")\n";
-            }
-            else
-            {
-               int64_t base = *( int64_t* )( p_data + ( addr2 * 8 ) );
-               int64_t offs = *( int64_t* )( p_data + ( addr3 * 8 ) );
+   snapshots.resize( contexts.size( ) );
 
-               int64_t addr = base + offs;
+#ifdef AT_THREADS
+   size_t num_workers = min( num_threads, contexts.size( ) );
 
-               if( addr < 0 || addr > c_max_to_multiply
-                || ( addr * 8 ) < 0 || ( addr * 8 ) + ( int32_t )sizeof( int64_t ) > dsize )
-                  rc = -1;
-               else
-               {
-                  state.pc += rc;
-                 *( int64_t* )( p_data + ( addr1 * 8 ) ) = *( int64_t* )( p_data + ( addr * 8 ) );
-               }
-            }
-         }
-      }
-   }
-   else if( op == e_op_code_PSH_DAT || op == e_op_code_POP_DAT )
+   if( num_workers > 1 )
    {
-      int32_t addr;
-      rc = get_addr( p_code, csize, dsize, state, addr );
+      workers.resize( num_workers );
 
-      if( rc == 0 || disassemble )
+      for( size_t i = 0; i < num_workers; i++ )
       {
-         rc = 1 + sizeof( int32_t );
+         worker& w( workers[ i ] );
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-            {
-               if( op == e_op_code_PSH_DAT )
-                  cout << "PSH $";
-               else
-                  cout << "POP @";
+         pthread_mutex_init( &w.mutex, 0 );
 
-               cout << hex << setw( 8 ) << setfill( '0' ) << addr << '\n';
-            }
-         }
-         else if( ( op == e_op_code_PSH_DAT && state.us == ( ussize / 8 ) )
-          || ( op == e_op_code_POP_DAT && state.us == 0 ) )
-            rc = -1;
-         else
-         {
-            state.pc += rc;
-            if( op == e_op_code_PSH_DAT )
-               *( int64_t* )( p_data + dsize + cssize + ussize
-                - ( ++state.us * 8 ) ) = *( int64_t* )( p_data + ( addr * 8 ) );
-            else
-               *( int64_t* )( p_data + ( addr * 8 ) )
-                = *( int64_t* )( p_data + dsize + cssize + ussize - ( state.us-- * 8 ) );
-         }
+         w.begin = contexts.size( ) * i / num_workers;
+         w.end = contexts.size( ) * ( i + 1 ) / num_workers;
+
+         w.index = i;
+         w.p_executor = this;
       }
-   }
-   else if( op == e_op_code_JMP_SUB )
-   {
-      int32_t addr;
-      rc = get_addr( p_code, csize, dsize, state, addr, true );
 
-      if( rc == 0 || disassemble )
-      {
-         rc = 1 + sizeof( int32_t );
+      // NOTE: If a thread cannot be created then its ATs will be stolen by the other workers.
+      vector< bool > started( num_workers );
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-               cout << "JSR :" << hex << setw( 8 ) << setfill( '0' ) << addr << '\n';
-         }
-         else
+      for( size_t i = 0; i < num_workers; i++ )
+         started[ i ] = pthread_create( &workers[ i ].thread, 0, run_worker, &workers[ i ] ) == 0;
+
+      bool any_started = false;
+
+      for( size_t i = 0; i < num_workers; i++ )
+      {
+         if( started[ i ] )
          {
-            if( state.cs == ( cssize / 8 ) )
-               rc = -1;
-            else if( state.jumps.count( addr ) )
-            {
-               *( int64_t* )( p_data + dsize + cssize - ( ++state.cs * 8 ) ) = state.pc + rc;
-               state.pc = addr;
-            }
-            else
-               rc = -2;
+            any_started = true;
+            pthread_join( workers[ i ].thread, 0 );
          }
       }
-   }
-   else if( op == e_op_code_RET_SUB )
-   {
-      rc = 1;
 
-      if( disassemble )
-      {
-         if( !determine_jumps )
-            cout << "RET\n";
-      }
-      else
+      if( !any_started )
       {
-         if( state.cs == 0 )
-            rc = -1;
-         else
+         for( size_t i = 0; i < num_workers; i++ )
          {
-            int64_t val = *( int64_t* )( p_data + dsize + cssize - ( state.cs-- * 8 ) );
-            int32_t addr = ( int32_t )val;
-            if( state.jumps.count( addr ) )
-               state.pc = addr;
-            else
-               rc = -2;
+            for( size_t j = workers[ i ].begin; j < workers[ i ].end; j++ )
+               run( j );
          }
       }
+
+      for( size_t i = 0; i < num_workers; i++ )
+         pthread_mutex_destroy( &workers[ i ].mutex );
+
+      workers.clear( );
    }
-   else if( op == e_op_code_IND_DAT )
+   else
+#endif
    {
-      int32_t addr1, addr2;
-      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
+      for( size_t i = 0; i < contexts.size( ); i++ )
+         run( i );
+   }
 
-      if( rc == 0 || disassemble )
-      {
-         rc = 1 + sizeof( int32_t ) + sizeof( int32_t );
+   vector< size_t > order( contexts.size( ) );
+   vector< at_context* > ordered( contexts );
 
-         if( disassemble )
+   stable_sort( ordered.begin( ), ordered.end( ), at_id_less );
+
+   for( size_t i = 0; i < contexts.size( ); i++ )
+      order[ find_at( ordered, contexts[ i ]->id ) ] = i;
+
+   vector< int64_t > credits( ordered.size( ) );
+
+   num_executed_again = 0;
+
+   for( size_t i = 0; i < ordered.size( ); i++ )
+   {
+      at_context& context( *ordered[ i ] );
+
+      if( credits[ i ] )
+      {
+         if( context.balance_read )
          {
-            if( !determine_jumps )
-               cout << "SET @($" << hex << setw( 8 ) << setfill( '0' )
-                << addr1 << ") $" << setw( 8 ) << setfill( '0' ) << addr2 << "\n";
+            snapshots[ order[ i ] ].restore( context );
+            context.balance += credits[ i ];
+
+            run_block( context, max_steps );
+
+            ++num_executed_again;
          }
          else
-         {
-            int64_t addr = *( int64_t* )( p_data + ( addr1 * 8 ) );
+            context.balance += credits[ i ];
+      }
 
-            if( addr < 0 || addr > c_max_to_multiply
-             || ( addr * 8 ) < 0 || ( addr * 8 ) + ( int32_t )sizeof( int64_t ) > dsize )
-               rc = -1;
+      for( size_t j = 0; j < context.payments.size( ); j++ )
+      {
+         const at_payment& payment( context.payments[ j ] );
+
+         payments.push_back( payment );
+
+         size_t pos = find_at( ordered, payment.account );
+
+         if( pos != string::npos )
+         {
+            if( pos > i )
+               credits[ pos ] += payment.amount;
             else
-            {
-               state.pc += rc;
-              *( int64_t* )( p_data + ( addr * 8 ) ) = *( int64_t* )( p_data + ( addr2 * 8 ) );
-            }
+               ordered[ pos ]->balance += payment.amount;
          }
       }
+
+      context.payments.clear( );
    }
-   else if( op == e_op_code_IDX_DAT )
+}
+
+// NOTE: A hierarchical timer wheel (four levels of 256 slots) holding the ids of sleeping ATs keyed
+// by the block height at which each is to be woken. An entry is placed at the level of the highest
+// byte in which its height differs from the current height (in the slot for its height's byte at
+// that level) and entries are moved down a level whenever the current height reaches their slot so
+// advancing by a block only ever touches the entries that are due (or are being moved down).
+struct timer_wheel
+{
+   timer_wheel( )
    {
-      int32_t addr1, addr2;
-      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
+      height = 0;
+      num_entries = 0;
 
-      int32_t size = sizeof( int32_t ) + sizeof( int32_t );
+      slots.resize( c_levels * c_slots );
+   }
 
-      if( rc == 0 || disassemble )
+   struct entry
+   {
+      entry( int64_t at_id = 0, int32_t wake_height = 0 )
+       :
+       at_id( at_id ),
+       wake_height( wake_height )
       {
-         int32_t addr3;
-         rc = get_addr( p_code + size, csize, dsize, state, addr3 );
-
-         if( rc == 0 || disassemble )
-         {
-            rc = 1 + size + sizeof( int32_t );
-
-            if( disassemble )
-            {
-               if( !determine_jumps )
-                  cout << "SET @($" << hex << setw( 8 ) << setfill( '0' )
-                   << addr1 << "+$" << setw( 8 ) << setfill( '0' ) << addr2
-                   << ") $" << setw( 8 ) << setfill( '0' ) << addr3 << "\n";
-            }
-            else
-            {
-               int64_t base = *( int64_t* )( p_data + ( addr1 * 8 ) );
-               int64_t offs = *( int64_t* )( p_data + ( addr2 * 8 ) );
-
-               int64_t addr = base + offs;
-
-               if( addr < 0 || addr > c_max_to_multiply
-                || ( addr * 8 ) < 0 || ( addr * 8 ) + ( int32_t )sizeof( int64_t ) > dsize )
-                  rc = -1;
-               else
-               {
-                  state.pc += rc;
-                 *( int64_t* )( p_data + ( addr * 8 ) ) = *( int64_t* )( p_data + ( addr3 * 8 ) );
-               }
-            }
-         }
+      }
+
+      int64_t at_id;
+      int32_t wake_height;
+   };
+
+   static const int c_levels = 4;
+   static const int c_slots = 256;
+
+   size_t size( ) const { return num_entries; }
+
+   // NOTE: Appends the ids of all the ATs in the wheel to "ids" (in no particular order).
+   void get_ids( vector< int64_t >& ids ) const
+   {
+      for( size_t i = 0; i < slots.size( ); i++ )
+      {
+         for( size_t j = 0; j < slots[ i ].size( ); j++ )
+            ids.push_back( slots[ i ][ j ].at_id );
       }
    }
-   else if( op == e_op_code_MOD_DAT )
+
+   void clear( int32_t new_height = 0 )
    {
-      int32_t addr1, addr2;
-      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
+      height = new_height;
+      num_entries = 0;
 
-      if( rc == 0 || disassemble )
-      {
-         rc = 1 + sizeof( int32_t ) + sizeof( int32_t );
+      for( size_t i = 0; i < slots.size( ); i++ )
+         slots[ i ].clear( );
+   }
 
-         if( disassemble )
+   // NOTE: If the wake height is not after the current height then it will be woken at the next one.
+   void add( int64_t at_id, int32_t wake_height )
+   {
+      if( wake_height <= height )
+         wake_height = height + 1;
+
+      insert( entry( at_id, wake_height ) );
+      ++num_entries;
+   }
+
+   // NOTE: Moves the current height forward to "new_height" appending the ids of the ATs that are
+   // woken (for each height in turn) to "woken".
+   void advance( int32_t new_height, vector< int64_t >& woken )
+   {
+      while( height < new_height )
+      {
+         if( !num_entries )
          {
-            if( !determine_jumps )
-            {
-               cout << "MOD @" << hex << setw( 8 ) << setfill( '0' )
-                << addr1 << " $" << setw( 16 ) << setfill( '0' ) << addr2 << '\n';
-            }
+            height = new_height;
+            break;
          }
-         else
+
+         ++height;
+
+         for( int level = c_levels - 1; level > 0; level-- )
          {
-            state.pc += rc;
-            int64_t val = *( int64_t* )( p_data + ( addr2 * 8 ) );
+            if( height & ( ( 1 << ( level * 8 ) ) - 1 ) )
+               continue;
 
-            *( int64_t* )( p_data + ( addr1 * 8 ) ) %= val;
+            vector< entry > entries;
+            entries.swap( slots[ level * c_slots + ( ( height >> ( level * 8 ) ) & 0xff ) ] );
+
+            for( size_t i = 0; i < entries.size( ); i++ )
+               insert( entries[ i ] );
          }
+
+         vector< entry >& due( slots[ height & 0xff ] );
+
+         for( size_t i = 0; i < due.size( ); i++ )
+            woken.push_back( due[ i ].at_id );
+
+         num_entries -= due.size( );
+         due.clear( );
       }
    }
-   else if( op == e_op_code_SHL_DAT )
+
+   void save( ostream& os ) const
    {
-      int32_t addr1, addr2;
-      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
+      os.write( ( const char* )&height, sizeof( height ) );
+      os.write( ( const char* )&num_entries, sizeof( num_entries ) );
 
-      if( rc == 0 || disassemble )
+      for( size_t i = 0; i < slots.size( ); i++ )
       {
-         rc = 1 + sizeof( int32_t ) + sizeof( int32_t );
-
-         if( disassemble )
-         {
-            if( !determine_jumps )
-            {
-               cout << "SHL @" << hex << setw( 8 ) << setfill( '0' )
-                << addr1 << " $" << setw( 16 ) << setfill( '0' ) << addr2 << '\n';
-            }
-         }
-         else
+         for( size_t j = 0; j < slots[ i ].size( ); j++ )
          {
-            state.pc += rc;
-            int64_t val = *( int64_t* )( p_data + ( addr2 * 8 ) );
-
-            *( int64_t* )( p_data + ( addr1 * 8 ) ) <<= val;
+            os.write( ( const char* )&slots[ i ][ j ].at_id, sizeof( int64_t ) );
+            os.write( ( const char* )&slots[ i ][ j ].wake_height, sizeof( int32_t ) );
          }
       }
    }
-   else if( op == e_op_code_SHR_DAT )
+
+   void load( istream& is )
    {
-      int32_t addr1, addr2;
-      rc = get_addrs( p_code, csize, dsize, state, addr1, addr2 );
+      int32_t new_height = 0;
+      is.read( ( char* )&new_height, sizeof( new_height ) );
 
-      if( rc == 0 || disassemble )
+      clear( new_height );
+
+      size_t size = 0;
+      is.read( ( char* )&size, sizeof( size ) );
+
+      for( size_t i = 0; i < size && is; i++ )
       {
-         rc = 1 + sizeof( int32_t ) + sizeof( int32_t );
+         entry e;
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-            {
-               cout << "SHR @" << hex << setw( 8 ) << setfill( '0' )
-                << addr1 << " $" << setw( 16 ) << setfill( '0' ) << addr2 << '\n';
-            }
-         }
-         else
-         {
-            state.pc += rc;
-            int64_t val = *( int64_t* )( p_data + ( addr2 * 8 ) );
+         is.read( ( char* )&e.at_id, sizeof( int64_t ) );
+         is.read( ( char* )&e.wake_height, sizeof( int32_t ) );
 
-            *( int64_t* )( p_data + ( addr1 * 8 ) ) >>= val;
-         }
+         add( e.at_id, e.wake_height );
       }
    }
-   else if( op == e_op_code_JMP_ADR )
+
+   private:
+   void insert( const entry& e )
    {
-      int32_t addr;
-      rc = get_addr( p_code, csize, dsize, state, addr, true );
+      uint32_t diff = ( uint32_t )e.wake_height ^ ( uint32_t )height;
 
-      if( rc == 0 || disassemble )
-      {
-         rc = 1 + sizeof( int32_t );
+      int level = 0;
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-               cout << "JMP :" << hex << setw( 8 ) << setfill( '0' ) << addr << '\n';
-         }
-         else if( state.jumps.count( addr ) )
-            state.pc = addr;
-         else
-            rc = -2;
-      }
+      if( diff >> 24 )
+         level = 3;
+      else if( diff >> 16 )
+         level = 2;
+      else if( diff >> 8 )
+         level = 1;
+
+      slots[ level * c_slots + ( ( e.wake_height >> ( level * 8 ) ) & 0xff ) ].push_back( e );
    }
-   else if( op == e_op_code_BZR_DAT || op == e_op_code_BNZ_DAT )
+
+   int32_t height;
+   size_t num_entries;
+
+   vector< vector< entry > > slots;
+};
+
+// NOTE: The tx functions that are provided by the AT runtime (with a tx's id being used as its hash).
+// An AT is only marked as waiting for a tx if no tx was found and the op that it will execute next
+// is SLP_IMD (as the pc has already been moved past the calling op). Such an AT is provably just
+// polling for a tx (as it will sleep without doing anything else) so it can be left waiting until
+// one arrives whereas an AT that sleeps until a specific height must always be woken at it.
+int64_t a_to_tx_after_timestamp( at_context& context, int32_t, int64_t value, int64_t )
+{
+   machine_state& state( context.state );
+
+   state.a1 = state.a2 = state.a3 = state.a4 = 0;
+
+   size_t lo = 0, hi = context.txs.size( );
+
+   while( lo < hi )
    {
-      int8_t off;
-      int32_t addr;
-      rc = get_addr_off( p_code, csize, dsize, state, addr, off );
+      size_t mid = lo + ( hi - lo ) / 2;
 
-      if( rc == 0 || disassemble )
-      {
-         rc = 1 + sizeof( int32_t ) + sizeof( int8_t );
+      if( context.txs[ mid ].timestamp <= value )
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-            {
-               if( op == e_op_code_BZR_DAT )
-                  cout << "BZR $";
-               else
-                  cout << "BNZ $";
+   context.waiting_for_tx = false;
 
-               cout << hex << setw( 8 ) << setfill( '0' )
-                << addr << " :" << setw( 8 ) << setfill( '0' ) << ( state.pc + off ) << '\n';
-            }
-         }
-         else
-         {
-            int64_t val = *( int64_t* )( p_data + ( addr * 8 ) );
+   if( lo < context.txs.size( ) )
+      state.a1 = context.txs[ lo ].id;
+   else if( state.pc >= 0 && state.pc < context.csize( )
+    && context.ap_code.get( )[ state.pc ] == e_op_code_SLP_IMD )
+      context.waiting_for_tx = true;
 
-            if( ( op == e_op_code_BZR_DAT && val == 0 )
-             || ( op == e_op_code_BNZ_DAT && val != 0 ) )
-            {
-               if( state.jumps.count( state.pc + off ) )
-                  state.pc += off;
-               else
-                  rc = -2;
-            }
-            else
-               state.pc += rc;
-         }
+   return 0;
+}
+
+const at_tx* get_tx_in_a( const at_context& context )
+{
+   const machine_state& state( context.state );
+
+   if( state.a2 || state.a3 || state.a4 )
+      return 0;
+
+   for( size_t i = context.txs.size( ); i > 0; i-- )
+   {
+      if( context.txs[ i - 1 ].id == state.a1 )
+         return &context.txs[ i - 1 ];
+   }
+
+   return 0;
+}
+
+int64_t get_amount_for_tx_in_a( at_context& context, int32_t, int64_t, int64_t )
+{
+   const at_tx* p_tx = get_tx_in_a( context );
+
+   return p_tx ? p_tx->amount : -1;
+}
+
+int64_t get_timestamp_for_tx_in_a( at_context& context, int32_t, int64_t, int64_t )
+{
+   const at_tx* p_tx = get_tx_in_a( context );
+
+   return p_tx ? p_tx->timestamp : -1;
+}
+
+// NOTE: A lock-free queue for the txs sent to ATs. Any number of threads (such as those handling
+// incoming blocks and txs) can push txs whilst the AT runtime (as the only consumer) takes all of
+// the queued txs at once. As the consumer never removes a single node there is no ABA problem and
+// a push never has to wait for the consumer (or for ATs to be executed).
+struct tx_queue
+{
+   struct node
+   {
+      node( int64_t at_id, int64_t tx_id, int64_t amount )
+       :
+       at_id( at_id ),
+       tx_id( tx_id ),
+       amount( amount ),
+       p_next( 0 )
+      {
       }
+
+      int64_t at_id;
+      int64_t tx_id;
+      int64_t amount;
+
+      node* p_next;
+   };
+
+   tx_queue( )
+    :
+    p_head( 0 )
+   {
    }
-   else if( op == e_op_code_BGT_DAT || op == e_op_code_BLT_DAT
-    || op == e_op_code_BGE_DAT || op == e_op_code_BLE_DAT
-    || op == e_op_code_BEQ_DAT || op == e_op_code_BNE_DAT )
+
+   ~tx_queue( )
    {
-      int8_t off;
-      int32_t addr1, addr2;
-      rc = get_addrs_off( p_code, csize, dsize, state, addr1, addr2, off );
+      release( pop_all( ) );
+   }
 
-      if( rc == 0 || disassemble )
+   void push( int64_t at_id, int64_t tx_id, int64_t amount )
+   {
+      node* p_node = new node( at_id, tx_id, amount );
+
+      do
+         p_node->p_next = p_head;
+      while( !atomic_compare_and_swap( &p_head, p_node->p_next, p_node ) );
+   }
+
+   // NOTE: Returns the queued txs in the order that they were pushed (which are to be released by
+   // the caller).
+   node* pop_all( )
+   {
+      node* p_node = atomic_exchange( &p_head, ( node* )0 );
+      node* p_list = 0;
+
+      while( p_node )
       {
-         rc = 1 + sizeof( int32_t ) + sizeof( int32_t ) + sizeof( int8_t );
+         node* p_next = p_node->p_next;
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-            {
-               if( op == e_op_code_BGT_DAT )
-                  cout << "BGT $";
-               else if( op == e_op_code_BLT_DAT )
-                  cout << "BLT $";
-               else if( op == e_op_code_BGE_DAT )
-                  cout << "BGE $";
-               else if( op == e_op_code_BLE_DAT )
-                  cout << "BLE $";
-               else if( op == e_op_code_BEQ_DAT )
-                  cout << "BEQ $";
-               else
-                  cout << "BNE $";
+         p_node->p_next = p_list;
+         p_list = p_node;
 
-               cout << hex << setw( 8 ) << setfill( '0' )
-                << addr1 << " $" << setw( 8 ) << setfill( '0' )
-                << addr2 << " :" << setw( 8 ) << setfill( '0' ) << ( state.pc + off ) << '\n';
-            }
-         }
-         else
-         {
-            int64_t val1 = *( int64_t* )( p_data + ( addr1 * 8 ) );
-            int64_t val2 = *( int64_t* )( p_data + ( addr2 * 8 ) );
+         p_node = p_next;
+      }
 
-            if( ( op == e_op_code_BGT_DAT && val1 > val2 )
-             || ( op == e_op_code_BLT_DAT && val1 < val2 )
-             || ( op == e_op_code_BGE_DAT && val1 >= val2 )
-             || ( op == e_op_code_BLE_DAT && val1 <= val2 )
-             || ( op == e_op_code_BEQ_DAT && val1 == val2 )
-             || ( op == e_op_code_BNE_DAT && val1 != val2 ) )
-            {
-               if( state.jumps.count( state.pc + off ) )
-                  state.pc += off;
-               else
-                  rc = -2;
-            }
-            else
-               state.pc += rc;
-         }
+      return p_list;
+   }
+
+   static void release( node* p_node )
+   {
+      while( p_node )
+      {
+         node* p_next = p_node->p_next;
+         delete p_node;
+         p_node = p_next;
       }
    }
-   else if( op == e_op_code_SLP_DAT )
+
+   private:
+   tx_queue( const tx_queue& );
+   tx_queue& operator =( const tx_queue& );
+
+   node* volatile p_head;
+};
+
+// NOTE: The AT runtime holds all of the ATs and processes them a block at a time. ATs that go to
+// sleep are moved out of the set of runnable ATs and into a timer wheel (and are not touched again
+// other than for being paid until they are woken). ATs that stop, finish or run out of balance are
+// instead put into a wake index keyed by their account (which is their id) along with the balance
+// that they stopped at so that only an AT being paid (or otherwise having its balance changed) is
+// ever checked. As per the AT spec a stopped AT will only be woken once its balance is greater than
+// the balance it stopped at (and it will then run from the next block).
+//
+// Txs sent to ATs are pushed into a lock-free queue (from any thread) and delivered at the start of
+// each block. An AT that went to sleep with SLP_IMD straight after an A_To_Tx_After_Timestamp call
+// that found no tx is not woken from its sleep (as it would only poll again and go back to sleep)
+// but is instead left waiting until a tx for it has been delivered. ATs that sleep in any other way
+// (such as until a deadline with SLP_DAT) are always woken at the height that they slept until.
+struct at_runtime
+{
+   at_runtime( size_t num_threads = 0 )
+    :
+    height( 0 ),
+    executor( num_threads ),
+    functions( g_functions, g_functions + e_function_range_end )
    {
-      int32_t addr;
-      rc = get_addr( p_code, csize, dsize, state, addr, true );
+      functions[ 0x0304 ].p_handlers[ 1 ] = a_to_tx_after_timestamp;
+      functions[ 0x0306 ].p_handlers[ 0 ] = get_amount_for_tx_in_a;
+      functions[ 0x0307 ].p_handlers[ 0 ] = get_timestamp_for_tx_in_a;
+   }
 
-      if( rc == 0 || disassemble )
-      {
-         rc = 1 + sizeof( int32_t );
+   void add( at_context* p_context )
+   {
+      ats[ p_context->id ] = p_context;
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-               cout << "SLP @" << hex << setw( 8 ) << setfill( '0' ) << addr << '\n';
-         }
-         else
-         {
-            // NOTE: The "sleep_until" state value would be set to the current block + $addr.
+      p_context->height = height;
+      p_context->p_functions = &functions[ 0 ];
 
-            state.pc += rc;
-         }
+      if( is_sleeping( *p_context ) )
+      {
+         sleeping.insert( p_context->id );
+         sleepers.add( p_context->id, p_context->state.sleep_until );
       }
+      else if( is_stopped( *p_context ) )
+         stop( *p_context );
+      else
+         runnable.push_back( p_context );
    }
-   else if( op == e_op_code_FIZ_DAT || op == e_op_code_STZ_DAT )
+
+   void process_block( int32_t max_steps, vector< at_payment >& payments );
+
+   // NOTE: Funds transferred to an AT from outside of the runtime (negative amounts can be used to
+   // reverse earlier transfers) with "set_balance" being used for any other balance change.
+   void credit( int64_t account, int64_t amount )
    {
-      int32_t addr;
-      rc = get_addr( p_code, csize, dsize, state, addr );
+      map< int64_t, at_context* >::iterator i = ats.find( account );
 
-      if( rc == 0 || disassemble )
-      {
-         if( disassemble )
-         {
-            rc = 1 + sizeof( int32_t );
+      if( i != ats.end( ) )
+         set_balance( account, i->second->balance + amount );
+   }
 
-            if( !determine_jumps )
-            {
-               if( op == e_op_code_FIZ_DAT )
-                  cout << "FIZ $";
-               else
-                  cout << "STZ $";
+   void set_balance( int64_t account, int64_t balance );
 
-               cout << hex << setw( 8 ) << setfill( '0' ) << addr << '\n';
-            }
-         }
-         else
-         {
-            if( *( int64_t* )( p_data + ( addr * 8 ) ) == 0 )
-            {
-               if( op == e_op_code_STZ_DAT )
-               {
-                  state.pc += rc;
-                  state.stopped = true;
-               }   
-               else
-               {
-                  state.pc = state.pcs;
-                  state.finished = true;
-               }
-            }
-            else
-            {
-               rc = 1 + sizeof( int32_t );
-               state.pc += rc;
-            }
-         }
-      }
+   bool is_stopped( const at_context& context ) const
+   {
+      return context.state.stopped || context.state.finished || context.balance <= 0;
+   }
+
+   // NOTE: Can be called from any thread (including whilst a block is being processed).
+   void send_tx( int64_t at_id, int64_t tx_id, int64_t amount )
+   {
+      incoming.push( at_id, tx_id, amount );
    }
-   else if( op == e_op_code_FIN_IMD || op == e_op_code_STP_IMD )
+
+   void save_sleepers( ostream& os ) const
    {
-      if( disassemble )
+      sleepers.save( os );
+
+      size_t size = waiting.size( );
+      os.write( ( const char* )&size, sizeof( size_t ) );
+
+      for( set< int64_t >::const_iterator i = waiting.begin( ); i != waiting.end( ); ++i )
+         os.write( ( const char* )&*i, sizeof( int64_t ) );
+   }
+
+   // NOTE: The ATs must have already been added (with any ATs in the saved queue then being removed
+   // from the runnable ATs).
+   void load_sleepers( istream& is )
+   {
+      sleepers.load( is );
+
+      vector< int64_t > ids;
+      sleepers.get_ids( ids );
+
+      sleeping.clear( );
+      sleeping.insert( ids.begin( ), ids.end( ) );
+
+      size_t size = 0;
+      is.read( ( char* )&size, sizeof( size_t ) );
+
+      waiting.clear( );
+
+      for( size_t i = 0; i < size && is; i++ )
       {
-         rc = 1;
+         int64_t id = 0;
+         is.read( ( char* )&id, sizeof( int64_t ) );
 
-         if( !determine_jumps )
+         if( ats.count( id ) )
          {
-            if( op == e_op_code_FIN_IMD )
-               cout << "FIN\n";
-            else
-               cout << "STP\n";
+            waiting.insert( id );
+            ats[ id ]->waiting_for_tx = true;
          }
       }
-      else if( op == e_op_code_STP_IMD )
+
+      remove_from_runnable( sleeping );
+      remove_from_runnable( waiting );
+   }
+
+   void save_stopped( ostream& os ) const;
+
+   // NOTE: As with "load_sleepers" the ATs must have already been added. In order to handle a chain
+   // reorganisation the ATs should be restored along with the sleepers and stopped ATs that had been
+   // saved at the same height (with the current height then being set to that height).
+   void load_stopped( istream& is );
+
+   int32_t height;
+
+   map< int64_t, at_context* > ats;
+
+   set< int64_t > sleeping;
+   timer_wheel sleepers;
+
+   tx_queue incoming;
+   set< int64_t > waiting; // ATs that have woken from a sleep but are waiting for a tx
+
+   // NOTE: Stopped ATs (by account) with the balance that they stopped at and those stopped ATs
+   // whose balance has been increased beyond this and so will be run in the next block.
+   map< int64_t, int64_t > stopped;
+   set< int64_t > waking;
+
+   vector< at_context* > runnable;
+
+   block_executor executor;
+
+   vector< function_entry > functions;
+
+   private:
+   void deliver_txs( vector< int64_t >& woken );
+
+   // NOTE: The balance that an AT stopped at excludes any amount that was paid to it after it had
+   // stopped (which will instead wake it).
+   void stop( at_context& context, int64_t paid_after_stopping = 0 )
+   {
+      stopped[ context.id ] = context.balance - paid_after_stopping;
+      waking.erase( context.id );
+
+      if( paid_after_stopping > 0 )
+         waking.insert( context.id );
+   }
+
+   void remove_from_runnable( const set< int64_t >& ids )
+   {
+      vector< at_context* > still_runnable;
+
+      for( size_t i = 0; i < runnable.size( ); i++ )
       {
-         state.pc += rc;
-         state.stopped = true;
+         if( !ids.count( runnable[ i ]->id ) )
+            still_runnable.push_back( runnable[ i ] );
       }
-      else
+
+      runnable.swap( still_runnable );
+   }
+};
+
+void at_runtime::process_block( int32_t max_steps, vector< at_payment >& payments )
+{
+   vector< int64_t > woken;
+   sleepers.advance( height, woken );
+
+   // NOTE: ATs that were just polling for a tx when they went to sleep will keep waiting for one.
+   size_t num_woken = 0;
+
+   for( size_t i = 0; i < woken.size( ); i++ )
+   {
+      if( ats[ woken[ i ] ]->waiting_for_tx )
       {
-         state.pc = state.pcs;
-         state.finished = true;
+         sleeping.erase( woken[ i ] );
+         waiting.insert( woken[ i ] );
       }
+      else
+         woken[ num_woken++ ] = woken[ i ];
    }
-   else if( op == e_op_code_SLP_IMD )
+
+   woken.resize( num_woken );
+
+   deliver_txs( woken );
+
+   for( set< int64_t >::iterator i = waking.begin( ); i != waking.end( ); ++i )
    {
-      if( rc == 0 || disassemble )
+      at_context& context( *ats[ *i ] );
+
+      // NOTE: A finished AT will start again from its starting point (which was set when it had
+      // finished) but with empty stacks.
+      if( context.state.finished )
       {
-         rc = 1;
+         context.state.cs = 0;
+         context.state.us = 0;
+      }
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-               cout << "SLP\n";
-         }
-         else
-         {
-            // NOTE: The "sleep_until" state value would be set to the current block + 1.
+      context.state.stopped = false;
+      context.state.finished = false;
 
-            state.pc += rc;
-         }
+      stopped.erase( *i );
+
+      // NOTE: An AT could have gone to sleep before stopping (which is checked against the current
+      // height as that of a stopped AT is only updated when it is run).
+      if( context.state.sleep_until > height )
+      {
+         sleeping.insert( context.id );
+         sleepers.add( context.id, context.state.sleep_until );
       }
+      else
+         woken.push_back( *i );
    }
-   else if( op == e_op_code_ERR_ADR )
+
+   waking.clear( );
+
+   sort( woken.begin( ), woken.end( ) );
+
+   for( size_t i = 0; i < woken.size( ); i++ )
    {
-      int32_t addr;
-      rc = get_addr( p_code, csize, dsize, state, addr, true );
+      sleeping.erase( woken[ i ] );
+      runnable.push_back( ats[ woken[ i ] ] );
+   }
 
-      if( rc == 0 || disassemble )
-      {
-         rc = 1 + sizeof( int32_t );
+   for( size_t i = 0; i < runnable.size( ); i++ )
+      runnable[ i ]->height = height;
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-               cout << "ERR :" << hex << setw( 8 ) << setfill( '0' ) << addr << '\n';
-         }
-         else if( state.jumps.count( addr ) )
-            state.pce = addr;
-         else
-            rc = -3;
-      }
+   size_t first = payments.size( );
+
+   executor.execute( runnable, max_steps, payments );
+
+   // NOTE: Payments to sleeping (or waiting) ATs are just added to their balances whilst payments to
+   // stopped ATs will wake them if their balances become greater than the balances they stopped at.
+   // Payments to ATs that were run were added by the executor with those made by the AT itself or by
+   // ATs after it (in AT id order) having been added after it had run.
+   map< int64_t, int64_t > paid_after_run;
+
+   for( size_t i = first; i < payments.size( ); i++ )
+   {
+      const at_payment& payment( payments[ i ] );
+
+      if( sleeping.count( payment.account ) || waiting.count( payment.account ) )
+         ats[ payment.account ]->balance += payment.amount;
+      else if( stopped.count( payment.account ) )
+         credit( payment.account, payment.amount );
+      else if( payment.at_id >= payment.account )
+         paid_after_run[ payment.account ] += payment.amount;
    }
-   else if( op == e_op_code_SET_PCS )
+
+   vector< at_context* > still_runnable;
+
+   for( size_t i = 0; i < runnable.size( ); i++ )
    {
-      rc = 1;
+      at_context& context( *runnable[ i ] );
 
-      if( disassemble )
+      if( is_sleeping( context ) )
       {
-         if( !determine_jumps )
-            cout << "PCS\n";
+         sleeping.insert( context.id );
+         sleepers.add( context.id, context.state.sleep_until );
       }
-      else
+      else if( is_stopped( context ) )
       {
-         state.pc += rc;
-         state.pcs = state.pc;
+         map< int64_t, int64_t >::iterator j = paid_after_run.find( context.id );
+
+         stop( context, j == paid_after_run.end( ) ? 0 : j->second );
       }
+      else
+         still_runnable.push_back( &context );
    }
-   else if( op == e_op_code_EXT_FUN )
+
+   runnable.swap( still_runnable );
+
+   ++height;
+}
+
+void at_runtime::deliver_txs( vector< int64_t >& woken )
+{
+   tx_queue::node* p_txs = incoming.pop_all( );
+
+   int64_t timestamp = ( int64_t )height << 32;
+
+   for( tx_queue::node* p_tx = p_txs; p_tx; p_tx = p_tx->p_next )
    {
-      int16_t fun;
-      rc = get_fun( p_code, csize, state, fun );
+      map< int64_t, at_context* >::iterator i = ats.find( p_tx->at_id );
 
-      if( rc == 0 || disassemble )
-      {
-         rc = 1 + sizeof( int16_t );
+      if( i == ats.end( ) )
+         continue;
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-            {
-               if( fun < 0x100 )
-                  cout << "FUN " << dec << fun << "\n";
-               else
-                  cout << "FUN " << decode_function_name( fun, op ) << "\n";
-            }
-         }
-         else
-         {
-            state.pc += rc;
-            func( fun, state );
-         }
-      }
+      at_context& context( *i->second );
+
+      context.txs.push_back( at_tx( p_tx->tx_id, timestamp++, p_tx->amount ) );
+
+      context.waiting_for_tx = false;
+
+      if( waiting.erase( context.id ) )
+         woken.push_back( context.id );
+
+      credit( context.id, p_tx->amount );
    }
-   else if( op == e_op_code_EXT_FUN_DAT )
+
+   tx_queue::release( p_txs );
+}
+
+void at_runtime::set_balance( int64_t account, int64_t balance )
+{
+   map< int64_t, at_context* >::iterator i = ats.find( account );
+
+   if( i == ats.end( ) )
+      return;
+
+   i->second->balance = balance;
+
+   map< int64_t, int64_t >::iterator j = stopped.find( account );
+
+   // NOTE: If the balance has gone back down (such as due to a transfer being reversed) then a stopped
+   // AT that was going to be woken will no longer be.
+   if( j != stopped.end( ) )
    {
-      int16_t fun;
-      int32_t addr;
-      rc = get_fun_addr( p_code, csize, dsize, state, fun, addr );
+      if( balance > j->second )
+         waking.insert( account );
+      else
+         waking.erase( account );
+   }
+}
 
-      if( rc == 0 || disassemble )
-      {
-         rc = 1 + sizeof( int16_t ) + sizeof( int32_t );
+void at_runtime::save_stopped( ostream& os ) const
+{
+   size_t size = stopped.size( );
+   os.write( ( const char* )&size, sizeof( size_t ) );
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-            {
-               if( fun < 0x100 )
-                  cout << "FUN " << dec << fun << " $" << hex << setw( 8 ) << setfill( '0' ) << addr << "\n";
-               else
-                  cout << "FUN " << decode_function_name( fun, op )
-                   << " $" << hex << setw( 8 ) << setfill( '0' ) << addr << "\n";
-            }
-         }
-         else
-         {
-            state.pc += rc;
-            int64_t val = *( int64_t* )( p_data + ( addr * 8 ) );
+   for( map< int64_t, int64_t >::const_iterator i = stopped.begin( ); i != stopped.end( ); ++i )
+   {
+      os.write( ( const char* )&i->first, sizeof( int64_t ) );
+      os.write( ( const char* )&i->second, sizeof( int64_t ) );
 
-            func1( fun, state, val, p_data, dsize );
-         }
-      }
+      bool finished = ats.find( i->first )->second->state.finished;
+      os.write( ( const char* )&finished, sizeof( bool ) );
    }
-   else if( op == e_op_code_EXT_FUN_DAT_2 )
+}
+
+void at_runtime::load_stopped( istream& is )
+{
+   stopped.clear( );
+   waking.clear( );
+
+   size_t size = 0;
+   is.read( ( char* )&size, sizeof( size_t ) );
+
+   set< int64_t > ids;
+
+   for( size_t i = 0; i < size && is; i++ )
    {
-      int16_t fun;
-      int32_t addr1, addr2;
-      rc = get_fun_addrs( p_code, csize, dsize, state, fun, addr1, addr2 );
+      int64_t account = 0, balance = 0;
+      bool finished = false;
 
-      if( rc == 0 || disassemble )
-      {
-         rc = 1 + sizeof( int16_t ) + sizeof( int32_t ) + sizeof( int32_t );
+      is.read( ( char* )&account, sizeof( int64_t ) );
+      is.read( ( char* )&balance, sizeof( int64_t ) );
+      is.read( ( char* )&finished, sizeof( bool ) );
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-            {
-               if( fun < 0x100 )
-                  cout << "FUN " << dec << fun << " $" << hex << setw( 8 )
-                   << setfill( '0' ) << addr1 << " $" << setw( 8 ) << setfill( '0' ) << addr2 << "\n";
-               else
-                  cout << "FUN " << decode_function_name( fun, op ) << " $" << hex << setw( 8 )
-                   << setfill( '0' ) << addr1 << " $" << setw( 8 ) << setfill( '0' ) << addr2 << "\n";
-            }
-         }
-         else
-         {
-            state.pc += rc;
-            int64_t val1 = *( int64_t* )( p_data + ( addr1 * 8 ) );
-            int64_t val2 = *( int64_t* )( p_data + ( addr2 * 8 ) );
+      map< int64_t, at_context* >::iterator j = ats.find( account );
 
-            func2( fun, state, val1, val2, p_data, dsize );
-         }
-      }
+      if( j == ats.end( ) )
+         continue;
+
+      stopped[ account ] = balance;
+      ids.insert( account );
+
+      // NOTE: The stopped and finished flags are not saved with the AT so are restored here.
+      j->second->state.stopped = !finished;
+      j->second->state.finished = finished;
+
+      if( j->second->balance > balance )
+         waking.insert( account );
    }
-   else if( op == e_op_code_EXT_FUN_RET )
+
+   remove_from_runnable( ids );
+}
+
+// NOTE: A synthetic AT (for benchmarking) that sums a number of values (which depends upon its id
+// so that the ATs do differing amounts of work) and then sends the sum to an external account (or
+// for every fiftieth AT to the AT with the next id).
+void make_synthetic_at( at_context& context, int64_t id )
+{
+   context.id = id;
+   context.balance = numeric_limits< int32_t >::max( );
+
+   int64_t loops = 50 + id % 200;
+
+   int8_t* p_code = context.ap_code.get( );
+
+   memset( p_code, 0, context.csize( ) );
+
+   int32_t pc = 0;
+
+   p_code[ pc ] = e_op_code_SET_VAL;
+   *( int32_t* )( p_code + pc + 1 ) = 2;
+   *( int64_t* )( p_code + pc + 5 ) = loops;
+   pc += 13;
+
+   p_code[ pc ] = e_op_code_SET_VAL;
+   *( int32_t* )( p_code + pc + 1 ) = 3;
+   *( int64_t* )( p_code + pc + 5 ) = ( id % 50 ) ? id + 0x100000000LL : id + 1;
+   pc += 13;
+
+   int32_t loop_pc = pc;
+
+   p_code[ pc ] = e_op_code_INC_DAT;
+   *( int32_t* )( p_code + pc + 1 ) = 0;
+   pc += 5;
+
+   p_code[ pc ] = e_op_code_ADD_DAT;
+   *( int32_t* )( p_code + pc + 1 ) = 1;
+   *( int32_t* )( p_code + pc + 5 ) = 0;
+   pc += 9;
+
+   p_code[ pc ] = e_op_code_BNE_DAT;
+   *( int32_t* )( p_code + pc + 1 ) = 0;
+   *( int32_t* )( p_code + pc + 5 ) = 2;
+   p_code[ pc + 9 ] = ( int8_t )( loop_pc - pc );
+   pc += 10;
+
+   p_code[ pc ] = e_op_code_EXT_FUN_DAT_2;
+   *( int16_t* )( p_code + pc + 1 ) = 31;
+   *( int32_t* )( p_code + pc + 3 ) = 1;
+   *( int32_t* )( p_code + pc + 7 ) = 3;
+   pc += 11;
+
+   p_code[ pc ] = e_op_code_FIN_IMD;
+
+   reset_machine( context );
+}
+
+int64_t get_wall_clock_usecs( )
+{
+#ifdef AT_THREADS
+   timeval tv;
+   gettimeofday( &tv, 0 );
+
+   return ( int64_t )tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+   return ( int64_t )clock( ) * 1000000 / CLOCKS_PER_SEC;
+#endif
+}
+
+// NOTE: Hashes the final state of every AT (in AT id order) along with all of the merged payments.
+string get_block_results_hash( const vector< at_context* >& contexts, const vector< at_payment >& payments )
+{
+   sha256 hash;
+
+   vector< at_context* > ordered( contexts );
+   stable_sort( ordered.begin( ), ordered.end( ), at_id_less );
+
+   for( size_t i = 0; i < ordered.size( ); i++ )
    {
-      int16_t fun;
-      int32_t addr;
-      rc = get_fun_addr( p_code, csize, dsize, state, fun, addr );
+      const at_context& context( *ordered[ i ] );
+      const machine_state& state( context.state );
 
-      if( rc == 0 || disassemble )
-      {
-         rc = 1 + sizeof( int16_t ) + sizeof( int32_t );
+      int64_t values[ ] = { context.id, context.balance, context.val, state.pc, state.cs, state.us,
+       state.steps, state.stopped, state.finished, state.a1, state.a2, state.a3, state.a4, state.b1, state.b2, state.b3, state.b4 };
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-            {
-               if( fun < 0x100 )
-                  cout << "FUN @" << hex << setw( 8 ) << setfill( '0' ) << addr << ' ' << dec << fun << '\n';
-               else
-                  cout << "FUN @" << hex << setw( 8 ) << setfill( '0' ) << addr
-                   << " " << decode_function_name( fun, op ) << '\n';
-            }
-         }
-         else
-         {
-            state.pc += rc;
-            *( int64_t* )( p_data + ( addr * 8 ) ) = func( fun, state );
-         }
+      hash.update( values, sizeof( values ) );
+      hash.update( context.ap_data.get( ), context.dsize( ) + context.cssize( ) + context.ussize( ) );
+   }
+
+   for( size_t i = 0; i < payments.size( ); i++ )
+   {
+      int64_t values[ ] = { payments[ i ].at_id, payments[ i ].account, payments[ i ].amount };
+      hash.update( values, sizeof( values ) );
+   }
+
+   return hash.hex_digest( );
+}
+
+// NOTE: Writes ops into the code of an AT (used to generate the code for benchmarking).
+struct code_writer
+{
+   code_writer( at_context& context )
+    :
+    p_code( context.ap_code.get( ) ),
+    pc( 0 )
+   {
+      memset( p_code, 0, context.csize( ) );
+   }
+
+   void op( int8_t op_code )
+   {
+      p_code[ pc++ ] = op_code;
+   }
+
+   void op( int8_t op_code, int32_t addr )
+   {
+      p_code[ pc ] = op_code;
+      *( int32_t* )( p_code + pc + 1 ) = addr;
+      pc += 5;
+   }
+
+   void op( int8_t op_code, int32_t addr1, int32_t addr2 )
+   {
+      p_code[ pc ] = op_code;
+      *( int32_t* )( p_code + pc + 1 ) = addr1;
+      *( int32_t* )( p_code + pc + 5 ) = addr2;
+      pc += 9;
+   }
+
+   void set_val( int32_t addr, int64_t val )
+   {
+      p_code[ pc ] = e_op_code_SET_VAL;
+      *( int32_t* )( p_code + pc + 1 ) = addr;
+      *( int64_t* )( p_code + pc + 5 ) = val;
+      pc += 13;
+   }
+
+   void fun( int16_t func_num )
+   {
+      p_code[ pc ] = e_op_code_EXT_FUN;
+      *( int16_t* )( p_code + pc + 1 ) = func_num;
+      pc += 3;
+   }
+
+   void fun( int8_t op_code, int16_t func_num, int32_t addr1, int32_t addr2 = -1 )
+   {
+      p_code[ pc ] = op_code;
+      *( int16_t* )( p_code + pc + 1 ) = func_num;
+      *( int32_t* )( p_code + pc + 3 ) = addr1;
+      pc += 7;
+
+      if( addr2 >= 0 )
+      {
+         *( int32_t* )( p_code + pc ) = addr2;
+         pc += 4;
       }
    }
-   else if( op == e_op_code_EXT_FUN_RET_DAT || op == e_op_code_EXT_FUN_RET_DAT_2 )
+
+   // NOTE: Ends a loop (that started at "loop_pc") that is repeated until "counter" equals "limit"
+   // and then finishes.
+   void end_loop( int32_t loop_pc, int32_t counter, int32_t limit )
    {
-      int16_t fun;
-      int32_t addr1, addr2;
-      rc = get_fun_addrs( p_code, csize, dsize, state, fun, addr1, addr2 );
+      op( e_op_code_INC_DAT, counter );
 
-      int32_t size = sizeof( int16_t ) + sizeof( int32_t ) + sizeof( int32_t );
+      p_code[ pc ] = e_op_code_BEQ_DAT;
+      *( int32_t* )( p_code + pc + 1 ) = counter;
+      *( int32_t* )( p_code + pc + 5 ) = limit;
+      p_code[ pc + 9 ] = 15;
+      pc += 10;
 
-      int32_t addr3;
-      if( ( rc == 0 || disassemble ) && op == e_op_code_EXT_FUN_RET_DAT_2 )
-         rc = get_addr( p_code + size, csize, dsize, state, addr3 );
+      op( e_op_code_JMP_ADR, loop_pc );
+      op( e_op_code_FIN_IMD );
+   }
 
-      if( rc == 0 || disassemble )
-      {
-         rc = 1 + size + ( op == e_op_code_EXT_FUN_RET_DAT_2 ? sizeof( int32_t ) : 0 );
+   int8_t* p_code;
+   int32_t pc;
+};
 
-         if( disassemble )
-         {
-            if( !determine_jumps )
-            {
-               if( fun < 0x100 )
-                  cout << "FUN @" << hex << setw( 8 ) << setfill( '0' ) << addr1
-                   << ' ' << dec << fun << " $" << setw( 8 ) << setfill( '0' ) << addr2;
-               else
-                  cout << "FUN @" << hex << setw( 8 ) << setfill( '0' ) << addr1 << " "
-                   << decode_function_name( fun, op ) << " $" << setw( 8 ) << setfill( '0' ) << addr2;
+// NOTE: Data addresses used by the math benchmark ATs (X, Y and the result R are 256 bit values
+// stored as four 64 bit values with the least significant first).
+enum bench_math_addr
+{
+   e_bench_math_addr_x = 0,
+   e_bench_math_addr_y = 4,
+   e_bench_math_addr_r = 8,
+   e_bench_math_addr_t = 12,
+   e_bench_math_addr_u = 13,
+   e_bench_math_addr_v = 14,
+   e_bench_math_addr_w = 15,
+   e_bench_math_addr_carry = 16,
+   e_bench_math_addr_63 = 17,
+   e_bench_math_addr_1 = 18,
+   e_bench_math_addr_counter = 19,
+   e_bench_math_addr_limit = 20,
+   e_bench_math_addr_mask = 21,
+   e_bench_math_addr_shifts = 22, // 0, 16, 32 and 48
+   e_bench_math_addr_x_digits = 32, // X and Y as 16 bit digits
+   e_bench_math_addr_y_digits = 48,
+   e_bench_math_addr_columns = 64
+};
 
-               if( op == e_op_code_EXT_FUN_RET_DAT_2 )
-                  cout << " $" << setw( 8 ) << setfill( '0' ) << addr3;
+// NOTE: Adds X to Y (into R) using only 64 bit ops (with the carry out of each word being
+// calculated from the top bits of the words and their sum).
+void write_emulated_add( code_writer& writer )
+{
+   writer.op( e_op_code_CLR_DAT, e_bench_math_addr_carry );
 
-               cout << "\n";
-            }
-         }
-         else
-         {
-            state.pc += rc;
-            int64_t val = *( int64_t* )( p_data + ( addr2 * 8 ) );
+   for( int32_t i = 0; i < 4; i++ )
+   {
+      int32_t x = e_bench_math_addr_x + i;
+      int32_t y = e_bench_math_addr_y + i;
+
+      writer.op( e_op_code_SET_DAT, e_bench_math_addr_t, x );
+      writer.op( e_op_code_ADD_DAT, e_bench_math_addr_t, y );
+      writer.op( e_op_code_ADD_DAT, e_bench_math_addr_t, e_bench_math_addr_carry );
+
+      writer.op( e_op_code_SET_DAT, e_bench_math_addr_u, x );
+      writer.op( e_op_code_AND_DAT, e_bench_math_addr_u, y );
+      writer.op( e_op_code_SET_DAT, e_bench_math_addr_v, x );
+      writer.op( e_op_code_BOR_DAT, e_bench_math_addr_v, y );
+      writer.op( e_op_code_SET_DAT, e_bench_math_addr_w, e_bench_math_addr_t );
+      writer.op( e_op_code_NOT_DAT, e_bench_math_addr_w );
+      writer.op( e_op_code_AND_DAT, e_bench_math_addr_v, e_bench_math_addr_w );
+      writer.op( e_op_code_BOR_DAT, e_bench_math_addr_u, e_bench_math_addr_v );
+      writer.op( e_op_code_SHR_DAT, e_bench_math_addr_u, e_bench_math_addr_63 );
+      writer.op( e_op_code_AND_DAT, e_bench_math_addr_u, e_bench_math_addr_1 );
+      writer.op( e_op_code_SET_DAT, e_bench_math_addr_carry, e_bench_math_addr_u );
+
+      writer.op( e_op_code_SET_DAT, e_bench_math_addr_r + i, e_bench_math_addr_t );
+   }
+}
 
-            if( op != e_op_code_EXT_FUN_RET_DAT_2 )
-               *( int64_t* )( p_data + ( addr1 * 8 ) ) = func1( fun, state, val, p_data, dsize );
-            else
-            {
-               int64_t val2 = *( int64_t* )( p_data + ( addr3 * 8 ) );
-               *( int64_t* )( p_data + ( addr1 * 8 ) ) = func2( fun, state, val, val2, p_data, dsize );
-            }
-         }
-      }
+// NOTE: Multiplies X by Y (into R) using only 64 bit ops by splitting both into 16 bit digits (so
+// that the sum of the digit products for each column cannot overflow) and then propagating the
+// carries between the columns.
+void write_emulated_mul( code_writer& writer )
+{
+   for( int32_t i = 0; i < 16; i++ )
+   {
+      int32_t shift = e_bench_math_addr_shifts + i % 4;
+
+      writer.op( e_op_code_SET_DAT, e_bench_math_addr_x_digits + i, e_bench_math_addr_x + i / 4 );
+      writer.op( e_op_code_SHR_DAT, e_bench_math_addr_x_digits + i, shift );
+      writer.op( e_op_code_AND_DAT, e_bench_math_addr_x_digits + i, e_bench_math_addr_mask );
+
+      writer.op( e_op_code_SET_DAT, e_bench_math_addr_y_digits + i, e_bench_math_addr_y + i / 4 );
+      writer.op( e_op_code_SHR_DAT, e_bench_math_addr_y_digits + i, shift );
+      writer.op( e_op_code_AND_DAT, e_bench_math_addr_y_digits + i, e_bench_math_addr_mask );
    }
-   else
+
+   for( int32_t k = 0; k < 16; k++ )
    {
-      if( !disassemble )
-         rc = -2;
+      writer.op( e_op_code_CLR_DAT, e_bench_math_addr_columns + k );
+
+      for( int32_t i = 0; i <= k; i++ )
+      {
+         writer.op( e_op_code_SET_DAT, e_bench_math_addr_t, e_bench_math_addr_x_digits + i );
+         writer.op( e_op_code_MUL_DAT, e_bench_math_addr_t, e_bench_math_addr_y_digits + k - i );
+         writer.op( e_op_code_ADD_DAT, e_bench_math_addr_columns + k, e_bench_math_addr_t );
+      }
    }
 
-   if( rc == -1 && state.pce )
+   writer.op( e_op_code_CLR_DAT, e_bench_math_addr_carry );
+
+   for( int32_t k = 0; k < 16; k++ )
    {
-      rc = 0;
-      state.pc = state.pce;
+      writer.op( e_op_code_ADD_DAT, e_bench_math_addr_columns + k, e_bench_math_addr_carry );
+      writer.op( e_op_code_SET_DAT, e_bench_math_addr_carry, e_bench_math_addr_columns + k );
+      writer.op( e_op_code_SHR_DAT, e_bench_math_addr_carry, e_bench_math_addr_shifts + 1 );
+      writer.op( e_op_code_AND_DAT, e_bench_math_addr_columns + k, e_bench_math_addr_mask );
    }
 
-   if( rc == -1 && disassemble && !determine_jumps )
-      cout << "\n(overflow)\n";
+   for( int32_t i = 0; i < 4; i++ )
+   {
+      writer.op( e_op_code_SET_DAT, e_bench_math_addr_r + i, e_bench_math_addr_columns + i * 4 + 3 );
 
-   if( rc == -2 && disassemble && !determine_jumps )
-      cout << "\n(invalid op)\n";
+      for( int32_t k = 2; k >= 0; k-- )
+      {
+         writer.op( e_op_code_SHL_DAT, e_bench_math_addr_r + i, e_bench_math_addr_shifts + 1 );
+         writer.op( e_op_code_BOR_DAT, e_bench_math_addr_r + i, e_bench_math_addr_columns + i * 4 + k );
+      }
+   }
+}
 
-   if( rc >= 0 )
-      ++state.steps;
+// NOTE: Calculates R from X and Y using the A and B math function "func_num" (which has its
+// result in B).
+void write_native_math( code_writer& writer, int16_t func_num )
+{
+   writer.fun( e_op_code_EXT_FUN_DAT_2, 0x0114, e_bench_math_addr_x, e_bench_math_addr_x + 1 );
+   writer.fun( e_op_code_EXT_FUN_DAT_2, 0x0115, e_bench_math_addr_x + 2, e_bench_math_addr_x + 3 );
+   writer.fun( e_op_code_EXT_FUN_DAT_2, 0x011a, e_bench_math_addr_y, e_bench_math_addr_y + 1 );
+   writer.fun( e_op_code_EXT_FUN_DAT_2, 0x011b, e_bench_math_addr_y + 2, e_bench_math_addr_y + 3 );
 
-   return rc;
+   writer.fun( func_num );
+
+   for( int32_t i = 0; i < 4; i++ )
+      writer.fun( e_op_code_EXT_FUN_RET, 0x0104 + i, e_bench_math_addr_r + i );
 }
 
-void dump_state( const machine_state& state )
+// NOTE: Runs an AT (which loops "iterations" times) until it finishes or fails returning the time
+// taken (and with its result copied into "result").
+int64_t run_bench_math_at( at_context& context, const uint256& x, const uint256& y, size_t iterations, uint256& result )
 {
-   cout << "pc: " << hex << setw( 8 ) << setfill( '0' ) << state.pc << '\n';
+   int64_t* p_data = ( int64_t* )context.ap_data.get( );
 
-   cout << "cs: " << dec << state.cs << '\n';
-   cout << "us: " << dec << state.us << '\n';
+   for( size_t i = 0; i < 4; i++ )
+   {
+      p_data[ e_bench_math_addr_x + i ] = ( int64_t )x.words[ i ];
+      p_data[ e_bench_math_addr_y + i ] = ( int64_t )y.words[ i ];
 
-   cout << "pce: " << hex << setw( 8 ) << setfill( '0' ) << state.pcs << '\n';
-   cout << "pcs: " << hex << setw( 8 ) << setfill( '0' ) << state.pcs << '\n';
+      p_data[ e_bench_math_addr_shifts + i ] = i * 16;
+   }
 
-   cout << "steps: " << dec << state.steps << '\n';
+   p_data[ e_bench_math_addr_63 ] = 63;
+   p_data[ e_bench_math_addr_1 ] = 1;
+   p_data[ e_bench_math_addr_mask ] = 0xffff;
+   p_data[ e_bench_math_addr_limit ] = ( int64_t )iterations;
 
-   cout << "a1: " << hex << setw( 16 ) << setfill( '0' ) << state.a1 << '\n';
-   cout << "a2: " << hex << setw( 16 ) << setfill( '0' ) << state.a2 << '\n';
-   cout << "a3: " << hex << setw( 16 ) << setfill( '0' ) << state.a3 << '\n';
-   cout << "a4: " << hex << setw( 16 ) << setfill( '0' ) << state.a4 << '\n';
+   context.mark_all_dirty( );
+   context.balance = numeric_limits< int64_t >::max( );
 
-   cout << "b1: " << hex << setw( 16 ) << setfill( '0' ) << state.b1 << '\n';
-   cout << "b2: " << hex << setw( 16 ) << setfill( '0' ) << state.b2 << '\n';
-   cout << "b3: " << hex << setw( 16 ) << setfill( '0' ) << state.b3 << '\n';
-   cout << "b4: " << hex << setw( 16 ) << setfill( '0' ) << state.b4 << '\n';
+   int64_t start = get_wall_clock_usecs( );
+
+   while( !context.state.finished && run_block( context, numeric_limits< int32_t >::max( ) ) >= 0 )
+      ;
+
+   int64_t usecs = get_wall_clock_usecs( ) - start;
+
+   for( size_t i = 0; i < 4; i++ )
+      result.words[ i ] = ( uint64_t )p_data[ e_bench_math_addr_r + i ];
+
+   return usecs;
 }
 
-void dump_bytes( int8_t* p_bytes, int num )
+// NOTE: Compares the time taken by the 256 bit A and B math functions with the same calculations
+// done by ATs using only 64 bit ops (for add and multiply) outputting the time taken for each and
+// whether or not the results matched those calculated directly.
+void bench_wide_math( size_t iterations )
 {
-   for( int i = 0; i < num; i += 16 )
+   if( !iterations )
+      iterations = 1;
+
+   uint256 x = { { 0x0123456789abcdefULL, 0xfedcba9876543210ULL, 0xffffffffffffffffULL, 0x7fffffff00000001ULL } };
+   uint256 y = { { 0xfffffffffffffff1ULL, 0x0000000100000000ULL, 0x8000000000000000ULL, 0x0000000000000003ULL } };
+
+   const char* p_names[ ] = { "add", "sub", "mul", "div" };
+   const int16_t func_nums[ ] = { 0x0140, 0x0142, 0x0144, 0x0146 };
+
+   uint256 expected[ 4 ];
+
+   expected[ 0 ] = add_256( x, y );
+   expected[ 1 ] = sub_256( x, y );
+   expected[ 2 ] = mul_256( x, y );
+
+   div_256( x, y, expected[ 3 ] );
+
+   // NOTE: Disable any console output and tracing.
+   trace_sink sink = g_trace_sink;
+
+   int level = g_trace_level;
+   int categories = g_trace_categories;
+
+   g_trace_sink = 0;
+   set_trace( e_trace_level_none, categories );
+
+   for( size_t i = 0; i < 4; i++ )
    {
-      cout << hex << setw( 8 ) << setfill( '0' ) << i << ' ';
+      int64_t emulated_usecs = 0;
+      bool emulated_matched = true;
 
-      for( int j = 0; j < 16; j++ )
+      if( i == 0 || i == 2 )
       {
-         int val = ( unsigned char )p_bytes[ i + j ];
+         at_context context;
 
-         cout << ' ' << hex << setw( 2 ) << setfill( '0' ) << val;
+         context.code_pages = 16;
+         context.data_pages = 2;
+
+         context.allocate_code( );
+         context.allocate_data( );
+
+         code_writer writer( context );
+
+         if( i == 0 )
+            write_emulated_add( writer );
+         else
+            write_emulated_mul( writer );
+
+         writer.end_loop( 0, e_bench_math_addr_counter, e_bench_math_addr_limit );
+
+         reset_machine( context );
+
+         uint256 result;
+         emulated_usecs = run_bench_math_at( context, x, y, iterations, result );
+
+         emulated_matched = memcmp( &result, &expected[ i ], sizeof( uint256 ) ) == 0;
       }
 
-      cout << '\n';
-   }
-}
+      at_context context;
+      context.data_pages = 2;
+      context.allocate_data( );
 
-void list_code( machine_state& state, int8_t* p_code, int32_t csize,
- int8_t* p_data, int32_t dsize, int32_t cssize, int32_t ussize, bool determine_jumps = false )
-{
-   int32_t opc = state.pc;
-   int32_t osteps = state.steps;
+      code_writer writer( context );
 
-   state.pc = 0;
-   state.opc = opc;
+      write_native_math( writer, func_nums[ i ] );
 
-   while( true )
-   {
-      int rc = process_op( p_code, csize, p_data, dsize, cssize, ussize, true, determine_jumps, state );
+      writer.end_loop( 0, e_bench_math_addr_counter, e_bench_math_addr_limit );
 
-      if( rc <= 0 )
-         break;
+      reset_machine( context );
 
-      state.pc += rc;
+      // NOTE: As the functions use A and B (in the opposite order for "sub") then X and Y are
+      // swapped for "sub" so that R is X - Y.
+      uint256 result;
+      int64_t native_usecs = i == 1
+       ? run_bench_math_at( context, y, x, iterations, result ) : run_bench_math_at( context, x, y, iterations, result );
+
+      bool native_matched = memcmp( &result, &expected[ i ], sizeof( uint256 ) ) == 0;
+
+      cout << p_names[ i ] << ": iterations: " << dec << iterations;
+
+      if( i == 0 || i == 2 )
+         cout << ", emulated usecs: " << emulated_usecs;
+
+      cout << ", function usecs: " << native_usecs;
+
+      if( i == 0 || i == 2 )
+         cout << ", speedup: " << fixed << setprecision( 2 )
+          << ( native_usecs ? ( double )emulated_usecs / native_usecs : 0.0 );
+
+      cout << ( emulated_matched && native_matched ? "" : " *** mismatch ***" ) << '\n';
    }
 
-   state.steps = osteps;
-   state.pc = opc;
+   g_trace_sink = sink;
+   set_trace( level, categories );
 }
 
-bool check_has_balance( )
+// NOTE: Runs a block of synthetic ATs sequentially and then with 1, 2, 4, ... up to "max_threads"
+// threads (outputting the time taken and a hash of the results which must be the same every time).
+void bench_block_executor( size_t num_ats, size_t max_threads )
 {
-   if( g_balance == 0 )
+   if( !max_threads )
+      max_threads = block_executor( ).num_threads;
+
+   at_memory_pools pools;
+
+   vector< at_context* > contexts;
+   contexts.reserve( num_ats );
+
+   for( size_t i = 0; i < num_ats; i++ )
+      contexts.push_back( new at_context( &pools ) );
+
+   // NOTE: Disable any console output and tracing from the worker threads.
+   trace_sink sink = g_trace_sink;
+
+   int level = g_trace_level;
+   int categories = g_trace_categories;
+
+   g_trace_sink = 0;
+   set_trace( e_trace_level_none, categories );
+
+   int64_t base_usecs = 0;
+   string expected_hash;
+
+   for( size_t num_threads = 0; ; num_threads = num_threads ? num_threads * 2 : 1 )
    {
-      cout << "(stopped - zero balance)\n";
-      return false;
-   }
-   else
-      return true;
-}
+      if( num_threads > max_threads )
+         num_threads = max_threads;
 
-void reset_machine( machine_state& state,
- int8_t* p_code, int32_t csize, int8_t* p_data, int32_t dsize, int32_t cssize, int32_t ussize )
-{
-   state.reset( );
-   list_code( state, p_code, csize, p_data, dsize, cssize, ussize, true );
+      for( size_t i = 0; i < num_ats; i++ )
+         make_synthetic_at( *contexts[ i ], ( int64_t )( num_ats - i ) );
 
-   memset( p_data, 0, dsize + cssize + ussize );
+      vector< at_payment > payments;
+      block_executor executor( num_threads );
 
-   g_first_call = true;
+      int64_t start = get_wall_clock_usecs( );
 
-   for( map< int32_t, function_data >::iterator i = g_function_data.begin( ); i != g_function_data.end( ); ++i )
-      i->second.offset = 0;
+      if( !num_threads )
+         execute_sequential( contexts, numeric_limits< int32_t >::max( ), payments );
+      else
+         executor.execute( contexts, numeric_limits< int32_t >::max( ), payments );
+
+      int64_t usecs = get_wall_clock_usecs( ) - start;
+
+      string hash( get_block_results_hash( contexts, payments ) );
+
+      if( !num_threads )
+      {
+         base_usecs = usecs;
+         expected_hash = hash;
+
+         cout << "sequential";
+      }
+      else
+         cout << "threads: " << dec << executor.num_threads;
+
+      cout << ", ats: " << dec << num_ats << ", usecs: " << usecs << ", speedup: "
+       << fixed << setprecision( 2 ) << ( usecs ? ( double )base_usecs / usecs : 0.0 )
+       << ", payments: " << payments.size( ) << ", executed again: " << executor.num_executed_again
+       << ", results: " << hash.substr( 0, 16 ) << ( hash == expected_hash ? "" : " *** mismatch ***" ) << '\n';
+
+      if( num_threads >= max_threads )
+         break;
+   }
+
+   g_trace_sink = sink;
+   set_trace( level, categories );
+
+   for( size_t i = 0; i < contexts.size( ); i++ )
+      delete contexts[ i ];
 }
 
 int main( )
 {
-   auto_ptr< int8_t > ap_code( new int8_t[ g_code_pages * c_code_page_bytes ] );
-   auto_ptr< int8_t > ap_data( new int8_t[ g_data_pages * c_data_page_bytes
-    + g_call_stack_pages * c_call_stack_page_bytes + g_user_stack_pages * c_user_stack_page_bytes ] );
+   at_context context;
+   context.p_output = &cout;
 
-   memset( ap_code.get( ), 0, g_code_pages * c_code_page_bytes );
-   memset( ap_data.get( ), 0, g_data_pages * c_data_page_bytes
-    + g_call_stack_pages * c_call_stack_page_bytes + g_user_stack_pages * c_user_stack_page_bytes );
+   jit_code jit;
+   bool use_jit = false;
+
+   aot_code aot;
+   bool use_aot = false;
 
-   machine_state state;
    set< int32_t > break_points;
 
+   // NOTE: By default host function calls are output to the console as they occur.
+   set_trace( e_trace_level_info, e_trace_category_func );
+   g_trace_sink = trace_to_console;
+
    string cmd, next;
    while( cout << "\n> ", getline( cin, next ) )
    {
@@ -2118,15 +8934,22 @@ int main( )
          cout << "dump {code|data|stacks}\n";
          cout << "list\n";
          cout << "load <file>\n";
-         cout << "save <file>\n";
+         cout << "save <file> [image]\n";
          cout << "size [{code|data|call|user} [<pages>]]\n";
          cout << "step [<num_steps>]\n";
+         cout << "verify\n";
          cout << "break <[0x]value>\n";
          cout << "reset\n";
          cout << "state\n";
+         cout << "hash\n";
          cout << "balance [<amount>]\n";
+         cout << "bench {<num_ats> [<max_threads>]|math <iterations>}\n";
          cout << "function <[+]#> [<[0x]value1[,[0x]value2[,...]]>] [loop]\n";
          cout << "functions\n";
+         cout << "aot [{on|off}]\n";
+         cout << "jit [{on|off}]\n";
+         cout << "trace [{off|error|info|debug} [{func|machine|all}]]\n";
+         cout << "trace {console [{on|off}]|dump [<num_records>]}\n";
          cout << "help\n";
          cout << "exit" << endl;
       }
@@ -2144,14 +8967,14 @@ int main( )
                offset = atoi( arg_2.c_str( ) );
          }
 
-         int8_t* p_c = cmd == "code" ? ap_code.get( ) : ap_data.get( ) + offset;
+         int8_t* p_c = cmd == "code" ? context.ap_code.get( ) : context.ap_data.get( ) + offset;
 
          if( arg_2.empty( ) )
          {
             if( cmd == "code" )
-               memset( p_c, 0, g_code_pages * c_code_page_bytes );
+               memset( p_c, 0, context.csize( ) );
             else
-               memset( p_c, 0, g_data_pages * c_data_page_bytes );
+               memset( p_c, 0, context.dsize( ) );
          }
 
          for( size_t i = 0; i < arg_1.size( ); i += 2 )
@@ -2164,53 +8987,72 @@ int main( )
          }
 
          if( cmd == "code" )
-            reset_machine( state,
-             ap_code.get( ), g_code_pages * c_code_page_bytes,
-             ap_data.get( ), g_data_pages * c_data_page_bytes,
-             g_call_stack_pages * c_call_stack_page_bytes, g_user_stack_pages * c_user_stack_page_bytes );
+            reset_machine( context );
+         else
+            context.mark_all_dirty( );
       }
       else if( cmd == "run" || cmd == "cont" )
       {
          if( cmd == "run" )
-            reset_machine( state, ap_code.get( ),
-             g_code_pages * c_code_page_bytes, ap_data.get( ), g_data_pages * c_data_page_bytes,
-             g_call_stack_pages * c_call_stack_page_bytes, g_user_stack_pages * c_user_stack_page_bytes );
+            reset_machine( context );
+
+         const native_code* p_native = 0;
+
+         if( use_aot )
+         {
+            if( aot_compile( aot, context.code,
+             context.ap_code.get( ), context.cssize( ), context.ussize( ) ) )
+               p_native = &aot.native;
+            else
+               cout << "error: unable to compile aot code\n";
+         }
+         else if( use_jit && jit_compile( jit, context.code ) )
+            p_native = &jit.native;
 
          while( true )
          {
-            if( !check_has_balance( ) )
+            if( !check_has_balance( context ) )
                break;
 
-            int rc = process_op(
-             ap_code.get( ), g_code_pages * c_code_page_bytes,
-             ap_data.get( ), g_data_pages * c_data_page_bytes,
-             g_call_stack_pages * c_call_stack_page_bytes,
-             g_user_stack_pages * c_user_stack_page_bytes, false, false, state );
+            int32_t steps = 0;
+            int rc = run_native( p_native, context, get_max_steps( context, break_points.empty( ) ? numeric_limits< int32_t >::max( ) : 1 ), steps );
 
-            if( !check_has_balance( ) )
+            // NOTE: All but the last op executed are charged here (the last one being checked
+            // and charged below as it could have been an external function that paid out).
+            context.balance -= steps - 1;
+
+            if( !check_has_balance( context ) )
                break;
 
-            --g_balance;
+            --context.balance;
 
             if( rc >= 0 )
             {
-               if( state.stopped )
+               if( context.state.stopped )
                {
                   cout << "(stopped)\n";
-                  cout << "total steps: " << dec << state.steps << '\n';
+                  cout << "total steps: " << dec << context.state.steps << '\n';
 
-                  state.stopped = false;
+                  context.state.stopped = false;
                   break;
                }
-               else if( state.finished )
+               else if( context.state.finished )
                {
                   cout << "(finished)\n";
-                  cout << "total steps: " << dec << state.steps << '\n';
+                  cout << "total steps: " << dec << context.state.steps << '\n';
+
+                  break;
+               }
+               else if( is_sleeping( context ) )
+               {
+                  // NOTE: The REPL simply moves on to the block that the AT is sleeping until.
+                  cout << "(sleeping until block " << dec << context.state.sleep_until << ")\n";
+                  context.height = context.state.sleep_until;
 
                   break;
                }
 
-               if( break_points.count( state.pc ) )
+               if( break_points.count( context.state.pc ) )
                {
                   cout << "(break point)\n";
                   break;
@@ -2232,101 +9074,122 @@ int main( )
       else if( cmd == "dump" && ( next == "code" || next == "data" || next == "stacks" ) )
       {
          if( next == "code" )
-            dump_bytes( ap_code.get( ), g_code_pages * c_code_page_bytes );
+            dump_bytes( context.ap_code.get( ), context.csize( ) );
          else if( next == "data" )
-            dump_bytes( ap_data.get( ), g_data_pages * c_data_page_bytes );
+            dump_bytes( context.ap_data.get( ), context.dsize( ) );
          else
-            dump_bytes( ap_data.get( ) + g_data_pages * c_data_page_bytes,
-             g_call_stack_pages * c_call_stack_page_bytes + g_user_stack_pages * c_user_stack_page_bytes );
+            dump_bytes( context.ap_data.get( ) + context.dsize( ),
+             context.cssize( ) + context.ussize( ) );
       }
       else if( cmd == "list" )
-         list_code( state,
-          ap_code.get( ), g_code_pages * c_code_page_bytes,
-          ap_data.get( ), g_data_pages * c_data_page_bytes,
-          g_call_stack_pages * c_call_stack_page_bytes, g_user_stack_pages * c_user_stack_page_bytes );
-      else if( cmd == "load" && !arg_1.empty( ) )
+         list_code( context );
+      else if( cmd == "verify" )
+         list_verified( context.code );
+      else if( cmd == "jit" )
       {
-         ifstream inpf( arg_1.c_str( ), ios::in | ios::binary );
-
-         if( !inpf )
-            cout << "error: unable to open '" << arg_1 << "' for input" << endl;
-         else
+         if( arg_1 == "on" )
+            use_jit = true;
+         else if( arg_1 == "off" )
          {
-            inpf.read( ( char* )&g_val, sizeof( g_val ) );
-            inpf.read( ( char* )&g_val1, sizeof( g_val1 ) );
-            inpf.read( ( char* )&g_balance, sizeof( g_balance ) );
-            inpf.read( ( char* )&g_first_call, sizeof( g_first_call ) );
-            inpf.read( ( char* )&g_increment_func, sizeof( g_increment_func ) );
-
-            inpf.read( ( char* )&state.pc, sizeof( state.pc ) );
-            inpf.read( ( char* )&state.cs, sizeof( state.cs ) );
-            inpf.read( ( char* )&state.us, sizeof( state.us ) );
-            inpf.read( ( char* )&state.pce, sizeof( state.pce ) );
-            inpf.read( ( char* )&state.pcs, sizeof( state.pcs ) );
-            inpf.read( ( char* )&state.steps, sizeof( state.steps ) );
-
-            inpf.read( ( char* )&state.a1, sizeof( state.a1 ) );
-            inpf.read( ( char* )&state.a2, sizeof( state.a2 ) );
-            inpf.read( ( char* )&state.a3, sizeof( state.a3 ) );
-            inpf.read( ( char* )&state.a4, sizeof( state.a4 ) );
-
-            inpf.read( ( char* )&state.b1, sizeof( state.b1 ) );
-            inpf.read( ( char* )&state.b2, sizeof( state.b2 ) );
-            inpf.read( ( char* )&state.b3, sizeof( state.b3 ) );
-            inpf.read( ( char* )&state.b4, sizeof( state.b4 ) );
-
-            inpf.read( ( char* )&g_code_pages, sizeof( g_code_pages ) );
-            ap_code.reset( new int8_t[ g_code_pages * c_code_page_bytes ] );
-
-            inpf.read( ( char* )ap_code.get( ), g_code_pages * c_code_page_bytes );
-
-            inpf.read( ( char* )&g_data_pages, sizeof( g_data_pages ) );
-            inpf.read( ( char* )&g_call_stack_pages, sizeof( g_call_stack_pages ) );
-            inpf.read( ( char* )&g_user_stack_pages, sizeof( g_user_stack_pages ) );
-
-            ap_data.reset( new int8_t[ g_data_pages * c_data_page_bytes
-            + g_call_stack_pages * c_call_stack_page_bytes + g_user_stack_pages * c_user_stack_page_bytes ] );
-
-            inpf.read( ( char* )ap_data.get( ), g_data_pages * c_data_page_bytes
-             + g_call_stack_pages * c_call_stack_page_bytes + g_user_stack_pages * c_user_stack_page_bytes );
-
-            g_function_data.clear( );
+            use_jit = false;
+            jit.release( );
+         }
 
-            size_t size;
-            inpf.read( ( char* )&size, sizeof( size_t ) );
+         cout << "jit: " << ( use_jit ? "on" : "off" ) << '\n';
+      }
+      else if( cmd == "aot" )
+      {
+         if( arg_1 == "on" )
+            use_aot = true;
+         else if( arg_1 == "off" )
+         {
+            use_aot = false;
+            aot.release( );
+         }
 
-            for( size_t i = 0; i < size; i++ )
+         cout << "aot: " << ( use_aot ? "on" : "off" ) << '\n';
+      }
+      else if( cmd == "trace" )
+      {
+         if( arg_1 == "dump" )
+            dump_trace( cout, arg_2.empty( ) ? c_trace_buffer_size : ( size_t )atoi( arg_2.c_str( ) ) );
+         else
+         {
+            if( arg_1 == "console" )
             {
-               int32_t func;
-               inpf.read( ( char* )&func, sizeof( int32_t ) );
-
-               bool loop;
-               inpf.read( ( char* )&loop, sizeof( bool ) );
-
-               size_t offset;
-               inpf.read( ( char* )&offset, sizeof( size_t ) );
-
-               g_function_data[ func ].loop = loop;
-               g_function_data[ func ].offset = offset;
+               if( arg_2 == "on" )
+                  g_trace_sink = trace_to_console;
+               else if( arg_2 == "off" )
+                  g_trace_sink = 0;
+            }
+            else if( !arg_1.empty( ) )
+            {
+               int level = -1;
+               int categories = g_trace_categories;
+
+               if( arg_1 == "off" )
+                  level = e_trace_level_none;
+               else if( arg_1 == "error" )
+                  level = e_trace_level_error;
+               else if( arg_1 == "info" )
+                  level = e_trace_level_info;
+               else if( arg_1 == "debug" )
+                  level = e_trace_level_debug;
+
+               if( arg_2 == "func" )
+                  categories = e_trace_category_func;
+               else if( arg_2 == "machine" )
+                  categories = e_trace_category_machine;
+               else if( arg_2 == "all" )
+                  categories = e_trace_category_all;
+               else if( !arg_2.empty( ) )
+                  level = -1;
+
+               if( level < 0 )
+                  cout << "error: invalid trace level or category" << endl;
+               else
+                  set_trace( level, categories );
+            }
 
-               size_t dsize;
-               inpf.read( ( char* )&dsize, sizeof( size_t ) );
+            const char* p_levels[ ] = { "off", "error", "info", "debug" };
 
-               for( size_t j = 0; j < dsize; j++ )
-               {
-                  int64_t next;
-                  inpf.read( ( char* )&next, sizeof( int64_t ) );
+            cout << "trace: " << p_levels[ g_trace_level ];
 
-                  g_function_data[ func ].data.push_back( next );
-               }
+            if( g_trace_level != e_trace_level_none )
+            {
+               if( g_trace_categories == e_trace_category_all )
+                  cout << " (all)";
+               else if( g_trace_categories == e_trace_category_func )
+                  cout << " (func)";
+               else
+                  cout << " (machine)";
             }
 
+            cout << " console: " << ( g_trace_sink ? "on" : "off" ) << '\n';
+         }
+      }
+      else if( cmd == "load" && !arg_1.empty( ) )
+      {
+         ifstream inpf( arg_1.c_str( ), ios::in | ios::binary );
+
+         if( !inpf )
+            cout << "error: unable to open '" << arg_1 << "' for input" << endl;
+         else
+         {
+            string buffer( ( istreambuf_iterator< char >( inpf ) ), istreambuf_iterator< char >( ) );
             inpf.close( );
 
-            list_code( state,
-             ap_code.get( ), g_code_pages * c_code_page_bytes,
-             ap_data.get( ), g_data_pages * c_data_page_bytes,
-             g_call_stack_pages * c_call_stack_page_bytes, g_user_stack_pages * c_user_stack_page_bytes, true );
+            // NOTE: A file is loaded as an AT image if it starts with the image magic.
+            if( is_image( buffer.data( ), buffer.size( ) ) )
+            {
+               if( !load_image( context, buffer.data( ), buffer.size( ) ) )
+                  cout << "error: invalid AT image '" << arg_1 << "'" << endl;
+            }
+            else
+            {
+               istringstream isstr( buffer );
+               load_context( context, isstr );
+            }
          }
       }
       else if( cmd == "save" && !arg_1.empty( ) )
@@ -2337,54 +9200,15 @@ int main( )
             cout << "error: unable to open '" << arg_1 << "' for output" << endl;
          else
          {
-            outf.write( ( const char* )&g_val, sizeof( g_val ) );
-            outf.write( ( const char* )&g_val1, sizeof( g_val1 ) );
-            outf.write( ( const char* )&g_balance, sizeof( g_balance ) );
-            outf.write( ( const char* )&g_first_call, sizeof( g_first_call ) );
-            outf.write( ( const char* )&g_increment_func, sizeof( g_increment_func ) );
-
-            outf.write( ( const char* )&state.pc, sizeof( state.pc ) );
-            outf.write( ( const char* )&state.cs, sizeof( state.cs ) );
-            outf.write( ( const char* )&state.us, sizeof( state.us ) );
-            outf.write( ( const char* )&state.pce, sizeof( state.pce ) );
-            outf.write( ( const char* )&state.pcs, sizeof( state.pcs ) );
-            outf.write( ( const char* )&state.steps, sizeof( state.steps ) );
-
-            outf.write( ( const char* )&state.a1, sizeof( state.a1 ) );
-            outf.write( ( const char* )&state.a2, sizeof( state.a2 ) );
-            outf.write( ( const char* )&state.a3, sizeof( state.a3 ) );
-            outf.write( ( const char* )&state.a4, sizeof( state.a4 ) );
-
-            outf.write( ( const char* )&state.b1, sizeof( state.b1 ) );
-            outf.write( ( const char* )&state.b2, sizeof( state.b2 ) );
-            outf.write( ( const char* )&state.b3, sizeof( state.b3 ) );
-            outf.write( ( const char* )&state.b4, sizeof( state.b4 ) );
-
-            outf.write( ( const char* )&g_code_pages, sizeof( g_code_pages ) );
-            outf.write( ( const char* )ap_code.get( ), g_code_pages * c_code_page_bytes );
-
-            outf.write( ( const char* )&g_data_pages, sizeof( g_data_pages ) );
-            outf.write( ( const char* )&g_call_stack_pages, sizeof( g_call_stack_pages ) );
-            outf.write( ( const char* )&g_user_stack_pages, sizeof( g_user_stack_pages ) );
-
-            outf.write( ( const char* )ap_data.get( ), g_data_pages * c_data_page_bytes
-             + g_call_stack_pages * c_call_stack_page_bytes + g_user_stack_pages * c_user_stack_page_bytes );
-
-            size_t size = g_function_data.size( );
-            outf.write( ( const char* )&size, sizeof( size_t ) );
-
-            for( map< int32_t, function_data >::iterator i = g_function_data.begin( ); i != g_function_data.end( ); ++i )
+            if( arg_2 == "image" )
             {
-               outf.write( ( const char* )&i->first, sizeof( int32_t ) );
-               outf.write( ( const char* )&i->second.loop, sizeof( bool ) );
-               outf.write( ( const char* )&i->second.offset, sizeof( size_t ) );
-
-               size_t dsize = i->second.data.size( );
-               outf.write( ( const char* )&dsize, sizeof( size_t ) );
+               string image;
+               save_image( context, image );
 
-               for( size_t j = 0; j < dsize; j++ )
-                  outf.write( ( const char* )&i->second.data[ j ], sizeof( int64_t ) );
+               outf.write( image.data( ), image.size( ) );
             }
+            else
+               save_context( context, outf );
 
             outf.close( );
          }
@@ -2394,20 +9218,20 @@ int main( )
          if( arg_1.empty( ) || arg_2.empty( ) )
          {
             if( arg_1.empty( ) || arg_1 == "code" )
-               cout << "code (" << g_code_pages << " * "
-                << c_code_page_bytes << ") = " << ( g_code_pages * c_code_page_bytes ) << " bytes\n";
+               cout << "code (" << context.code_pages << " * "
+                << c_code_page_bytes << ") = " << ( context.csize( ) ) << " bytes\n";
 
             if( arg_1.empty( ) || arg_1 == "data" )
-               cout << "data (" << g_data_pages << " * "
-                << c_data_page_bytes << ") = " << ( g_data_pages * c_data_page_bytes ) << " bytes\n";
+               cout << "data (" << context.data_pages << " * "
+                << c_data_page_bytes << ") = " << ( context.dsize( ) ) << " bytes\n";
 
             if( arg_1.empty( ) || arg_1 == "call" )
-               cout << "call (" << g_call_stack_pages << " * "
-                << c_call_stack_page_bytes << ") = " << ( g_call_stack_pages * c_call_stack_page_bytes ) << " bytes\n";
+               cout << "call (" << context.call_stack_pages << " * "
+                << c_call_stack_page_bytes << ") = " << ( context.cssize( ) ) << " bytes\n";
 
             if( arg_1.empty( ) || arg_1 == "user" )
-               cout << "user (" << g_user_stack_pages << " * "
-                << c_user_stack_page_bytes << ") = " << ( g_user_stack_pages * c_user_stack_page_bytes ) << " bytes\n";
+               cout << "user (" << context.user_stack_pages << " * "
+                << c_user_stack_page_bytes << ") = " << ( context.ussize( ) ) << " bytes\n";
          }
          else
          {
@@ -2417,29 +9241,25 @@ int main( )
 
             if( arg_1 == "code" )
             {
-               g_code_pages = pages;
-
-               ap_code.reset( new int8_t[ g_code_pages * c_code_page_bytes ] );
-
-               memset( ap_code.get( ), 0, g_code_pages * c_code_page_bytes );
+               context.code_pages = pages;
+               context.allocate_code( );
             }
             else
             {
                if( arg_1 == "data" )
-                  g_data_pages = pages;
+                  context.data_pages = pages;
                else if( arg_1 == "call" )
-                  g_call_stack_pages = pages;
+                  context.call_stack_pages = pages;
                else if( arg_1 == "user" )
-                  g_user_stack_pages = pages;
+                  context.user_stack_pages = pages;
                else
                   throw runtime_error( "unexpected arg_1 '" + arg_1 + "' for 'size' command" );
 
-               ap_data.reset( new int8_t[ g_data_pages * c_data_page_bytes
-               + g_call_stack_pages * c_call_stack_page_bytes + g_user_stack_pages * c_user_stack_page_bytes ] );
-
-               memset( ap_data.get( ), 0, g_data_pages * c_data_page_bytes
-                + g_call_stack_pages * c_call_stack_page_bytes + g_user_stack_pages * c_user_stack_page_bytes );
+               context.allocate_data( );
             }
+
+            decode_code( context.code, context.ap_code.get( ),
+             context.csize( ), context.dsize( ), context.cssize( ), context.ussize( ) );
          }
       }
       else if( cmd == "step" )
@@ -2450,37 +9270,53 @@ int main( )
          if( !arg_1.empty( ) )
             num_steps = atoi( arg_1.c_str( ) );
 
-         if( state.finished )
-            reset_machine( state,
-             ap_code.get( ), g_code_pages * c_code_page_bytes,
-             ap_data.get( ), g_data_pages * c_data_page_bytes,
-             g_call_stack_pages * c_call_stack_page_bytes, g_user_stack_pages * c_user_stack_page_bytes );
+         if( context.state.finished )
+            reset_machine( context );
+
+         const native_code* p_native = 0;
+
+         if( use_aot )
+         {
+            if( aot_compile( aot, context.code,
+             context.ap_code.get( ), context.cssize( ), context.ussize( ) ) )
+               p_native = &aot.native;
+            else
+               cout << "error: unable to compile aot code\n";
+         }
+         else if( use_jit && jit_compile( jit, context.code ) )
+            p_native = &jit.native;
 
          while( true )
          {
-            if( !check_has_balance( ) )
+            if( !check_has_balance( context ) )
                break;
 
-            int rc = process_op(
-             ap_code.get( ), g_code_pages * c_code_page_bytes,
-             ap_data.get( ), g_data_pages * c_data_page_bytes,
-             g_call_stack_pages * c_call_stack_page_bytes,
-             g_user_stack_pages * c_user_stack_page_bytes, false, false, state );
+            int32_t executed = 0;
+            int rc = run_native( p_native, context, get_max_steps( context, num_steps ? num_steps - steps : 1 ), executed );
 
-            if( !check_has_balance( ) )
+            context.balance -= executed - 1;
+            steps += executed - 1;
+
+            if( !check_has_balance( context ) )
                break;
 
-            --g_balance;
+            --context.balance;
 
             if( rc >= 0 )
             {
                ++steps;
-               if( state.stopped || state.finished || num_steps && steps >= num_steps )
+               if( context.state.stopped || context.state.finished
+                || is_sleeping( context ) || num_steps && steps >= num_steps )
                {
-                  if( state.stopped )
+                  if( context.state.stopped )
                      cout << "(stopped)\n";
-                  else if( state.finished )
+                  else if( context.state.finished )
                      cout << "(finished)\n";
+                  else if( is_sleeping( context ) )
+                  {
+                     cout << "(sleeping until block " << dec << context.state.sleep_until << ")\n";
+                     context.height = context.state.sleep_until;
+                  }
 
                   break;
                }
@@ -2525,19 +9361,26 @@ int main( )
          }
       }
       else if( cmd == "reset" )
-         reset_machine( state,
-          ap_code.get( ), g_code_pages * c_code_page_bytes,
-          ap_data.get( ), g_data_pages * c_data_page_bytes,
-          g_call_stack_pages * c_call_stack_page_bytes, g_user_stack_pages * c_user_stack_page_bytes );
+         reset_machine( context );
       else if( cmd == "state" )
-         dump_state( state );
+         dump_state( context.state );
       else if( cmd == "balance" )
       {
          if( arg_1.empty( ) )
-            cout << dec << g_balance << '\n';
+            cout << dec << context.balance << '\n';
          else
-            g_balance = atoi( arg_1.c_str( ) );
+            context.balance = atoi( arg_1.c_str( ) );
+      }
+      else if( cmd == "hash" )
+      {
+         string hash( context.get_state_hash( ) );
+
+         cout << hash << " (hashed " << dec << context.state_hash.num_hashed << " nodes)\n";
       }
+      else if( cmd == "bench" && arg_1 == "math" )
+         bench_wide_math( atoi( arg_2.c_str( ) ) );
+      else if( cmd == "bench" && !arg_1.empty( ) )
+         bench_block_executor( atoi( arg_1.c_str( ) ), atoi( arg_2.c_str( ) ) );
       else if( cmd == "function" && !arg_1.empty( ) )
       {
          bool is_increment_func = false;
@@ -2550,10 +9393,10 @@ int main( )
          int32_t func = atoi( arg_1.c_str( ) );
 
          if( is_increment_func )
-            g_increment_func = func;
+            context.increment_func = func;
 
-         if( ( !is_increment_func || !arg_2.empty( ) ) && g_function_data.count( func ) )
-            g_function_data.erase( func );
+         if( ( !is_increment_func || !arg_2.empty( ) ) && context.func_data.count( func ) )
+            context.func_data.erase( func );
 
          if( !arg_2.empty( ) )
          {
@@ -2572,7 +9415,7 @@ int main( )
                else
                   val = atoi( next.c_str( ) );
 
-               g_function_data[ func ].data.push_back( val );
+               context.func_data[ func ].data.push_back( val );
 
                if( pos == string::npos )
                   break;
@@ -2581,14 +9424,14 @@ int main( )
             }
 
             if( arg_3 == "true" )
-               g_function_data[ func ].loop = true;
+               context.func_data[ func ].loop = true;
          }
       }
       else if( cmd == "functions" )
       {
-         for( map< int32_t, function_data >::iterator i = g_function_data.begin( ); i != g_function_data.end( ); ++i )
+         for( map< int32_t, function_data >::iterator i = context.func_data.begin( ); i != context.func_data.end( ); ++i )
          {
-            if( i->first == g_increment_func )
+            if( i->first == context.increment_func )
                cout << '+';
             else
                cout << ' ';
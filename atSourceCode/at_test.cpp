@@ -0,0 +1,288 @@
+// NOTE: Tests for the parts of the AT simulator that can't be exercised from the REPL (see the basic
+// test cases in "at.cpp" for those that can). To build and run:
+//
+// g++ -o at_test at_test.cpp -ldl -lpthread && ./at_test
+
+#define main at_main
+#include "at.cpp"
+#undef main
+
+// NOTE: An AT that stops (with its balance) and one (with a higher id) that then pays it in the same
+// block. The payment arrived after the first AT had stopped so must wake it.
+bool check_stopped_at_paid_in_same_block( )
+{
+   at_context first, second;
+
+   first.id = 1;
+   first.balance = 999;
+
+   int8_t* p_code = first.ap_code.get( );
+
+   p_code[ 0 ] = e_op_code_STP_IMD;
+
+   reset_machine( first );
+
+   second.id = 2;
+   second.balance = 10000;
+
+   p_code = second.ap_code.get( );
+
+   p_code[ 0 ] = e_op_code_EXT_FUN_DAT_2;
+   *( int16_t* )( p_code + 1 ) = 31;
+   *( int32_t* )( p_code + 3 ) = 0;
+   *( int32_t* )( p_code + 7 ) = 1;
+   p_code[ 11 ] = e_op_code_FIN_IMD;
+
+   reset_machine( second );
+
+   int64_t* p_data = ( int64_t* )second.ap_data.get( );
+
+   p_data[ 0 ] = 500;
+   p_data[ 1 ] = first.id;
+
+   second.mark_all_dirty( );
+
+   at_runtime runtime( 1 );
+
+   runtime.add( &first );
+   runtime.add( &second );
+
+   vector< at_payment > payments;
+   runtime.process_block( 1000, payments );
+
+   if( payments.size( ) != 1 || !runtime.stopped.count( first.id ) )
+      return false;
+
+   int64_t stopped_at = runtime.stopped[ first.id ];
+
+   if( stopped_at != first.balance - 500 || !runtime.waking.count( first.id ) )
+      return false;
+
+   int32_t steps = first.state.steps;
+
+   runtime.process_block( 1000, payments );
+
+   return first.state.steps > steps;
+}
+
+// NOTE: A SLP_DAT whose address is within the code but not within the data must fail (rather than
+// reading past the end of the data).
+bool check_sleep_address_outside_of_data( )
+{
+   at_context context;
+
+   context.code_pages = 64;
+   context.allocate_code( );
+
+   int8_t* p_code = context.ap_code.get( );
+
+   p_code[ 0 ] = e_op_code_SLP_DAT;
+   *( int32_t* )( p_code + 1 ) = 0x3f0;
+   p_code[ 5 ] = e_op_code_FIN_IMD;
+
+   reset_machine( context );
+
+   if( run_block( context, 10 ) != -1 || context.state.sleep_until )
+      return false;
+
+   reset_machine( context );
+
+   return process_op( context, false ) == -1 && !context.state.sleep_until;
+}
+
+// NOTE: An AT that polls for a tx and then sleeps until a deadline (with SLP_DAT) must be woken at
+// that deadline even though no tx has arrived (whereas one that just polls and then sleeps with
+// SLP_IMD is left waiting for a tx).
+bool check_deadline_sleeper_without_txs( )
+{
+   at_context sleeper, poller;
+
+   sleeper.id = 1;
+
+   int8_t* p_code = sleeper.ap_code.get( );
+
+   p_code[ 0 ] = e_op_code_EXT_FUN_DAT;
+   *( int16_t* )( p_code + 1 ) = 0x0304;
+   *( int32_t* )( p_code + 3 ) = 0;
+   p_code[ 7 ] = e_op_code_INC_DAT;
+   *( int32_t* )( p_code + 8 ) = 1;
+   p_code[ 12 ] = e_op_code_SLP_DAT;
+   *( int32_t* )( p_code + 13 ) = 2;
+   p_code[ 17 ] = e_op_code_JMP_ADR;
+   *( int32_t* )( p_code + 18 ) = 0;
+
+   reset_machine( sleeper );
+
+   int64_t* p_data = ( int64_t* )sleeper.ap_data.get( );
+
+   p_data[ 2 ] = ( int64_t )5 << 32;
+
+   sleeper.mark_all_dirty( );
+
+   poller.id = 2;
+
+   p_code = poller.ap_code.get( );
+
+   p_code[ 0 ] = e_op_code_EXT_FUN_DAT;
+   *( int16_t* )( p_code + 1 ) = 0x0304;
+   *( int32_t* )( p_code + 3 ) = 0;
+   p_code[ 7 ] = e_op_code_SLP_IMD;
+   p_code[ 8 ] = e_op_code_JMP_ADR;
+   *( int32_t* )( p_code + 9 ) = 0;
+
+   reset_machine( poller );
+
+   at_runtime runtime( 1 );
+
+   runtime.add( &sleeper );
+   runtime.add( &poller );
+
+   vector< at_payment > payments;
+
+   for( int i = 0; i < 10; i++ )
+      runtime.process_block( 1000, payments );
+
+   // NOTE: Run at height 0 and then at each height from 5 to 9.
+   return p_data[ 1 ] == 6 && !runtime.waiting.count( sleeper.id ) && runtime.waiting.count( poller.id );
+}
+
+// NOTE: A call to a function that might change the balance must not be fused with a following BZR
+// (whereas a call to a function that keeps the balance is).
+int64_t test_spend( at_context& context, int32_t, int64_t, int64_t )
+{
+   --context.balance;
+
+   return 0;
+}
+
+bool check_balance_changing_call_is_not_fused( )
+{
+   register_function( 0x0500, "Spend", e_op_code_EXT_FUN_RET, test_spend );
+
+   at_context context;
+
+   int8_t* p_code = context.ap_code.get( );
+
+   p_code[ 0 ] = e_op_code_EXT_FUN_RET;
+   *( int16_t* )( p_code + 1 ) = 0x0100;
+   *( int32_t* )( p_code + 3 ) = 0;
+   p_code[ 7 ] = e_op_code_BZR_DAT;
+   *( int32_t* )( p_code + 8 ) = 0;
+   p_code[ 12 ] = 6;
+   p_code[ 13 ] = e_op_code_EXT_FUN_RET;
+   *( int16_t* )( p_code + 14 ) = 0x0500;
+   *( int32_t* )( p_code + 16 ) = 0;
+   p_code[ 20 ] = e_op_code_BZR_DAT;
+   *( int32_t* )( p_code + 21 ) = 0;
+   p_code[ 25 ] = 6;
+   p_code[ 26 ] = e_op_code_FIN_IMD;
+
+   reset_machine( context );
+
+   const decoded_code& code( context.get_code( ) );
+
+   return code.ops.size( ) >= 4 && code.ops[ 0 ].fused == 2 && code.ops[ 2 ].fused == 0;
+}
+
+#ifdef AT_STORE
+// NOTE: A store whose header has an index capacity that is not a power of two must not be opened
+// and an AT must not be attached to a record whose page counts or state are not valid.
+bool check_corrupt_store_is_rejected( )
+{
+   const char* p_file_name = "at_test.store";
+
+   unlink( p_file_name );
+
+   at_image_store store;
+
+   if( !store.open( p_file_name, 16 ) )
+      return false;
+
+   at_context context;
+
+   context.id = 1;
+   store.add( context );
+
+   store.close( );
+
+   int fd = open( p_file_name, O_RDWR );
+
+   if( fd < 0 )
+      return false;
+
+   store_header hdr;
+   store_index_entry entry;
+
+   // NOTE: The only record is in the index slot that its id hashes to.
+   size_t slot = ( ( uint64_t )context.id * 0x9e3779b97f4a7c15ULL ) >> 20 & 15;
+
+   bool okay = pread( fd, &hdr, sizeof( hdr ), 0 ) == sizeof( hdr )
+    && pread( fd, &entry, sizeof( entry ), c_store_header_bytes + slot * sizeof( entry ) ) == sizeof( entry );
+
+   if( okay && entry.offset )
+   {
+      off_t capacity_offset = offsetof( store_header, index_capacity );
+
+      uint64_t capacity = hdr.index_capacity - 1;
+      okay = pwrite( fd, &capacity, sizeof( capacity ), capacity_offset ) == sizeof( capacity )
+       && !store.open( p_file_name );
+
+      capacity = hdr.index_capacity;
+      okay = okay && pwrite( fd, &capacity, sizeof( capacity ), capacity_offset ) == sizeof( capacity );
+
+      uint16_t data_pages = 0xffff;
+      okay = okay && pwrite( fd, &data_pages, sizeof( data_pages ),
+       entry.offset + offsetof( store_record, data_pages ) ) == sizeof( data_pages );
+
+      at_context attached;
+
+      okay = okay && store.open( p_file_name ) && !store.attach( attached, 1 ) && attached.ap_data.is_owned( );
+   }
+   else
+      okay = false;
+
+   store.close( );
+
+   close( fd );
+   unlink( p_file_name );
+
+   return okay;
+}
+#endif
+
+struct test_case
+{
+   const char* p_name;
+   bool ( *p_test )( );
+};
+
+int main( )
+{
+   g_trace_sink = 0;
+   set_trace( e_trace_level_none, e_trace_category_all );
+
+   test_case tests[ ] =
+   {
+      { "stopped_at_paid_in_same_block", check_stopped_at_paid_in_same_block },
+      { "sleep_address_outside_of_data", check_sleep_address_outside_of_data },
+      { "deadline_sleeper_without_txs", check_deadline_sleeper_without_txs },
+      { "balance_changing_call_is_not_fused", check_balance_changing_call_is_not_fused },
+#ifdef AT_STORE
+      { "corrupt_store_is_rejected", check_corrupt_store_is_rejected }
+#endif
+   };
+
+   int failures = 0;
+
+   for( size_t i = 0; i < sizeof( tests ) / sizeof( tests[ 0 ] ); i++ )
+   {
+      bool passed = ( *tests[ i ].p_test )( );
+
+      cout << ( passed ? "passed: " : "FAILED: " ) << tests[ i ].p_name << '\n';
+
+      if( !passed )
+         ++failures;
+   }
+
+   return failures;
+}